@@ -0,0 +1,552 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * BTree.cpp
+ * Implementation for the BTree username index.
+ */
+
+#include "btree.h"
+#include "utree.h"
+#include "outputsink.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/**
+ * Packs the first eight bytes of a key into an integer that orders the same
+ * way the bytes do. Shorter keys are padded with zeros.
+ */
+uint64_t BTree::prefix(std::string_view key)
+{
+    unsigned char bytes[8] = {0};
+    memcpy(bytes, key.data(), std::min<size_t>(key.size(), 8));
+
+    uint64_t packed = 0;
+    for (int i = 0; i < 8; i++)
+        packed = (packed << 8) | bytes[i];
+    return packed;
+}
+/**
+ * Username of the UNode in a leaf slot.
+ */
+const std::string &BTree::key(const BTreeLeaf *leaf, int slot)
+{
+    return *leaf->users[slot]->_username;
+}
+/**
+ * Index of the child of an inner node whose subtree may hold key.
+ */
+int BTree::childFor(const BTreeInner *node, std::string_view key, uint64_t keyPrefix)
+{
+    int child = 0;
+    while (child < node->count - 1 &&
+           (node->prefixes[child] < keyPrefix || (node->prefixes[child] == keyPrefix && key.compare(*node->keys[child]) >= 0)))
+        child++;
+    return child;
+}
+/**
+ * Index of the first slot of a leaf whose username is not less than key.
+ */
+int BTree::slotFor(const BTreeLeaf *leaf, std::string_view key, uint64_t keyPrefix)
+{
+    int slot = 0;
+    while (slot < leaf->count &&
+           (leaf->prefixes[slot] < keyPrefix || (leaf->prefixes[slot] == keyPrefix && key.compare(BTree::key(leaf, slot)) > 0)))
+        slot++;
+    return slot;
+}
+/**
+ * Walks from the root to the leaf that may hold key.
+ * @param path if not nullptr, receives the inner node and child taken at every level
+ * @return the leaf, nullptr if the tree is empty
+ */
+BTreeLeaf *BTree::descend(std::string_view key, uint64_t keyPrefix, Step *path) const
+{
+    BTreeNode *node = _root;
+    for (int level = 0; node != nullptr && !node->leaf; level++)
+    {
+        BTreeInner *inner = static_cast<BTreeInner *>(node);
+        int child = childFor(inner, key, keyPrefix);
+        if (path != nullptr)
+            path[level] = {inner, child};
+        node = inner->children[child];
+    }
+    return static_cast<BTreeLeaf *>(node);
+}
+
+/**
+ * Finds the UNode of a username.
+ * @param username username to match
+ * @return the UNode, nullptr if there is none
+ */
+UNode *BTree::find(std::string_view username) const
+{
+    uint64_t keyPrefix = prefix(username);
+    BTreeLeaf *leaf = descend(username, keyPrefix, nullptr);
+    if (leaf == nullptr)
+        return nullptr;
+
+    int slot = slotFor(leaf, username, keyPrefix);
+    if (slot == leaf->count || leaf->prefixes[slot] != keyPrefix || key(leaf, slot) != username)
+        return nullptr;
+    return leaf->users[slot];
+}
+
+/**
+ * Finds the UNodes of several usernames at once. Every descent has the same
+ * length, so they advance together one level at a time, each prefetching the
+ * prefixes of its next node so that the cache misses overlap.
+ * @param usernames usernames to match
+ * @param count number of usernames, at most BATCH_GROUP
+ * @param results receives each UNode, or nullptr if there is none
+ */
+void BTree::findBatch(const std::string_view *usernames, int count, UNode **results) const
+{
+    const BTreeNode *nodes[BATCH_GROUP];
+    uint64_t keyPrefixes[BATCH_GROUP];
+    for (int i = 0; i < count; i++)
+    {
+        results[i] = nullptr;
+        keyPrefixes[i] = prefix(usernames[i]);
+        nodes[i] = _root;
+    }
+    if (_root == nullptr)
+        return;
+
+    for (int level = 0; level < _height; level++)
+        for (int i = 0; i < count; i++)
+        {
+            const BTreeInner *inner = static_cast<const BTreeInner *>(nodes[i]);
+            nodes[i] = inner->children[childFor(inner, usernames[i], keyPrefixes[i])];
+            for (size_t line = 0; line < offsetof(BTreeNode, prefixes) + sizeof(nodes[i]->prefixes); line += 64)
+                __builtin_prefetch(reinterpret_cast<const char *>(nodes[i]) + line);
+        }
+
+    for (int i = 0; i < count; i++)
+    {
+        const BTreeLeaf *leaf = static_cast<const BTreeLeaf *>(nodes[i]);
+        int slot = slotFor(leaf, usernames[i], keyPrefixes[i]);
+        if (slot < leaf->count && leaf->prefixes[slot] == keyPrefixes[i] && key(leaf, slot) == usernames[i])
+            results[i] = leaf->users[slot];
+    }
+}
+
+/**
+ * Adds a UNode under its username.
+ * @param user UNode to add, its username must be set
+ * @return true if it was added, false if the username is already present
+ */
+bool BTree::insert(UNode *user)
+{
+    std::string_view username = *user->_username;
+    uint64_t keyPrefix = prefix(username);
+
+    if (_root == nullptr)
+    {
+        BTreeLeaf *leaf = new BTreeLeaf();
+        leaf->leaf = true;
+        leaf->count = 1;
+        leaf->prefixes[0] = keyPrefix;
+        leaf->users[0] = user;
+        leaf->prev = leaf->next = nullptr;
+        _root = leaf;
+        _height = 0;
+        _size = 1;
+        return true;
+    }
+
+    Step path[BTREE_MAX_HEIGHT];
+    BTreeLeaf *leaf = descend(username, keyPrefix, path);
+    int slot = slotFor(leaf, username, keyPrefix);
+    if (slot < leaf->count && leaf->prefixes[slot] == keyPrefix && key(leaf, slot) == username)
+        return false;
+    _size++;
+
+    if (leaf->count < BTREE_FANOUT)
+    {
+        memmove(&leaf->prefixes[slot + 1], &leaf->prefixes[slot], (leaf->count - slot) * sizeof(uint64_t));
+        memmove(&leaf->users[slot + 1], &leaf->users[slot], (leaf->count - slot) * sizeof(UNode *));
+        leaf->prefixes[slot] = keyPrefix;
+        leaf->users[slot] = user;
+        leaf->count++;
+        return true;
+    }
+
+    /* Split the full leaf. Appending past the last leaf leaves it full, so
+     * ascending inserts pack the leaves instead of half-filling them. */
+    uint64_t prefixes[BTREE_FANOUT + 1];
+    UNode *users[BTREE_FANOUT + 1];
+    memcpy(prefixes, leaf->prefixes, slot * sizeof(uint64_t));
+    memcpy(users, leaf->users, slot * sizeof(UNode *));
+    prefixes[slot] = keyPrefix;
+    users[slot] = user;
+    memcpy(&prefixes[slot + 1], &leaf->prefixes[slot], (BTREE_FANOUT - slot) * sizeof(uint64_t));
+    memcpy(&users[slot + 1], &leaf->users[slot], (BTREE_FANOUT - slot) * sizeof(UNode *));
+
+    int keep = (slot == BTREE_FANOUT && leaf->next == nullptr) ? BTREE_FANOUT : (BTREE_FANOUT + 1) / 2;
+    BTreeLeaf *right = new BTreeLeaf();
+    right->leaf = true;
+    right->count = BTREE_FANOUT + 1 - keep;
+    memcpy(right->prefixes, &prefixes[keep], right->count * sizeof(uint64_t));
+    memcpy(right->users, &users[keep], right->count * sizeof(UNode *));
+    leaf->count = keep;
+    memcpy(leaf->prefixes, prefixes, keep * sizeof(uint64_t));
+    memcpy(leaf->users, users, keep * sizeof(UNode *));
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr)
+        leaf->next->prev = right;
+    leaf->next = right;
+
+    insertSeparator(path, _height - 1, right->users[0]->_username, right);
+    return true;
+}
+/**
+ * Helper funtion for insert, adds a new right sibling to the parent at
+ * path[depth], splitting inner nodes up the path as needed.
+ * @param separator smallest username under right
+ */
+void BTree::insertSeparator(Step *path, int depth, const std::string *separator, BTreeNode *right)
+{
+    for (; depth >= 0; depth--)
+    {
+        BTreeInner *node = path[depth].node;
+        int at = path[depth].child; /* separator goes to keys[at], right to children[at + 1] */
+
+        if (node->count < BTREE_FANOUT)
+        {
+            int moved = node->count - 1 - at;
+            memmove(&node->prefixes[at + 1], &node->prefixes[at], moved * sizeof(uint64_t));
+            memmove(&node->keys[at + 1], &node->keys[at], moved * sizeof(std::string *));
+            memmove(&node->children[at + 2], &node->children[at + 1], moved * sizeof(BTreeNode *));
+            node->prefixes[at] = prefix(*separator);
+            node->keys[at] = separator;
+            node->children[at + 1] = right;
+            node->count++;
+            return;
+        }
+
+        /* Split the full node: the middle separator moves up to the parent */
+        const std::string *keys[BTREE_FANOUT];
+        BTreeNode *children[BTREE_FANOUT + 1];
+        for (int i = 0, j = 0; i < BTREE_FANOUT; i++)
+        {
+            if (i == at)
+                keys[j++] = separator;
+            if (i < BTREE_FANOUT - 1)
+                keys[j++] = node->keys[i];
+        }
+        for (int i = 0, j = 0; i < BTREE_FANOUT; i++)
+        {
+            children[j++] = node->children[i];
+            if (i == at)
+                children[j++] = right;
+        }
+
+        int keep = (BTREE_FANOUT + 1) / 2;
+        BTreeInner *sibling = new BTreeInner();
+        sibling->leaf = false;
+        sibling->count = BTREE_FANOUT + 1 - keep;
+        for (int i = 0; i < sibling->count; i++)
+            sibling->children[i] = children[keep + i];
+        for (int i = 0; i < sibling->count - 1; i++)
+        {
+            sibling->keys[i] = keys[keep + i];
+            sibling->prefixes[i] = prefix(*keys[keep + i]);
+        }
+        node->count = keep;
+        for (int i = 0; i < keep; i++)
+            node->children[i] = children[i];
+        for (int i = 0; i < keep - 1; i++)
+        {
+            node->keys[i] = keys[i];
+            node->prefixes[i] = prefix(*keys[i]);
+        }
+
+        separator = keys[keep - 1];
+        right = sibling;
+    }
+
+    /* The root split, the tree grows a level */
+    BTreeInner *root = new BTreeInner();
+    root->leaf = false;
+    root->count = 2;
+    root->children[0] = _root;
+    root->children[1] = right;
+    root->keys[0] = separator;
+    root->prefixes[0] = prefix(*separator);
+    _root = root;
+    _height++;
+}
+
+/**
+ * Removes the UNode of a username from the index, without deleting it.
+ * @param username username to match
+ * @return the UNode, nullptr if there is none
+ */
+UNode *BTree::erase(std::string_view username)
+{
+    uint64_t keyPrefix = prefix(username);
+    Step path[BTREE_MAX_HEIGHT];
+    BTreeLeaf *leaf = descend(username, keyPrefix, path);
+    if (leaf == nullptr)
+        return nullptr;
+
+    int slot = slotFor(leaf, username, keyPrefix);
+    if (slot == leaf->count || leaf->prefixes[slot] != keyPrefix || key(leaf, slot) != username)
+        return nullptr;
+
+    UNode *user = leaf->users[slot];
+    _size--;
+    leaf->count--;
+    memmove(&leaf->prefixes[slot], &leaf->prefixes[slot + 1], (leaf->count - slot) * sizeof(uint64_t));
+    memmove(&leaf->users[slot], &leaf->users[slot + 1], (leaf->count - slot) * sizeof(UNode *));
+    if (leaf->count > 0)
+        return user;
+
+    /* The leaf is empty: unlink it from the chain and from its parent */
+    if (leaf->prev != nullptr)
+        leaf->prev->next = leaf->next;
+    if (leaf->next != nullptr)
+        leaf->next->prev = leaf->prev;
+    delete leaf;
+    removeChild(path, _height - 1);
+    return user;
+}
+/**
+ * Helper funtion for erase, drops the child at path[depth] after it was
+ * freed. Parents left without children are freed in turn, and a root with
+ * a single child is replaced by that child.
+ */
+void BTree::removeChild(Step *path, int depth)
+{
+    for (; depth >= 0; depth--)
+    {
+        BTreeInner *node = path[depth].node;
+        int child = path[depth].child;
+        if (node->count > 1)
+        {
+            /* children[child] goes with the separator on its left, or the
+             * one on its right if it is the first child */
+            int key = (child == 0) ? 0 : child - 1;
+            memmove(&node->prefixes[key], &node->prefixes[key + 1], (node->count - 2 - key) * sizeof(uint64_t));
+            memmove(&node->keys[key], &node->keys[key + 1], (node->count - 2 - key) * sizeof(std::string *));
+            memmove(&node->children[child], &node->children[child + 1], (node->count - 1 - child) * sizeof(BTreeNode *));
+            node->count--;
+            break;
+        }
+        delete node;
+    }
+    if (depth < 0)
+    {
+        _root = nullptr;
+        _height = -1;
+        return;
+    }
+
+    while (!_root->leaf && _root->count == 1)
+    {
+        BTreeInner *root = static_cast<BTreeInner *>(_root);
+        _root = root->children[0];
+        delete root;
+        _height--;
+    }
+}
+
+/**
+ * Replaces the contents of the index with UNodes already sorted by
+ * username, filling every node completely, level by level.
+ * @param users UNodes with strictly increasing usernames
+ * @param count number of UNodes
+ */
+void BTree::buildSorted(UNode *const *users, int count)
+{
+    clear();
+    if (count == 0)
+        return;
+
+    /* Each node of the level being built, with the smallest username under it */
+    std::vector<BTreeNode *> level;
+    std::vector<const std::string *> smallest;
+    BTreeLeaf *prev = nullptr;
+    for (int i = 0; i < count; i += BTREE_FANOUT)
+    {
+        BTreeLeaf *leaf = new BTreeLeaf();
+        leaf->leaf = true;
+        leaf->count = std::min(BTREE_FANOUT, count - i);
+        for (int j = 0; j < leaf->count; j++)
+        {
+            leaf->users[j] = users[i + j];
+            leaf->prefixes[j] = prefix(*users[i + j]->_username);
+        }
+        leaf->prev = prev;
+        leaf->next = nullptr;
+        if (prev != nullptr)
+            prev->next = leaf;
+        prev = leaf;
+        level.push_back(leaf);
+        smallest.push_back(users[i]->_username);
+    }
+
+    _height = 0;
+    while (level.size() > 1)
+    {
+        std::vector<BTreeNode *> parents;
+        std::vector<const std::string *> parentSmallest;
+        for (size_t i = 0; i < level.size(); i += BTREE_FANOUT)
+        {
+            BTreeInner *node = new BTreeInner();
+            node->leaf = false;
+            node->count = std::min<size_t>(BTREE_FANOUT, level.size() - i);
+            for (int j = 0; j < node->count; j++)
+            {
+                node->children[j] = level[i + j];
+                if (j > 0)
+                {
+                    node->keys[j - 1] = smallest[i + j];
+                    node->prefixes[j - 1] = prefix(*smallest[i + j]);
+                }
+            }
+            parents.push_back(node);
+            parentSmallest.push_back(smallest[i]);
+        }
+        level = std::move(parents);
+        smallest = std::move(parentSmallest);
+        _height++;
+    }
+
+    _root = level[0];
+    _size = count;
+}
+
+/**
+ * Frees every node of the index. The UNodes are left alone.
+ */
+void BTree::clear()
+{
+    helpClear(_root);
+    _root = nullptr;
+    _size = 0;
+    _height = -1;
+}
+/**
+ * Helper funtion for clear.
+ */
+void BTree::helpClear(BTreeNode *node)
+{
+    if (node == nullptr)
+        return;
+    if (node->leaf)
+    {
+        delete static_cast<BTreeLeaf *>(node);
+        return;
+    }
+
+    BTreeInner *inner = static_cast<BTreeInner *>(node);
+    for (int i = 0; i < inner->count; i++)
+        helpClear(inner->children[i]);
+    delete inner;
+}
+
+/**
+ * Position of the smallest username.
+ */
+BTree::Position BTree::first() const
+{
+    BTreeNode *node = _root;
+    while (node != nullptr && !node->leaf)
+        node = static_cast<BTreeInner *>(node)->children[0];
+    return {static_cast<BTreeLeaf *>(node), 0};
+}
+/**
+ * Position of the largest username.
+ */
+BTree::Position BTree::last() const
+{
+    BTreeNode *node = _root;
+    while (node != nullptr && !node->leaf)
+        node = static_cast<BTreeInner *>(node)->children[node->count - 1];
+    if (node == nullptr)
+        return {};
+    return {static_cast<BTreeLeaf *>(node), node->count - 1};
+}
+/**
+ * Position of the first username not less than username.
+ */
+BTree::Position BTree::lowerBound(std::string_view username) const
+{
+    uint64_t keyPrefix = prefix(username);
+    Position position = {descend(username, keyPrefix, nullptr), 0};
+    if (!position.valid())
+        return position;
+
+    position.slot = slotFor(position.leaf, username, keyPrefix);
+    if (position.slot == position.leaf->count)
+    {
+        position.leaf = position.leaf->next;
+        position.slot = 0;
+    }
+    return position;
+}
+/**
+ * Moves to the next username; the position becomes invalid past the end.
+ */
+void BTree::Position::next()
+{
+    if (++slot < leaf->count)
+        return;
+    leaf = leaf->next;
+    slot = 0;
+}
+/**
+ * Moves to the previous username; the position becomes invalid past the start.
+ */
+void BTree::Position::prev()
+{
+    if (--slot >= 0)
+        return;
+    leaf = leaf->prev;
+    slot = (leaf == nullptr) ? 0 : leaf->count - 1;
+}
+
+/**
+ * Dumps the index with every node in '[]', leaves listing username:numUsers.
+ */
+void BTree::dump() const
+{
+    StreamSink out(cout);
+    dump(out);
+}
+/**
+ * Dumps the BTree in the '[]' notation to a sink.
+ * @param out sink receiving the text
+ */
+void BTree::dump(OutputSink &out) const
+{
+    helpDump(_root, out);
+}
+/**
+ * Helper funtion for dump.
+ */
+void BTree::helpDump(const BTreeNode *node, OutputSink &out) const
+{
+    if (node == nullptr)
+        return;
+
+    out << '[';
+    for (int i = 0; i < node->count; i++)
+    {
+        if (i > 0)
+            out << ' ';
+        if (node->leaf)
+        {
+            UNode *user = static_cast<const BTreeLeaf *>(node)->users[i];
+            out << user->getUsername() << ':' << user->getDTree()->getNumUsers();
+        }
+        else
+            helpDump(static_cast<const BTreeInner *>(node)->children[i], out);
+    }
+    out << ']';
+}
@@ -0,0 +1,126 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * BTree.h
+ * An interface for the BTree username index.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#define BTREE_FANOUT 16     /* keys per node; 16 inline prefixes fill two cache lines */
+#define BTREE_MAX_HEIGHT 16 /* splits leave at least FANOUT / 2 children, so 8^16 users */
+
+class Tester; /* Forward declaration for testing class */
+class UNode;
+class OutputSink;
+
+/**
+ * Header shared by both kinds of BTree node. prefixes[i] holds the first
+ * eight bytes of the i-th key, big-endian, so most comparisons made while
+ * searching a node never leave it.
+ */
+struct BTreeNode
+{
+    int count; /* keys in a leaf, children in an inner node */
+    bool leaf;
+    uint64_t prefixes[BTREE_FANOUT];
+};
+
+/**
+ * Leaf of a BTree: the UNodes themselves, sorted by username, with links to
+ * the neighbouring leaves.
+ */
+struct BTreeLeaf : BTreeNode
+{
+    UNode *users[BTREE_FANOUT];
+    BTreeLeaf *prev;
+    BTreeLeaf *next;
+};
+
+/**
+ * Inner node of a BTree. keys[i] is the smallest username under
+ * children[i + 1], for i < count - 1.
+ */
+struct BTreeInner : BTreeNode
+{
+    const std::string *keys[BTREE_FANOUT]; /* interned usernames */
+    BTreeNode *children[BTREE_FANOUT];
+};
+
+/**
+ * B+-tree mapping usernames to UNodes, an alternative to linking the UNodes
+ * into an AVL tree. A lookup reads a few wide nodes instead of chasing one
+ * pointer per level of a binary tree. The BTree owns its nodes but not the
+ * UNodes. Removal frees a node only once it is empty, without merging
+ * half-empty neighbours.
+ */
+class BTree
+{
+    friend class Tester;
+
+public:
+    /**
+     * Position of a UNode in the leaf chain, invalid past either end.
+     */
+    struct Position
+    {
+        BTreeLeaf *leaf = nullptr;
+        int slot = 0;
+
+        bool valid() const { return leaf != nullptr; }
+        UNode *get() const { return leaf->users[slot]; }
+        void next();
+        void prev();
+        bool operator==(const Position &rhs) const { return leaf == rhs.leaf && (leaf == nullptr || slot == rhs.slot); }
+        bool operator!=(const Position &rhs) const { return !(*this == rhs); }
+    };
+
+    BTree() : _root(nullptr), _size(0), _height(-1) {}
+    ~BTree() { clear(); }
+
+    BTree(const BTree &) = delete;
+    BTree &operator=(const BTree &) = delete;
+
+    UNode *find(std::string_view username) const;
+    void findBatch(const std::string_view *usernames, int count, UNode **results) const;
+    bool insert(UNode *user);
+    UNode *erase(std::string_view username);
+    void buildSorted(UNode *const *users, int count);
+    void clear();
+
+    Position first() const;
+    Position last() const;
+    Position lowerBound(std::string_view username) const;
+
+    int size() const { return _size; }
+    int getHeight() const { return _height; }
+    void dump() const;
+    void dump(OutputSink &out) const;
+
+private:
+    /* An inner node and the child followed from it */
+    struct Step
+    {
+        BTreeInner *node;
+        int child;
+    };
+
+    BTreeNode *_root;
+    int _size;
+    int _height; /* -1 when empty, 0 when the root is a leaf */
+
+    static uint64_t prefix(std::string_view key);
+    static const std::string &key(const BTreeLeaf *leaf, int slot);
+    static int childFor(const BTreeInner *node, std::string_view key, uint64_t keyPrefix);
+    static int slotFor(const BTreeLeaf *leaf, std::string_view key, uint64_t keyPrefix);
+
+    BTreeLeaf *descend(std::string_view key, uint64_t keyPrefix, Step *path) const;
+    void insertSeparator(Step *path, int depth, const std::string *separator, BTreeNode *right);
+    void removeChild(Step *path, int depth);
+    void helpClear(BTreeNode *node);
+    void helpDump(const BTreeNode *node, OutputSink &out) const;
+};
@@ -6,6 +6,15 @@
  */
 
 #include "dtree.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/* Accounts only hold interned references, so a DNode owns no memory */
+static_assert(std::is_trivially_destructible<DNode>::value, "DNode must be trivially destructible");
 
 /**
  * Destructor, deletes all dynamic memory.
@@ -22,11 +31,63 @@ DTree::~DTree()
  */
 DTree &DTree::operator=(const DTree &rhs)
 {
-    if (_root == rhs._root)
+    if (this == &rhs)
         return *this;
 
     clear();
     _root = helpAssignment(rhs._root);
+    helpAssignDense(rhs._dense);
+    if (rhs._frozen != nullptr)
+        _frozen = new FrozenTable(*rhs._frozen);
+    _policy = rhs._policy;
+
+    return *this;
+}
+/**
+ * Copy constructor, makes a deep copy of a DTree. The copy draws from the
+ * same node pool as rhs.
+ * @param rhs Source DTree to copy
+ */
+DTree::DTree(const DTree &rhs)
+    : _root(nullptr), _pool(rhs._pool), _dense(nullptr), _frozen(nullptr), _policy(rhs._policy), _numReclaimed(0)
+{
+    _root = helpAssignment(rhs._root);
+    helpAssignDense(rhs._dense);
+    if (rhs._frozen != nullptr)
+        _frozen = new FrozenTable(*rhs._frozen);
+}
+/**
+ * Move constructor, takes over the nodes of rhs without copying them.
+ * @param rhs Source DTree, left empty
+ */
+DTree::DTree(DTree &&rhs) noexcept
+    : _root(rhs._root), _pool(rhs._pool), _dense(rhs._dense), _frozen(rhs._frozen), _policy(rhs._policy),
+      _numReclaimed(rhs._numReclaimed)
+{
+    rhs._root = nullptr;
+    rhs._dense = nullptr;
+    rhs._frozen = nullptr;
+}
+/**
+ * Move assignment operator, takes over the nodes (and pool) of rhs.
+ * @param rhs Source DTree, left empty
+ * @return this DTree
+ */
+DTree &DTree::operator=(DTree &&rhs) noexcept
+{
+    if (this == &rhs)
+        return *this;
+
+    clear();
+    _root = rhs._root;
+    _pool = rhs._pool;
+    _dense = rhs._dense;
+    _frozen = rhs._frozen;
+    _policy = rhs._policy;
+    _numReclaimed = rhs._numReclaimed;
+    rhs._root = nullptr;
+    rhs._dense = nullptr;
+    rhs._frozen = nullptr;
 
     return *this;
 }
@@ -38,8 +99,7 @@ DNode *DTree::helpAssignment(DNode *rhs)
     if (rhs == nullptr)
         return nullptr;
 
-    DNode *root = new DNode();
-    root->_account = rhs->getAccount();
+    DNode *root = newNode(rhs->getAccount());
     root->_numVacant = rhs->getNumVacant();
     root->_size = rhs->getSize();
     root->_vacant = rhs->isVacant();
@@ -49,6 +109,43 @@ DNode *DTree::helpAssignment(DNode *rhs)
     return root;
 }
 
+/**
+ * Helper funtion for assignment operator, copies a DenseTable.
+ */
+void DTree::helpAssignDense(const DenseTable *rhs)
+{
+    if (rhs == nullptr)
+        return;
+
+    _dense = new DenseTable();
+    for (int disc = rhs->next(MIN_DISC); disc != INVALID_DISC; disc = rhs->next(disc + 1))
+    {
+        _dense->insert(disc, newNode(rhs->get(disc)->getAccount()));
+    }
+}
+
+/**
+ * Allocates a DNode from the tree's pool, or from the heap if it has none.
+ * @param account Account object to be contained within the new DNode
+ * @return the new DNode
+ */
+DNode *DTree::newNode(const Account &account)
+{
+    if (_pool != nullptr)
+        return _pool->create(account);
+    return new DNode(account);
+}
+/**
+ * Returns a DNode to wherever newNode took it from.
+ */
+void DTree::deleteNode(DNode *node)
+{
+    if (_pool != nullptr)
+        _pool->destroy(node);
+    else
+        delete node;
+}
+
 /**
  * Dynamically allocates a new DNode in the tree. 
  * Should also update heights and detect imbalances in the traversal path
@@ -56,95 +153,144 @@ DNode *DTree::helpAssignment(DNode *rhs)
  * @param newAcct Account object to be contained within the new DNode
  * @return true if the account was inserted, false otherwise
  */
-bool DTree::insert(Account newAcct)
+bool DTree::insert(const Account &newAcct)
+{
+    bool inserted;
+    insertOrGet(newAcct, inserted);
+    return inserted;
+}
+/**
+ * Inserts an account unless one with the same discriminator is already
+ * there, in a single descent.
+ * @param newAcct Account object to be contained within the new DNode
+ * @param inserted set to true if the account was inserted, false otherwise
+ * @return the new DNode, or the existing one holding the discriminator,
+ * nullptr if the discriminator is out of range
+ */
+DNode *DTree::insertOrGet(const Account &newAcct, bool &inserted)
 {
-    // if it exist retrieve return false
-    DNode *node = new DNode(newAcct);
-    if (retrieve(node->getDiscriminator()) != nullptr)
+    int disc = newAcct.getDiscriminator();
+    inserted = false;
+    if (disc < MIN_DISC || disc > MAX_DISC)
+        return nullptr;
+
+    if (_frozen != nullptr)
+        thaw();
+    if (_dense != nullptr)
     {
-        delete node;
-        return false;
+        inserted = !_dense->test(disc);
+        if (inserted)
+            _dense->insert(disc, newNode(newAcct));
+        return _dense->get(disc);
     }
-    delete node;
-    helpInsert(newAcct, _root);
-    if (checkImbalance(_root))
-        rebalance(_root);
-    return true;
+
+    DNode *node = helpInsert(newAcct, _root, inserted);
+    if (!inserted)
+        return node;
+
+    /* Rebuilds, compaction and the switch to a DenseTable all keep live
+     * nodes where they are, so node stays valid */
+    if (getNumUsers() >= DENSE_THRESHOLD)
+        toDense();
+    else
+        maybeCompact();
+    return node;
 }
 
 /**
- * Helper funtion for insert.
+ * Helper funtion for insert. A new node can only unbalance the nodes on its
+ * insertion path, and every other subtree already obeys the 'Discord' rule,
+ * so only the highest unbalanced node on the path is rebuilt. That is the
+ * smallest subtree whose rebuild restores the rule everywhere.
  */
-bool DTree::helpInsert(Account newAcct, DNode *&root)
+DNode *DTree::helpInsert(const Account &newAcct, DNode *&root, bool &inserted)
 {
-    if (root == nullptr)
-    {
-        root = new DNode(newAcct);
-        updateSize(root);
-        return true;
-    }
-    if ((root->_left == nullptr && root->_right == nullptr) && root->isVacant())
-    {
-        root->_vacant = false;
-        root->_account = newAcct;
-        updateNumVacant(root);
-        return true;
-    }
-    if (root->_left == nullptr)
-        if (root->isVacant() == true && root->_right->getDiscriminator() > newAcct.getDiscriminator())
-        {
-            root->_vacant = false;
-            root->_account = newAcct;
-            updateNumVacant(root);
-            return true;
-        }
-    if (root->_right == nullptr)
-        if (root->isVacant() == true && root->_left->getDiscriminator() < newAcct.getDiscriminator())
-        {
-            root->_vacant = false;
-            root->_account = newAcct;
-            updateNumVacant(root);
-            return true;
-        }
-    if (root->isVacant() == true &&
-        (root->_left->getDiscriminator() < newAcct.getDiscriminator() &&
-         root->_right->getDiscriminator() > newAcct.getDiscriminator()))
-    {
-        root->_vacant = false;
-        root->_account = newAcct;
-        updateNumVacant(root);
-        return true;
-    }
+    int disc = newAcct.getDiscriminator();
+    PathStack<DNode **> path; /* links followed from root */
 
-    if (root->getDiscriminator() < newAcct.getDiscriminator())
+    DNode **link = &root;
+    while (*link != nullptr)
     {
-        if (helpInsert(newAcct, root->_right) == true)
+        DNode *node = *link;
+        if (node->isVacant() && (node->getDiscriminator() == disc || canFill(node, disc)))
         {
-            updateSize(root);
-            return true;
+            /* Reuse the vacant node, the sizes along the path do not change */
+            node->_vacant = false;
+            node->_account = newAcct;
+            updateNumVacant(node);
+            for (int i = path.size() - 1; i >= 0; i--)
+                updateNumVacant(*path[i]);
+            inserted = true;
+            return node;
         }
-        else
+        if (node->getDiscriminator() == disc)
         {
-            updateNumVacant(root);
-            return false;
+            inserted = false;
+            return node;
         }
+
+        path.push_back(link);
+        link = (disc < node->getDiscriminator()) ? &node->_left : &node->_right;
     }
 
-    if (root->getDiscriminator() > newAcct.getDiscriminator())
+    DNode *node = newNode(newAcct);
+    *link = node;
+    helpFixPath(path);
+    inserted = true;
+    return node;
+}
+/**
+ * Updates the sizes and vacancy counts along a path of links after the
+ * subtree at its end changed, then rebuilds the highest unbalanced node on it.
+ * A rebuild drops vacant nodes and so can shrink the subtree, which may
+ * unbalance an ancestor: the path above it is rescanned until all is balanced.
+ */
+void DTree::helpFixPath(PathStack<DNode **> &path)
+{
+    int limit = path.size();
+    while (limit > 0)
     {
-        if (helpInsert(newAcct, root->_left) == true)
-        {
-            updateSize(root);
-            return true;
-        }
-        else
+        /* One bottom-up pass updates the counts and finds the highest unbalanced node */
+        int highest = -1;
+        for (int i = limit - 1; i >= 0; i--)
         {
-            updateNumVacant(root);
-            return false;
+            updateSize(*path[i]);
+            updateNumVacant(*path[i]);
+            if (checkImbalance(*path[i]))
+                highest = i;
         }
+        if (highest < 0)
+            return;
+
+        /* Everything above was checked with the subtree's old size, so only
+         * a rebuild that dropped vacant nodes needs another pass */
+        int size = (*path[highest])->getSize();
+        rebalance(*path[highest]);
+        if (*path[highest] != nullptr && (*path[highest])->getSize() == size)
+            return;
+        limit = highest;
     }
+}
+/**
+ * Checks whether a vacant node can hold disc without breaking the BST
+ * property, i.e. disc lies between its left and right subtrees. The caller
+ * has already descended to the node along the search path of disc.
+ */
+bool DTree::canFill(DNode *node, int disc) const
+{
+    DNode *neighbour = node->_left;
+    while (neighbour != nullptr && neighbour->_right != nullptr)
+        neighbour = neighbour->_right;
+    if (neighbour != nullptr && neighbour->getDiscriminator() >= disc)
+        return false;
 
-    return false;
+    neighbour = node->_right;
+    while (neighbour != nullptr && neighbour->_left != nullptr)
+        neighbour = neighbour->_left;
+    if (neighbour != nullptr && neighbour->getDiscriminator() <= disc)
+        return false;
+
+    return true;
 }
 
 /**
@@ -155,10 +301,27 @@ bool DTree::helpInsert(Account newAcct, DNode *&root)
  */
 bool DTree::remove(int disc, DNode *&removed)
 {
+    if (_frozen != nullptr)
+        thaw();
+    if (_dense != nullptr)
+    {
+        removed = nullptr;
+        if (disc < MIN_DISC || disc > MAX_DISC || !_dense->test(disc))
+            return false;
+
+        DNode *node = _dense->erase(disc);
+        removed = new DNode(node->getAccount());
+        deleteNode(node);
+        if (_dense->count() < SPARSE_THRESHOLD)
+            toSparse();
+        return true;
+    }
+
     removed = helpRemove(disc, _root);
     if (removed == nullptr)
         return false;
 
+    maybeCompact();
     return true;
 }
 
@@ -167,42 +330,23 @@ bool DTree::remove(int disc, DNode *&removed)
  */
 DNode *DTree::helpRemove(int disc, DNode *&root)
 {
-    if (root == nullptr)
-        return nullptr;
-
-    if (disc == root->getDiscriminator() && (root->isVacant() == false))
-    {
-        DNode *temp = new DNode(root->getAccount());
-        root->_vacant = true;
-        updateNumVacant(root);
-        return temp;
-    }
-
-    if (disc > root->getDiscriminator())
-    {
-        DNode *temp = helpRemove(disc, root->_right);
-        if (temp != nullptr)
-        {
-            updateNumVacant(root);
-            return temp;
-        }
-        else
-            return nullptr;
-    }
+    PathStack<DNode *> path;
 
-    if (disc < root->getDiscriminator())
+    DNode *node = root;
+    while (node != nullptr && node->getDiscriminator() != disc)
     {
-        DNode *temp = helpRemove(disc, root->_left);
-        if (temp != nullptr)
-        {
-            updateNumVacant(root);
-            return temp;
-        }
-        else
-            return nullptr;
+        path.push_back(node);
+        node = (disc < node->getDiscriminator()) ? node->_left : node->_right;
     }
+    if (node == nullptr || node->isVacant())
+        return nullptr;
 
-    return nullptr;
+    DNode *temp = new DNode(node->getAccount());
+    node->_vacant = true;
+    updateNumVacant(node);
+    for (int i = path.size() - 1; i >= 0; i--)
+        updateNumVacant(path[i]);
+    return temp;
 }
 
 /**
@@ -212,23 +356,84 @@ DNode *DTree::helpRemove(int disc, DNode *&root)
  */
 DNode *DTree::retrieve(int disc)
 {
+    if (_dense != nullptr)
+    {
+        if (disc < MIN_DISC || disc > MAX_DISC || !_dense->test(disc))
+            return nullptr;
+        return _dense->get(disc);
+    }
+    if (_frozen != nullptr)
+    {
+        int i = _frozen->find(disc);
+        return (i == 0) ? nullptr : &_frozen->nodes[i];
+    }
+
     return helpRetrieve(disc, _root);
 }
 /**
- * Helper funtion for retrieve.
+ * Retrieves one account from each of several DTrees at once. The descents
+ * of linked trees advance together one level at a time, and each prefetches
+ * its next node, so their cache misses overlap instead of queueing.
+ * @param trees tree to search for each lookup, nullptr for none
+ * @param discs discriminator to search for in each tree
+ * @param count number of lookups, at most BATCH_GROUP
+ * @param results receives each DNode, or nullptr if it was not found
  */
-DNode *DTree::helpRetrieve(int disc, DNode *root)
+void DTree::retrieveBatch(DTree *const *trees, const int *discs, int count, DNode **results)
 {
-    if (root == nullptr)
-        return nullptr;
-    if ((root->getDiscriminator() == disc) && (root->_vacant == true))
-        return root;
+    DNode *nodes[BATCH_GROUP];
+    int pending[BATCH_GROUP];
+    int numPending = 0;
 
-    if (disc > root->getDiscriminator())
-        return helpRetrieve(disc, root->_right);
+    for (int i = 0; i < count; i++)
+    {
+        results[i] = nullptr;
+        if (trees[i] == nullptr)
+            continue;
+        if (trees[i]->_root == nullptr)
+            results[i] = trees[i]->retrieve(discs[i]);
+        else
+        {
+            nodes[i] = trees[i]->_root;
+            __builtin_prefetch(nodes[i]);
+            pending[numPending++] = i;
+        }
+    }
+
+    while (numPending > 0)
+    {
+        int kept = 0;
+        for (int k = 0; k < numPending; k++)
+        {
+            int i = pending[k];
+            DNode *node = nodes[i];
+            if (node->getDiscriminator() == discs[i])
+            {
+                results[i] = node->isVacant() ? nullptr : node;
+                continue;
+            }
 
-    if (disc < root->getDiscriminator())
-        return helpRetrieve(disc, root->_left);
+            node = (discs[i] < node->getDiscriminator()) ? node->_left : node->_right;
+            if (node == nullptr)
+                continue;
+            __builtin_prefetch(node);
+            nodes[i] = node;
+            pending[kept++] = i;
+        }
+        numPending = kept;
+    }
+}
+/**
+ * Helper funtion for retrieve.
+ */
+DNode *DTree::helpRetrieve(int disc, DNode *root)
+{
+    while (root != nullptr)
+    {
+        if (root->getDiscriminator() == disc)
+            return root->isVacant() ? nullptr : root;
+        root = (disc < root->getDiscriminator()) ? root->_left : root->_right;
+    }
 
     return nullptr;
 }
@@ -239,51 +444,207 @@ void DTree::clear()
 {
     helpClean(_root);
     _root = nullptr;
+
+    if (_dense != nullptr)
+    {
+        for (int disc = _dense->next(MIN_DISC); disc != INVALID_DISC; disc = _dense->next(disc + 1))
+            deleteNode(_dense->get(disc));
+        delete _dense;
+        _dense = nullptr;
+    }
+    delete _frozen;
+    _frozen = nullptr;
 }
 /**
  * Helper funtion for clear.
  */
 void DTree::helpClean(DNode *&root)
 {
-    if (root == nullptr)
-        return;
-
-    helpClean(root->_right);
-    helpClean(root->_left);
-
-    delete root;
+    /* Rotate left children up until the root has none, then delete it and
+     * continue with its right subtree: no recursion and no stack */
+    while (root != nullptr)
+    {
+        if (root->_left != nullptr)
+        {
+            DNode *left = root->_left;
+            root->_left = left->_right;
+            left->_right = root;
+            root = left;
+        }
+        else
+        {
+            DNode *right = root->_right;
+            deleteNode(root);
+            root = right;
+        }
+    }
+}
+/**
+ * Forgets every node without visiting them. Only valid for a pooled tree whose
+ * pool is about to be reset, since DNodes need no destructor.
+ */
+void DTree::releasePooled()
+{
+    _root = nullptr;
+    delete _dense;
+    _dense = nullptr;
+    delete _frozen;
+    _frozen = nullptr;
 }
 /**
  * Prints all accounts' details within the DTree.
  */
 void DTree::printAccounts() const
 {
-    helpPrintAccounts(_root);
+    StreamSink out(cout);
+    printAccounts(out);
 }
 /**
- * Helper funtion for Print Accounts.
+ * Prints all accounts' details within the DTree to a sink.
+ * @param out sink receiving the text
  */
-void DTree::helpPrintAccounts(DNode *root) const
+void DTree::printAccounts(OutputSink &out) const
 {
-    if (root == nullptr)
+    if (_dense != nullptr)
+    {
+        for (int disc = _dense->next(MIN_DISC); disc != INVALID_DISC; disc = _dense->next(disc + 1))
+            out << _dense->get(disc)->_account << '\n';
+        return;
+    }
+    if (_frozen != nullptr)
+    {
+        for (int i = _frozen->first(); i != 0; i = _frozen->next(i))
+            out << _frozen->nodes[i]._account << '\n';
         return;
+    }
 
-    helpPrintAccounts(root->_left);
-    cout << root->_account << endl;
-    helpPrintAccounts(root->_right);
+    helpPrintAccounts(_root, out);
+}
+/**
+ * Helper funtion for Print Accounts.
+ */
+void DTree::helpPrintAccounts(DNode *root, OutputSink &out) const
+{
+    TreeCursor<DNode> cursor;
+    for (cursor.first(root); cursor.valid(); cursor.next())
+        out << cursor.get()->_account << '\n';
 }
 /**
  * Dump the DTree in the '()' notation.
  */
+void DTree::dump() const
+{
+    StreamSink out(cout);
+    dump(out);
+}
+/**
+ * Dump the DTree in the '()' notation to a sink. A dense DTree is shown as
+ * the perfectly balanced tree it would be rebuilt into, a frozen one as the
+ * complete tree its array encodes.
+ * @param out sink receiving the text
+ */
+void DTree::dump(OutputSink &out) const
+{
+    if (_frozen != nullptr)
+    {
+        helpDumpFrozen(1, out);
+        return;
+    }
+    if (_dense == nullptr)
+    {
+        dump(_root, out);
+        return;
+    }
+
+    std::vector<DNode *> nodes;
+    for (int disc = _dense->next(MIN_DISC); disc != INVALID_DISC; disc = _dense->next(disc + 1))
+        nodes.push_back(_dense->get(disc));
+    helpDumpDense(nodes.data(), 0, nodes.size() - 1, out);
+}
+/**
+ * Helper funtion for dump of a dense DTree.
+ */
+void DTree::helpDumpDense(DNode **nodes, int min, int max, OutputSink &out) const
+{
+    if (min > max)
+        return;
+    int mid = (max + min) / 2;
+    out << '(';
+    helpDumpDense(nodes, min, mid - 1, out);
+    out << nodes[mid]->getDiscriminator() << ':' << max - min + 1 << ':' << 0;
+    helpDumpDense(nodes, mid + 1, max, out);
+    out << ')';
+}
+/**
+ * Helper funtion for dump of a frozen DTree.
+ */
+void DTree::helpDumpFrozen(int i, OutputSink &out) const
+{
+    if (i > _frozen->count)
+        return;
+    out << '(';
+    helpDumpFrozen(2 * i, out);
+    out << _frozen->discs[i] << ':' << _frozen->size(i) << ':' << 0;
+    helpDumpFrozen(2 * i + 1, out);
+    out << ')';
+}
+/**
+ * Dump the subtree rooted at node in the '()' notation.
+ */
 void DTree::dump(DNode *node) const
+{
+    StreamSink out(cout);
+    dump(node, out);
+}
+/**
+ * Dump the subtree rooted at node in the '()' notation to a sink.
+ * @param node root of the subtree
+ * @param out sink receiving the text
+ */
+void DTree::dump(DNode *node, OutputSink &out) const
 {
     if (node == nullptr)
         return;
-    cout << "(";
-    dump(node->_left);
-    cout << node->getAccount().getDiscriminator() << ":" << node->getSize() << ":" << node->getNumVacant();
-    dump(node->_right);
-    cout << ")";
+    out << '(';
+    dump(node->_left, out);
+    out << node->getAccount().getDiscriminator() << ':' << node->getSize() << ':' << node->getNumVacant();
+    dump(node->_right, out);
+    out << ')';
+}
+
+/**
+ * Replaces the contents of the DTree with a perfectly balanced tree built
+ * directly from accounts already sorted by discriminator.
+ * @param accounts array of accounts with strictly increasing discriminators
+ * @param count number of accounts in the array
+ */
+void DTree::buildSorted(const Account *accounts, int count)
+{
+    clear();
+    if (count < DENSE_THRESHOLD)
+    {
+        helpRebalance(_root, accounts, 0, count - 1);
+        return;
+    }
+
+    _dense = new DenseTable();
+    for (int i = 0; i < count; i++)
+    {
+        _dense->insert(accounts[i].getDiscriminator(), newNode(accounts[i]));
+    }
+}
+
+/**
+ * Returns the username shared by every account in the tree.
+ * @return username of the accounts
+ */
+const string &DTree::getUsername() const
+{
+    if (_dense != nullptr)
+        return _dense->get(_dense->next(MIN_DISC))->getUsername();
+    if (_frozen != nullptr)
+        return _frozen->nodes[1].getUsername();
+    return _root->getUsername();
 }
 
 /**
@@ -292,6 +653,10 @@ void DTree::dump(DNode *node) const
  */
 int DTree::getNumUsers() const
 {
+    if (_dense != nullptr)
+        return _dense->count();
+    if (_frozen != nullptr)
+        return _frozen->count;
     if (_root == nullptr)
         return 0;
     return _root->getSize() - _root->getNumVacant();
@@ -303,9 +668,9 @@ int DTree::getNumUsers() const
  */
 void DTree::updateSize(DNode *node)
 {
-    node->_size = 1;
     if (node == nullptr)
         return;
+    node->_size = 1;
     if (node->_left != nullptr)
         node->_size += node->_left->getSize();
     if (node->_right != nullptr)
@@ -361,7 +726,7 @@ bool DTree::checkImbalance(DNode *node)
             min = left;
             max = right;
         }
-        if (max > (min * 1.5))
+        if (2 * max > 3 * min) /* max > 1.5 * min */
             return true;
         else
             return false;
@@ -377,34 +742,80 @@ bool DTree::checkImbalance(DNode *node)
  */
 void DTree::rebalance(DNode *&node)
 {
+    /* Most rebuilds are small subtrees, their nodes are gathered on the stack */
+    DNode *local[REBUILD_INLINE];
+    int count = node->_size - node->_numVacant;
+    DNode **nodes = (count <= REBUILD_INLINE) ? local : new DNode *[count];
     int index = 0;
-    Account *rootArray = new Account[node->_size - node->_numVacant];
-    helpArrayInOrder(node, rootArray, index);
-    DNode *root = nullptr;
-    helpRebalance(root, rootArray, 0, getNumUsers() - 1);
-    helpClean(node);
-    node = root;
-    delete[] rootArray;
+    helpGatherLive(node, nodes, index);
+
+    /* The live nodes are relinked in place, nothing is reallocated */
+    node = helpLinkBalanced(nodes, 0, index - 1);
+    if (nodes != local)
+        delete[] nodes;
 }
 /**
- * Helper funtion rebalancing, sort DTree into an Array.
+ * Helper funtion rebalancing, collects the live nodes of a subtree in order
+ * and releases the vacant ones.
  */
-void DTree::helpArrayInOrder(DNode *root, Account *&rootArray, int &index)
+void DTree::helpArrayInOrder(DNode *root, DNode **nodes, int &index)
 {
-    if (root == nullptr)
-        return;
-
-    helpArrayInOrder(root->_left, rootArray, index);
-    if (!root->isVacant())
-        rootArray[index++] = root->getAccount();
-    helpArrayInOrder(root->_right, rootArray, index);
+    /* A vacant node may stay on the cursor's path until its right subtree is
+     * done, so they are released afterwards. The cursor never reads the left
+     * link of a node it has passed, which lets it chain them. */
+    DNode *vacant = nullptr;
+    TreeCursor<DNode> cursor;
+    for (cursor.first(root); cursor.valid(); cursor.next())
+    {
+        DNode *node = cursor.get();
+        if (!node->isVacant())
+            nodes[index++] = node;
+        else
+        {
+            node->_left = vacant;
+            vacant = node;
+        }
+    }
+    while (vacant != nullptr)
+    {
+        DNode *next = vacant->_left;
+        deleteNode(vacant);
+        vacant = next;
+        _numReclaimed++;
+    }
+}
+/**
+ * Helper funtion for rebalancing, collects the live nodes of a subtree in
+ * order and releases the vacant ones. The walk keeps its path in a
+ * PathStack, so a degenerate subtree cannot exhaust the call stack; a node
+ * is off the path once it is visited, so a vacant one is released at once.
+ */
+void DTree::helpGatherLive(DNode *root, DNode **nodes, int &index)
+{
+    PathStack<DNode *> path;
+    DNode *node = root;
+    while (node != nullptr || !path.empty())
+    {
+        for (; node != nullptr; node = node->_left)
+            path.push_back(node);
+        node = path.back();
+        path.pop_back();
 
-    return;
+        DNode *right = node->_right;
+        if (!node->isVacant())
+            nodes[index++] = node;
+        else
+        {
+            deleteNode(node);
+            _numReclaimed++;
+        }
+        node = right;
+    }
 }
 /**
  * Helper funtion for rebalancing, Array back to DTree.
  */
-void DTree::helpRebalance(DNode *&root, Account *rootArray, int min, int max)
+void DTree::helpRebalance(DNode *&root, const Account *rootArray, int min, int max)
 {
 
     if (min > max)
@@ -412,12 +823,570 @@ void DTree::helpRebalance(DNode *&root, Account *rootArray, int min, int max)
         return;
     }
     int mid = (max + min) / 2;
-    root = new DNode(rootArray[mid]);
+    root = newNode(rootArray[mid]);
 
     helpRebalance(root->_left, rootArray, min, mid - 1);
     helpRebalance(root->_right, rootArray, mid + 1, max);
     updateSize(root);
 }
+
+/**
+ * Frees every vacant node of the tree at once, leaving it perfectly balanced.
+ * @return number of vacant nodes freed
+ */
+int DTree::compact()
+{
+    int numVacant = getNumVacant();
+    if (numVacant > 0)
+        rebalance(_root);
+    return numVacant;
+}
+/**
+ * Runs one compaction step if the tree has more vacant nodes than its policy allows.
+ */
+void DTree::maybeCompact()
+{
+    int numVacant = getNumVacant();
+    if (numVacant < _policy.minVacant || numVacant <= _policy.maxVacantRatio * _root->getSize())
+        return;
+
+    if (_policy.stepNodes <= 0)
+        compact();
+    else
+        compactStep(_policy.stepNodes);
+}
+/**
+ * Frees some of the vacant nodes: follows the children holding the most of
+ * them down to a subtree of at most stepNodes nodes and rebuilds it. If the
+ * vacant node is the only one in a larger subtree, it is unlinked instead.
+ */
+void DTree::compactStep(int stepNodes)
+{
+    PathStack<DNode **> path;
+    DNode **link = &_root;
+    while ((*link)->getSize() > stepNodes)
+    {
+        DNode *node = *link;
+        int left = node->_left == nullptr ? 0 : node->_left->getNumVacant();
+        int right = node->_right == nullptr ? 0 : node->_right->getNumVacant();
+        if (left == 0 && right == 0)
+        {
+            helpUnlinkVacant(path, link);
+            return;
+        }
+
+        path.push_back(link);
+        link = (left >= right) ? &node->_left : &node->_right;
+    }
+
+    rebalance(*link);
+    helpFixPath(path);
+}
+/**
+ * Helper funtion for compaction, removes the vacant node at link from the
+ * tree. A node with two children is replaced by its in-order predecessor,
+ * which is relinked rather than copied so pointers to it stay valid.
+ * @param path links followed from the root to link
+ */
+void DTree::helpUnlinkVacant(PathStack<DNode **> &path, DNode **link)
+{
+    DNode *node = *link;
+    if (node->_left == nullptr || node->_right == nullptr)
+        *link = (node->_left != nullptr) ? node->_left : node->_right;
+    else
+    {
+        path.push_back(link);
+        int top = path.size();
+        DNode **predecessorLink = &node->_left;
+        while ((*predecessorLink)->_right != nullptr)
+        {
+            path.push_back(predecessorLink);
+            predecessorLink = &(*predecessorLink)->_right;
+        }
+        DNode *predecessor = *predecessorLink;
+        *predecessorLink = predecessor->_left;
+
+        /* the walk began at the link the predecessor takes over */
+        predecessor->_left = node->_left;
+        predecessor->_right = node->_right;
+        *link = predecessor;
+        if (path.size() > top)
+            path[top] = &predecessor->_left;
+    }
+
+    deleteNode(node);
+    _numReclaimed++;
+    helpFixPath(path);
+}
+
+/**
+ * Moves every account of the tree into a DenseTable. Vacant nodes are
+ * released, live nodes are reused as the table's slots.
+ */
+void DTree::toDense()
+{
+    _dense = new DenseTable();
+    helpToDense(_root);
+    _root = nullptr;
+}
+/**
+ * Helper funtion for to dense.
+ */
+void DTree::helpToDense(DNode *root)
+{
+    if (root == nullptr)
+        return;
+
+    helpToDense(root->_left);
+    helpToDense(root->_right);
+
+    if (root->isVacant())
+    {
+        deleteNode(root);
+        _numReclaimed++;
+        return;
+    }
+    root->_left = nullptr;
+    root->_right = nullptr;
+    root->_size = DEFAULT_SIZE;
+    root->_numVacant = DEFAULT_NUM_VACANT;
+    _dense->insert(root->getDiscriminator(), root);
+}
+/**
+ * Turns a DenseTable back into a perfectly balanced tree, reusing its nodes.
+ */
+void DTree::toSparse()
+{
+    std::vector<DNode *> nodes;
+    for (int disc = _dense->next(MIN_DISC); disc != INVALID_DISC; disc = _dense->next(disc + 1))
+        nodes.push_back(_dense->get(disc));
+    delete _dense;
+    _dense = nullptr;
+
+    _root = helpLinkBalanced(nodes.data(), 0, nodes.size() - 1);
+}
+/**
+ * Links live nodes already sorted by discriminator into a perfectly balanced
+ * tree. Every subtree is a range of the array, so its counts are known
+ * without reading the children.
+ * @return root of the tree
+ */
+DNode *DTree::helpLinkBalanced(DNode **nodes, int min, int max)
+{
+    if (min > max)
+        return nullptr;
+
+    int mid = (max + min) / 2;
+    DNode *root = nodes[mid];
+    root->_left = (mid > min) ? helpLinkBalanced(nodes, min, mid - 1) : nullptr;
+    root->_right = (mid < max) ? helpLinkBalanced(nodes, mid + 1, max) : nullptr;
+    root->_size = max - min + 1;
+    root->_numVacant = 0;
+
+    return root;
+}
+
+/**
+ * Moves the accounts of a tree into a FrozenTable, for users that are only
+ * read from now on. Vacant nodes are dropped. The next insert or remove
+ * thaws the tree again. A dense DTree already has direct lookups and stays
+ * as it is. Freezing and thawing both move the accounts, so DNode pointers
+ * and iterators taken before are invalidated.
+ */
+void DTree::freeze()
+{
+    if (_frozen != nullptr || _dense != nullptr)
+        return;
+
+    int index = 0;
+    DNode **nodes = new DNode *[getNumUsers()];
+    if (_root != nullptr)
+        helpArrayInOrder(_root, nodes, index);
+    _frozen = new FrozenTable(nodes, index);
+    for (int i = 0; i < index; i++)
+        deleteNode(nodes[i]);
+    delete[] nodes;
+    _root = nullptr;
+}
+/**
+ * Turns a FrozenTable back into a perfectly balanced tree of new nodes.
+ */
+void DTree::thaw()
+{
+    DNode **nodes = new DNode *[_frozen->count];
+    int index = 0;
+    for (int i = _frozen->first(); i != 0; i = _frozen->next(i))
+        nodes[index++] = newNode(_frozen->nodes[i].getAccount());
+    delete _frozen;
+    _frozen = nullptr;
+
+    _root = helpLinkBalanced(nodes, 0, index - 1);
+    delete[] nodes;
+}
+
+/**
+ * Returns an iterator to the account with the smallest discriminator.
+ */
+DTree::const_iterator DTree::begin() const
+{
+    const_iterator it(this);
+    if (_dense != nullptr)
+        it._disc = _dense->next(MIN_DISC);
+    else if (_frozen != nullptr)
+        it._disc = (_frozen->count == 0) ? INVALID_DISC : _frozen->first();
+    else
+    {
+        it._cursor.first(_root);
+        it.skipVacant(true);
+    }
+    return it;
+}
+/**
+ * Returns an iterator to the first account whose discriminator is at least disc.
+ */
+DTree::const_iterator DTree::lower_bound(int disc) const
+{
+    const_iterator it(this);
+    if (_dense != nullptr)
+        it._disc = _dense->next(disc);
+    else if (_frozen != nullptr)
+    {
+        int i = _frozen->lowerBound(disc);
+        it._disc = (i == 0) ? INVALID_DISC : i;
+    }
+    else
+    {
+        it._cursor.seek(_root, [disc](DNode *node) { return node->getDiscriminator() >= disc; });
+        it.skipVacant(true);
+    }
+    return it;
+}
+/**
+ * Returns an iterator to the first account whose discriminator is greater than disc.
+ */
+DTree::const_iterator DTree::upper_bound(int disc) const
+{
+    const_iterator it(this);
+    if (_dense != nullptr)
+        it._disc = _dense->next(disc + 1);
+    else if (_frozen != nullptr)
+    {
+        int i = _frozen->lowerBound(disc + 1);
+        it._disc = (i == 0) ? INVALID_DISC : i;
+    }
+    else
+    {
+        it._cursor.seek(_root, [disc](DNode *node) { return node->getDiscriminator() > disc; });
+        it.skipVacant(true);
+    }
+    return it;
+}
+/**
+ * Advances to the next account.
+ */
+DTree::const_iterator &DTree::const_iterator::operator++()
+{
+    if (_tree->_dense != nullptr)
+        _disc = _tree->_dense->next(_disc + 1);
+    else if (_tree->_frozen != nullptr)
+    {
+        int i = _tree->_frozen->next(_disc);
+        _disc = (i == 0) ? INVALID_DISC : i;
+    }
+    else
+    {
+        _cursor.next();
+        skipVacant(true);
+    }
+    return *this;
+}
+/**
+ * Steps back to the previous account; from end() this is the last account.
+ */
+DTree::const_iterator &DTree::const_iterator::operator--()
+{
+    if (_tree->_dense != nullptr)
+        _disc = _tree->_dense->prev(_disc == INVALID_DISC ? MAX_DISC : _disc - 1);
+    else if (_tree->_frozen != nullptr)
+    {
+        int i = (_disc == INVALID_DISC) ? _tree->_frozen->last() : _tree->_frozen->prev(_disc);
+        _disc = (i == 0) ? INVALID_DISC : i;
+    }
+    else
+    {
+        if (_cursor.valid())
+            _cursor.prev();
+        else
+            _cursor.last(_tree->_root);
+        skipVacant(false);
+    }
+    return *this;
+}
+/**
+ * Moves past vacant nodes in the given direction.
+ */
+void DTree::const_iterator::skipVacant(bool forward)
+{
+    while (_cursor.valid() && _cursor.get()->isVacant())
+    {
+        if (forward)
+            _cursor.next();
+        else
+            _cursor.prev();
+    }
+}
+
+/**
+ * Constructor, lays out accounts sorted by discriminator in Eytzinger order.
+ * @param sorted nodes with strictly increasing discriminators, copied
+ * @param count number of nodes
+ */
+FrozenTable::FrozenTable(DNode *const *sorted, int count) : count(count)
+{
+    discs = new int[count + 1];
+    nodes = new DNode[count + 1];
+    int index = 0;
+    fill(sorted, index, 1);
+}
+/**
+ * Copy constructor, makes a deep copy of a FrozenTable.
+ */
+FrozenTable::FrozenTable(const FrozenTable &rhs) : count(rhs.count)
+{
+    discs = new int[count + 1];
+    nodes = new DNode[count + 1];
+    std::copy(rhs.discs, rhs.discs + count + 1, discs);
+    std::copy(rhs.nodes, rhs.nodes + count + 1, nodes);
+}
+/**
+ * Destructor, frees both arrays.
+ */
+FrozenTable::~FrozenTable()
+{
+    delete[] discs;
+    delete[] nodes;
+}
+/**
+ * Helper funtion for the constructor: an in-order walk of the implicit tree
+ * hands out the sorted nodes in order.
+ */
+void FrozenTable::fill(DNode *const *sorted, int &index, int i)
+{
+    if (i > count)
+        return;
+    fill(sorted, index, 2 * i);
+    nodes[i] = DNode(sorted[index]->getAccount());
+    discs[i] = sorted[index]->getDiscriminator();
+    index++;
+    fill(sorted, index, 2 * i + 1);
+}
+/**
+ * Finds the smallest discriminator that is at least disc. The descent has
+ * no data-dependent branch, and each step prefetches the cache line holding
+ * the node's descendants four levels down.
+ * @return its index, 0 if there is none
+ */
+int FrozenTable::lowerBound(int disc) const
+{
+    int i = 1;
+    while (i <= count)
+    {
+        __builtin_prefetch(discs + 16 * i);
+        i = 2 * i + (discs[i] < disc);
+    }
+    /* Undo the right turns taken after the last left turn, and that left turn */
+    return i >> __builtin_ffs(~i);
+}
+/**
+ * Finds a discriminator.
+ * @return its index, 0 if it is not in the table
+ */
+int FrozenTable::find(int disc) const
+{
+    int i = lowerBound(disc);
+    return (i != 0 && discs[i] == disc) ? i : 0;
+}
+/**
+ * Index of the smallest discriminator, 0 if the table is empty.
+ */
+int FrozenTable::first() const
+{
+    if (count == 0)
+        return 0;
+    int i = 1;
+    while (2 * i <= count)
+        i = 2 * i;
+    return i;
+}
+/**
+ * Index of the largest discriminator, 0 if the table is empty.
+ */
+int FrozenTable::last() const
+{
+    if (count == 0)
+        return 0;
+    int i = 1;
+    while (2 * i + 1 <= count)
+        i = 2 * i + 1;
+    return i;
+}
+/**
+ * Index of the in-order successor of i, 0 past the end.
+ */
+int FrozenTable::next(int i) const
+{
+    if (2 * i + 1 <= count)
+    {
+        i = 2 * i + 1;
+        while (2 * i <= count)
+            i = 2 * i;
+        return i;
+    }
+    /* Climb while i is a right child, then once more */
+    while (i & 1)
+        i >>= 1;
+    return i >> 1;
+}
+/**
+ * Index of the in-order predecessor of i, 0 past the start.
+ */
+int FrozenTable::prev(int i) const
+{
+    if (2 * i <= count)
+    {
+        i = 2 * i;
+        while (2 * i + 1 <= count)
+            i = 2 * i + 1;
+        return i;
+    }
+    /* Climb while i is a left child, then once more */
+    while (i != 0 && !(i & 1))
+        i >>= 1;
+    return i >> 1;
+}
+/**
+ * Number of nodes in the implicit subtree rooted at i, in constant time.
+ * Every level of the subtree but its deepest is full; the deepest spans
+ * [i << depth, ((i + 1) << depth) - 1], cut short by count.
+ */
+int FrozenTable::size(int i) const
+{
+    if (i > count)
+        return 0;
+    int depth = __builtin_clz(i) - __builtin_clz(count);
+    int64_t first = (int64_t)i << depth;
+    int64_t deepest = std::min(first + ((int64_t)1 << depth) - 1, (int64_t)count) - first + 1;
+    return ((1 << depth) - 1) + (int)std::max(deepest, (int64_t)0);
+}
+
+/**
+ * Constructor, starts with no discriminator occupied.
+ */
+DenseTable::DenseTable() : occupied(0)
+{
+    memset(bits, 0, sizeof(bits));
+    memset(slots, 0, sizeof(slots));
+}
+/**
+ * Destructor, frees the slot arrays but not the nodes in them.
+ */
+DenseTable::~DenseTable()
+{
+    for (int i = 0; i < DENSE_WORDS; i++)
+        free(slots[i]);
+}
+/**
+ * Stores the node of an unoccupied discriminator, shifting the nodes above
+ * it in its word up by one.
+ * @param disc discriminator to occupy
+ * @param node node holding the account
+ */
+void DenseTable::insert(int disc, DNode *node)
+{
+    int word = (disc - MIN_DISC) >> 6;
+    int used = __builtin_popcountll(bits[word]);
+    if (used == 0 || (used >= 4 && (used & (used - 1)) == 0))
+    {
+        DNode **grown = static_cast<DNode **>(realloc(slots[word], std::max(4, 2 * used) * sizeof(DNode *)));
+        if (grown == nullptr)
+            throw std::bad_alloc();
+        slots[word] = grown;
+    }
+
+    int index = rank(disc);
+    memmove(slots[word] + index + 1, slots[word] + index, (used - index) * sizeof(DNode *));
+    slots[word][index] = node;
+    bits[word] |= uint64_t(1) << ((disc - MIN_DISC) & 63);
+    occupied++;
+}
+/**
+ * Frees an occupied discriminator, shifting the nodes above it in its word
+ * down by one.
+ * @param disc discriminator to free
+ * @return the node that held it
+ */
+DNode *DenseTable::erase(int disc)
+{
+    int word = (disc - MIN_DISC) >> 6;
+    int used = __builtin_popcountll(bits[word]);
+    int index = rank(disc);
+    DNode *node = slots[word][index];
+    memmove(slots[word] + index, slots[word] + index + 1, (used - index - 1) * sizeof(DNode *));
+    bits[word] &= ~(uint64_t(1) << ((disc - MIN_DISC) & 63));
+    occupied--;
+    if (used == 1)
+    {
+        free(slots[word]);
+        slots[word] = nullptr;
+    }
+    return node;
+}
+/**
+ * Finds the smallest occupied discriminator that is at least disc.
+ * @return the discriminator, INVALID_DISC if there is none
+ */
+int DenseTable::next(int disc) const
+{
+    if (disc > MAX_DISC)
+        return INVALID_DISC;
+    if (disc < MIN_DISC)
+        disc = MIN_DISC;
+
+    int word = (disc - MIN_DISC) >> 6;
+    uint64_t remaining = bits[word] & (~uint64_t(0) << ((disc - MIN_DISC) & 63));
+    while (remaining == 0)
+    {
+        if (++word == DENSE_WORDS)
+            return INVALID_DISC;
+        remaining = bits[word];
+    }
+
+    return MIN_DISC + (word << 6) + __builtin_ctzll(remaining);
+}
+
+/**
+ * Finds the largest occupied discriminator that is at most disc.
+ * @return the discriminator, INVALID_DISC if there is none
+ */
+int DenseTable::prev(int disc) const
+{
+    if (disc < MIN_DISC)
+        return INVALID_DISC;
+    if (disc > MAX_DISC)
+        disc = MAX_DISC;
+
+    int word = (disc - MIN_DISC) >> 6;
+    uint64_t remaining = bits[word] & (~uint64_t(0) >> (63 - ((disc - MIN_DISC) & 63)));
+    while (remaining == 0)
+    {
+        if (--word < 0)
+            return INVALID_DISC;
+        remaining = bits[word];
+    }
+
+    return MIN_DISC + (word << 6) + 63 - __builtin_clzll(remaining);
+}
+
 // -- OR --
 
 /**
@@ -440,4 +1409,15 @@ ostream &operator<<(ostream &sout, const Account &acct)
 {
     sout << "Account name: " << acct.getUsername() << "\n\tDiscriminator: " << acct.getDiscriminator() << "\n\tNitro: " << acct.hasNitro() << "\n\tBadge: " << acct.getBadge() << "\n\tStatus: " << acct.getStatus();
     return sout;
+}
+/**
+ * Overloaded << operator for an Account to print the same details to a sink
+ * @param out OutputSink object
+ * @param acct Account object to print
+ * @return the sink
+ */
+OutputSink &operator<<(OutputSink &out, const Account &acct)
+{
+    out << "Account name: " << acct.getUsername() << "\n\tDiscriminator: " << acct.getDiscriminator() << "\n\tNitro: " << acct.hasNitro() << "\n\tBadge: " << acct.getBadge() << "\n\tStatus: " << acct.getStatus();
+    return out;
 }
\ No newline at end of file
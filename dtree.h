@@ -9,7 +9,15 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <exception>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include "intern.h"
+#include "nodepool.h"
+#include "outputsink.h"
+#include "treecursor.h"
 
 using std::cout;
 using std::endl;
@@ -26,6 +34,19 @@ using std::string;
 #define DEFAULT_SIZE 1
 #define DEFAULT_NUM_VACANT 0
 
+#define NUM_DISCS (MAX_DISC - MIN_DISC + 1)
+#define DENSE_WORDS ((NUM_DISCS + 63) / 64)
+#define DENSE_THRESHOLD 1024 /* switch to a DenseTable at this many accounts */
+#define SPARSE_THRESHOLD 512 /* and back to a tree below this many */
+
+#define COMPACT_VACANT_RATIO 0.25f
+#define COMPACT_MIN_VACANT 32
+#define COMPACT_STEP_NODES 64
+
+#define REBUILD_INLINE 256 /* rebuilds of up to this many nodes gather them on the stack */
+
+#define BATCH_GROUP 16 /* lookups a batch interleaves so their cache misses overlap */
+
 class Grader; /* For grading purposes */
 class Tester; /* Forward declaration for testing class */
 
@@ -36,51 +57,60 @@ public:
     friend class Tester;
     friend class DNode;
     friend class DTree;
+    friend class UNode;
+    friend class UTree;
+    friend class UserFile;
     Account()
     {
-        _username = DEFAULT_USERNAME;
+        static const string *defaultUsername = &usernamePool().get(usernamePool().intern(DEFAULT_USERNAME));
+        static const int defaultBadge = vocabularyPool().intern(DEFAULT_BADGE);
+        static const int defaultStatus = vocabularyPool().intern(DEFAULT_STATUS);
+        _username = defaultUsername;
         _disc = INVALID_DISC;
         _nitro = false;
-        _badge = DEFAULT_BADGE;
-        _status = DEFAULT_STATUS;
+        _badge = defaultBadge;
+        _status = defaultStatus;
     }
 
-    Account(string username, int disc, bool nitro, string badge, string status)
+    Account(std::string_view username, int disc, bool nitro, std::string_view badge, std::string_view status)
     {
         if (disc < MIN_DISC || disc > MAX_DISC)
         {
             throw std::out_of_range("Discriminator out of valid range (" + std::to_string(MIN_DISC) + "-" + std::to_string(MAX_DISC) + ")");
         }
-        _username = username;
+        _username = &usernamePool().get(usernamePool().intern(username));
         _disc = disc;
         _nitro = nitro;
-        _badge = badge;
-        _status = status;
+        _badge = vocabularyPool().intern(badge);
+        _status = vocabularyPool().intern(status);
     }
 
     /* Getters */
-    string getUsername() const { return _username; }
+    const string &getUsername() const { return *_username; }
     int getDiscriminator() const { return _disc; }
     bool hasNitro() const { return _nitro; }
-    string getBadge() const { return _badge; }
-    string getStatus() const { return _status; }
+    const string &getBadge() const { return vocabularyPool().get(_badge); }
+    const string &getStatus() const { return vocabularyPool().get(_status); }
 
 private:
-    string _username;
+    const string *_username; /* canonical copy in usernamePool() */
     int _disc;
     bool _nitro;
-    string _badge;
-    string _status;
+    int _badge;  /* id in vocabularyPool() */
+    int _status; /* id in vocabularyPool() */
 };
 
 /* Overloaded << operator to print Accounts */
 ostream &operator<<(ostream &sout, const Account &acct);
+OutputSink &operator<<(OutputSink &out, const Account &acct);
 
 class DNode
 {
     friend class Grader;
     friend class Tester;
     friend class DTree;
+    template <class Node>
+    friend class TreeCursor;
 
 public:
     DNode()
@@ -92,7 +122,7 @@ public:
         _right = nullptr;
     }
 
-    DNode(Account account)
+    DNode(const Account &account)
     {
         _account = account;
         _size = DEFAULT_SIZE;
@@ -103,11 +133,11 @@ public:
     }
 
     /* Getters */
-    Account getAccount() const { return _account; }
+    const Account &getAccount() const { return _account; }
     int getSize() const { return _size; }
     int getNumVacant() const { return _numVacant; }
     bool isVacant() const { return _vacant; }
-    string getUsername() const { return _account.getUsername(); }
+    const string &getUsername() const { return _account.getUsername(); }
     int getDiscriminator() const { return _account.getDiscriminator(); }
 
 private:
@@ -121,32 +151,191 @@ private:
     /* IMPLEMENT (optional): any other helper functions */
 };
 
+/**
+ * Storage for a DTree holding many accounts: an occupancy bitmap over every
+ * possible discriminator, and for each 64-bit word of it an array holding
+ * the nodes of its set bits in order. A node is found by its rank, the
+ * popcount of the bits below it in its word, so lookups are a bit test, a
+ * popcount and an array index, and only occupied discriminators cost a slot.
+ * Each array has room for the next power of two, at least 4, of its nodes.
+ */
+struct DenseTable
+{
+    uint64_t bits[DENSE_WORDS];
+    DNode **slots[DENSE_WORDS];
+    int occupied; /* number of set bits, kept by insert and erase */
+
+    DenseTable();
+    ~DenseTable();
+
+    DenseTable(const DenseTable &) = delete;
+    DenseTable &operator=(const DenseTable &) = delete;
+
+    bool test(int disc) const { return (bits[(disc - MIN_DISC) >> 6] >> ((disc - MIN_DISC) & 63)) & 1; }
+    DNode *get(int disc) const { return slots[(disc - MIN_DISC) >> 6][rank(disc)]; }
+    void insert(int disc, DNode *node);
+    DNode *erase(int disc);
+
+    int count() const { return occupied; }
+    int next(int disc) const;
+    int prev(int disc) const;
+
+private:
+    /* Number of occupied discriminators below disc in its word */
+    int rank(int disc) const
+    {
+        return __builtin_popcountll(bits[(disc - MIN_DISC) >> 6] & ((uint64_t(1) << ((disc - MIN_DISC) & 63)) - 1));
+    }
+};
+
+/**
+ * Read-only storage for a frozen DTree: its accounts laid out as a complete
+ * binary search tree in Eytzinger (breadth-first) order, 1-based. Node i has
+ * children 2i and 2i + 1, so a search walks the discs array alone, without
+ * pointers or unpredictable branches, and can prefetch levels ahead.
+ */
+struct FrozenTable
+{
+    int count;
+    int *discs;   /* discs[i] is the discriminator of nodes[i], discs[0] is unused */
+    DNode *nodes; /* the accounts, unlinked */
+
+    FrozenTable(DNode *const *sorted, int count);
+    FrozenTable(const FrozenTable &rhs);
+    ~FrozenTable();
+    FrozenTable &operator=(const FrozenTable &) = delete;
+
+    int lowerBound(int disc) const;
+    int find(int disc) const;
+    int first() const;
+    int last() const;
+    int next(int i) const;
+    int prev(int i) const;
+    int size(int i) const;
+
+private:
+    void fill(DNode *const *sorted, int &index, int i);
+};
+
+/**
+ * When a DTree reclaims its vacant nodes. Once more than maxVacantRatio of
+ * the nodes are vacant, and at least minVacant of them, every insert or
+ * remove also rebuilds one subtree of at most stepNodes nodes, so the work
+ * is spread over several operations. A stepNodes of 0 compacts the whole
+ * tree at once.
+ */
+struct CompactionPolicy
+{
+    float maxVacantRatio = COMPACT_VACANT_RATIO;
+    int minVacant = COMPACT_MIN_VACANT;
+    int stepNodes = COMPACT_STEP_NODES;
+};
+
 class DTree
 {
     friend class Grader;
     friend class Tester;
 
 public:
-    DTree() : _root(nullptr) {}
+    /**
+     * Bidirectional iterator over the accounts of a DTree in discriminator
+     * order. Vacant nodes are skipped. Any insert or remove invalidates it.
+     */
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Account;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Account *;
+        using reference = const Account &;
+
+        const_iterator() : _tree(nullptr), _disc(INVALID_DISC) {}
+
+        reference operator*() const { return node()->_account; }
+        pointer operator->() const { return &node()->_account; }
+        const_iterator &operator++();
+        const_iterator &operator--();
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+        const_iterator operator--(int)
+        {
+            const_iterator old = *this;
+            --*this;
+            return old;
+        }
+        bool operator==(const const_iterator &rhs) const { return _tree == rhs._tree && _disc == rhs._disc && _cursor == rhs._cursor; }
+        bool operator!=(const const_iterator &rhs) const { return !(*this == rhs); }
+
+    private:
+        friend class DTree;
+        const DTree *_tree;
+        TreeCursor<DNode> _cursor; /* position in a tree */
+        int _disc;                 /* discriminator in a DenseTable or index in a FrozenTable, INVALID_DISC at the end */
+
+        explicit const_iterator(const DTree *tree) : _tree(tree), _disc(INVALID_DISC) {}
+        DNode *node() const
+        {
+            if (_tree->_dense != nullptr)
+                return _tree->_dense->get(_disc);
+            if (_tree->_frozen != nullptr)
+                return &_tree->_frozen->nodes[_disc];
+            return _cursor.get();
+        }
+        void skipVacant(bool forward);
+    };
+    using iterator = const_iterator;
+
+    DTree() : _root(nullptr), _pool(nullptr), _dense(nullptr), _frozen(nullptr), _numReclaimed(0) {}
+    explicit DTree(NodePool<DNode> *pool) : _root(nullptr), _pool(pool), _dense(nullptr), _frozen(nullptr), _numReclaimed(0) {}
 
     /* IMPLEMENT: destructor and assignment operator*/
     ~DTree();
     DTree &operator=(const DTree &rhs);
 
+    DTree(const DTree &rhs);
+    DTree(DTree &&rhs) noexcept;
+    DTree &operator=(DTree &&rhs) noexcept;
+
     /* IMPLEMENT: Basic operations */
 
-    bool insert(Account newAcct);
+    bool insert(const Account &newAcct);
+    DNode *insertOrGet(const Account &newAcct, bool &inserted);
     bool remove(int disc, DNode *&removed);
     DNode *retrieve(int disc);
+    static void retrieveBatch(DTree *const *trees, const int *discs, int count, DNode **results);
     void clear();
     void printAccounts() const;
-    void dump() const { dump(_root); }
+    void printAccounts(OutputSink &out) const;
+    void dump() const;
+    void dump(OutputSink &out) const;
     void dump(DNode *node) const;
+    void dump(DNode *node, OutputSink &out) const;
+    void buildSorted(const Account *accounts, int count);
+    bool isDense() const { return _dense != nullptr; }
+    void freeze();
+    bool isFrozen() const { return _frozen != nullptr; }
+
+    const_iterator begin() const;
+    const_iterator end() const { return const_iterator(this); }
+    const_iterator lower_bound(int disc) const;
+    const_iterator upper_bound(int disc) const;
+    void releasePooled();
+
+    void setCompaction(const CompactionPolicy &policy) { _policy = policy; }
+    const CompactionPolicy &getCompaction() const { return _policy; }
+    int compact();
+    int getNumVacant() const { return _root == nullptr ? 0 : _root->getNumVacant(); }
+    int getNumReclaimed() const { return _numReclaimed; }
 
     /* IMPLEMENT: "Helper" functions */
 
     int getNumUsers() const;
-    string getUsername() const { return _root->getUsername(); }
+    const string &getUsername() const;
     void updateSize(DNode *node);
     void updateNumVacant(DNode *node);
     bool checkImbalance(DNode *node);
@@ -158,14 +347,35 @@ public:
 
 private:
     DNode *_root;
+    NodePool<DNode> *_pool; /* nodes come from here when set, the heap otherwise */
+    DenseTable *_dense;     /* replaces _root while the tree holds many accounts */
+    FrozenTable *_frozen;   /* replaces _root from freeze() until the next change */
+    CompactionPolicy _policy;
+    int _numReclaimed; /* vacant nodes freed over the tree's lifetime */
 
     /* IMPLEMENT (optional): any additional helper functions here */
+    DNode *newNode(const Account &account);
+    void deleteNode(DNode *node);
     DNode *helpAssignment(DNode *rhs);
-    bool helpInsert(Account newAcct, DNode *&root);
+    DNode *helpInsert(const Account &newAcct, DNode *&root, bool &inserted);
+    bool canFill(DNode *node, int disc) const;
+    void helpFixPath(PathStack<DNode **> &path);
+    void maybeCompact();
+    void compactStep(int stepNodes);
+    void helpUnlinkVacant(PathStack<DNode **> &path, DNode **link);
     DNode *helpRemove(int disc, DNode *&root);
     DNode *helpRetrieve(int disc, DNode *root);
     void helpClean(DNode *&root);
-    void helpPrintAccounts(DNode *root) const;
-    void helpArrayInOrder(DNode *root, Account *&rootArray, int &index);
-    void helpRebalance(DNode *&root, Account *rootArray, int min, int max);
+    void helpPrintAccounts(DNode *root, OutputSink &out) const;
+    void helpArrayInOrder(DNode *root, DNode **nodes, int &index);
+    void helpGatherLive(DNode *root, DNode **nodes, int &index);
+    void helpRebalance(DNode *&root, const Account *rootArray, int min, int max);
+    void helpAssignDense(const DenseTable *rhs);
+    void toDense();
+    void toSparse();
+    void helpToDense(DNode *root);
+    DNode *helpLinkBalanced(DNode **nodes, int min, int max);
+    void helpDumpDense(DNode **nodes, int min, int max, OutputSink &out) const;
+    void thaw();
+    void helpDumpFrozen(int i, OutputSink &out) const;
 };
\ No newline at end of file
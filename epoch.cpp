@@ -0,0 +1,258 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Epoch.cpp
+ * Implementation for epoch-based reclamation of memory read without locks.
+ */
+
+#include "epoch.h"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Constructor, starts at epoch 0 with every thread slot free.
+ */
+EpochDomain::EpochDomain() : _epoch(0), _nextOwner(0), _sinceCollect(0)
+{
+    for (Slot &slot : _slots)
+    {
+        slot.epoch.store(EPOCH_QUIESCENT, std::memory_order_relaxed);
+        slot.inUse.store(false, std::memory_order_relaxed);
+        slot.depth = 0;
+    }
+}
+
+/**
+ * Destructor, frees every object still retired. No guard may be held.
+ */
+EpochDomain::~EpochDomain()
+{
+    for (auto &owner : _owners)
+        for (Retired &retired : owner.second.retired)
+            retired.deleter(retired.object);
+}
+
+/**
+ * Hands an object over to be freed once no reader can still hold it.
+ * The object must already be unreachable for readers that start now.
+ * @param object object to free
+ * @param deleter function that frees it
+ * @param owner owner whose pins keep the object, from newOwner()
+ */
+void EpochDomain::retire(void *object, void (*deleter)(void *), uint64_t owner)
+{
+    retire(&object, 1, deleter, owner);
+}
+/**
+ * Hands several objects over at once, taking the lock only once.
+ * @param objects objects to free
+ * @param count number of objects
+ * @param deleter function that frees each of them
+ * @param owner owner whose pins keep the objects, from newOwner()
+ */
+void EpochDomain::retire(void *const *objects, int count, void (*deleter)(void *), uint64_t owner)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+    std::deque<Retired> &retired = _owners[owner].retired;
+    for (int i = 0; i < count; i++)
+        retired.push_back({objects[i], deleter, epoch});
+    _sinceCollect += count;
+    if (_sinceCollect < EPOCH_COLLECT_INTERVAL)
+        return;
+
+    _sinceCollect = 0;
+    tryAdvance();
+    reclaim();
+}
+
+/**
+ * Advances the epoch if every reader has caught up with it, and frees
+ * whatever is no longer reachable by any reader.
+ */
+void EpochDomain::collect()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    tryAdvance();
+    reclaim();
+}
+
+/**
+ * Holds the current epoch until unpin() is called, from any thread.
+ * Nothing the owner retires from now on is freed in the meantime; what
+ * other owners retire is not held back.
+ * @param owner owner whose objects the pin keeps
+ * @return the pinned epoch, to pass to unpin()
+ */
+uint64_t EpochDomain::pin(uint64_t owner)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+    _owners[owner].pins.push_back(epoch);
+    return epoch;
+}
+/**
+ * Releases an epoch held by pin().
+ * @param epoch epoch returned by pin()
+ * @param owner owner passed to pin()
+ */
+void EpochDomain::unpin(uint64_t epoch, uint64_t owner)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    std::vector<uint64_t> &pins = _owners[owner].pins;
+    pins.erase(std::find(pins.begin(), pins.end(), epoch));
+}
+
+/**
+ * Returns the number of objects retired but not yet freed.
+ */
+int EpochDomain::getNumRetired()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    int count = 0;
+    for (auto &owner : _owners)
+        count += owner.second.retired.size();
+    return count;
+}
+/**
+ * Returns the number of objects one owner retired that are not yet freed.
+ * @param owner owner passed to retire()
+ */
+int EpochDomain::getNumRetired(uint64_t owner)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    auto found = _owners.find(owner);
+    return (found == _owners.end()) ? 0 : found->second.retired.size();
+}
+
+/**
+ * Returns the slot of the calling thread, claiming a free one the first
+ * time the thread reads from this domain.
+ */
+EpochDomain::Slot &EpochDomain::threadSlot()
+{
+    /* Gives the thread's slots back when it exits */
+    struct Owned
+    {
+        std::vector<std::pair<const EpochDomain *, Slot *>> slots;
+        ~Owned()
+        {
+            for (auto &owned : slots)
+            {
+                owned.second->epoch.store(EPOCH_QUIESCENT, std::memory_order_release);
+                owned.second->inUse.store(false, std::memory_order_release);
+            }
+        }
+    };
+    thread_local Owned owned;
+
+    for (auto &mine : owned.slots)
+        if (mine.first == this)
+            return *mine.second;
+
+    for (Slot &slot : _slots)
+    {
+        bool expected = false;
+        if (!slot.inUse.load(std::memory_order_relaxed) && slot.inUse.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+        {
+            slot.depth = 0;
+            owned.slots.emplace_back(this, &slot);
+            return slot;
+        }
+    }
+    throw std::length_error("EpochDomain has no free thread slot");
+}
+
+/**
+ * Moves to the next epoch unless a reader in a guard is still in an older
+ * one. Pins do not hold the epoch back. Must be called with _lock held.
+ * @return true if the epoch advanced
+ */
+bool EpochDomain::tryAdvance()
+{
+    uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+
+    /* Pairs with the fence of a reader announcing its epoch */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (Slot &slot : _slots)
+    {
+        if (!slot.inUse.load(std::memory_order_acquire))
+            continue;
+        uint64_t announced = slot.epoch.load(std::memory_order_acquire);
+        if (announced != EPOCH_QUIESCENT && announced != epoch)
+            return false;
+    }
+
+    _epoch.store(epoch + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Frees every object retired at least two epochs before both the current
+ * epoch and the oldest pin of its owner, and forgets owners left with
+ * nothing. Must be called with _lock held.
+ */
+void EpochDomain::reclaim()
+{
+    uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+    for (auto owner = _owners.begin(); owner != _owners.end();)
+    {
+        std::deque<Retired> &retired = owner->second.retired;
+        std::vector<uint64_t> &pins = owner->second.pins;
+        uint64_t oldest = pins.empty() ? epoch : std::min(epoch, *std::min_element(pins.begin(), pins.end()));
+        while (!retired.empty() && retired.front().epoch + 2 <= oldest)
+        {
+            retired.front().deleter(retired.front().object);
+            retired.pop_front();
+        }
+
+        if (retired.empty() && pins.empty())
+            owner = _owners.erase(owner);
+        else
+            ++owner;
+    }
+}
+
+/**
+ * Constructor, announces the current epoch unless the thread already holds a
+ * guard. The announcement is checked against the epoch again, so a domain
+ * that advanced meanwhile is not missed.
+ * @param domain domain the thread is about to read from
+ */
+EpochGuard::EpochGuard(EpochDomain &domain) : _slot(domain.threadSlot()), _outermost(_slot.depth++ == 0)
+{
+    if (!_outermost)
+        return;
+
+    uint64_t epoch = domain._epoch.load(std::memory_order_acquire);
+    while (true)
+    {
+        _slot.epoch.store(epoch, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t now = domain._epoch.load(std::memory_order_acquire);
+        if (now == epoch)
+            break;
+        epoch = now;
+    }
+}
+
+/**
+ * Destructor, leaves the epoch once the outermost guard goes away.
+ */
+EpochGuard::~EpochGuard()
+{
+    _slot.depth--;
+    if (_outermost)
+        _slot.epoch.store(EPOCH_QUIESCENT, std::memory_order_release);
+}
+
+/**
+ * Domain shared by every structure read without locks. It lives until the
+ * program exits, so it outlives every thread that uses it.
+ */
+EpochDomain &epochDomain()
+{
+    static EpochDomain domain;
+    return domain;
+}
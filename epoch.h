@@ -0,0 +1,109 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Epoch.h
+ * An interface for epoch-based reclamation of memory read without locks.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define EPOCH_MAX_THREADS 256     /* threads that may be inside a guard at once */
+#define EPOCH_COLLECT_INTERVAL 64 /* retirements between attempts to reclaim */
+#define EPOCH_QUIESCENT UINT64_MAX
+
+/**
+ * Defers freeing objects that lock-free readers may still be reading.
+ * A reader holds an EpochGuard while it follows pointers; a writer unlinks
+ * an object so no new reader can reach it, then retires it. A retired object
+ * is freed once every reader has left the epoch in which it was retired,
+ * and the one after, so no guard that could have seen it is still held.
+ * A pin holds an epoch like a guard but is not tied to a thread, for
+ * readers that keep pointers for a long time. Pins never stop the epoch
+ * from advancing: objects are retired on behalf of an owner, and a pin only
+ * keeps what its own owner retired since, so one long-lived reader of a
+ * structure does not hold back the memory of every other.
+ * Everything but entering a guard takes a lock; entering a guard never blocks.
+ */
+class EpochDomain
+{
+public:
+    EpochDomain();
+    ~EpochDomain();
+
+    EpochDomain(const EpochDomain &) = delete;
+    EpochDomain &operator=(const EpochDomain &) = delete;
+
+    uint64_t newOwner() { return _nextOwner.fetch_add(1) + 1; }
+    void retire(void *object, void (*deleter)(void *), uint64_t owner = 0);
+    void retire(void *const *objects, int count, void (*deleter)(void *), uint64_t owner = 0);
+    void collect();
+    uint64_t pin(uint64_t owner = 0);
+    void unpin(uint64_t epoch, uint64_t owner = 0);
+    int getNumRetired();
+    int getNumRetired(uint64_t owner);
+    uint64_t getEpoch() const { return _epoch.load(std::memory_order_acquire); }
+
+private:
+    friend class EpochGuard;
+
+    /* Epoch announced by one reader thread, on its own cache line */
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> inUse;
+        int depth; /* guards held, only touched by the owning thread */
+    };
+
+    /* An object waiting to be freed, and the epoch it was retired in */
+    struct Retired
+    {
+        void *object;
+        void (*deleter)(void *);
+        uint64_t epoch;
+    };
+
+    /* What one owner retired, and the epochs its readers pinned */
+    struct Owner
+    {
+        std::deque<Retired> retired; /* in the order retired, so epochs never decrease */
+        std::vector<uint64_t> pins;
+    };
+
+    std::atomic<uint64_t> _epoch;
+    std::atomic<uint64_t> _nextOwner;
+    Slot _slots[EPOCH_MAX_THREADS];
+    std::unordered_map<uint64_t, Owner> _owners; /* only those with something retired or pinned */
+    int _sinceCollect;
+    std::mutex _lock;
+
+    Slot &threadSlot();
+    bool tryAdvance();
+    void reclaim();
+};
+
+/**
+ * Marks the calling thread as reading from an EpochDomain for its lifetime.
+ * Guards nest; only the outermost one announces an epoch.
+ */
+class EpochGuard
+{
+public:
+    explicit EpochGuard(EpochDomain &domain);
+    ~EpochGuard();
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
+
+private:
+    EpochDomain::Slot &_slot;
+    bool _outermost;
+};
+
+EpochDomain &epochDomain();
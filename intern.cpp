@@ -0,0 +1,121 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Intern.cpp
+ * Implementation for the string interning pools shared by every Account.
+ */
+
+#include "intern.h"
+#include <algorithm>
+#include <stdexcept>
+
+/* A string a thread interned recently, tagged with the pool that holds it */
+struct InternCacheEntry
+{
+    uint64_t serial;
+    size_t hash;
+    int id;
+};
+
+static thread_local InternCacheEntry internCache[INTERN_CACHE_SIZE];
+static std::atomic<uint64_t> poolSerial(1); /* 0 marks an empty cache entry */
+
+/**
+ * Constructor, creates an empty pool.
+ * @param maxBlocks number of blocks of INTERN_BLOCK_SIZE strings the pool may fill
+ */
+StringPool::StringPool(int maxBlocks)
+    : _size(0), _maxBlocks(std::min(maxBlocks, INTERN_MAX_BLOCKS)), _serial(poolSerial.fetch_add(1))
+{
+    for (int i = 0; i < INTERN_MAX_BLOCKS; i++)
+        _blocks[i].store(nullptr, std::memory_order_relaxed);
+}
+
+/**
+ * Destructor, frees every interned string.
+ */
+StringPool::~StringPool()
+{
+    for (int i = 0; i < INTERN_MAX_BLOCKS; i++)
+        delete[] _blocks[i].load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the id of a string, adding it to the pool the first time it is seen.
+ * @param str string to intern
+ * @return id of the canonical copy of str
+ */
+int StringPool::intern(std::string_view str)
+{
+    size_t hash = std::hash<std::string_view>()(str);
+    InternCacheEntry &cached = internCache[hash % INTERN_CACHE_SIZE];
+    if (cached.serial == _serial && cached.hash == hash && get(cached.id) == str)
+        return cached.id;
+
+    Shard &shard = _shards[hash / INTERN_CACHE_SIZE % INTERN_SHARDS];
+    int id;
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.ids.find(str);
+        if (found != shard.ids.end())
+        {
+            id = found->second;
+        }
+        else
+        {
+            id = add(str);
+            shard.ids.emplace(get(id), id);
+        }
+    }
+
+    cached = {_serial, hash, id};
+    return id;
+}
+
+/**
+ * Helper funtion for intern, stores a string under the next free id. Shards
+ * add at the same time, so ids are claimed and blocks published atomically.
+ * @param str string not yet in the pool
+ * @return id of the new canonical copy
+ */
+int StringPool::add(std::string_view str)
+{
+    int id = _size.load(std::memory_order_relaxed);
+    do
+    {
+        if ((id >> INTERN_BLOCK_BITS) == _maxBlocks)
+            throw std::length_error("StringPool is full");
+    } while (!_size.compare_exchange_weak(id, id + 1, std::memory_order_relaxed));
+
+    std::atomic<std::string *> &block = _blocks[id >> INTERN_BLOCK_BITS];
+    std::string *strings = block.load(std::memory_order_acquire);
+    if (strings == nullptr)
+    {
+        std::string *fresh = new std::string[INTERN_BLOCK_SIZE];
+        if (block.compare_exchange_strong(strings, fresh, std::memory_order_acq_rel))
+            strings = fresh;
+        else
+            delete[] fresh;
+    }
+
+    strings[id & (INTERN_BLOCK_SIZE - 1)] = str;
+    return id;
+}
+
+/**
+ * Pool of every username ever given to an Account.
+ */
+StringPool &usernamePool()
+{
+    static StringPool pool;
+    return pool;
+}
+
+/**
+ * Pool of badges and statuses, a small vocabulary shared by every Account.
+ */
+StringPool &vocabularyPool()
+{
+    static StringPool pool;
+    return pool;
+}
@@ -0,0 +1,68 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Intern.h
+ * An interface for the string interning pools shared by every Account.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define INTERN_BLOCK_BITS 10
+#define INTERN_BLOCK_SIZE (1 << INTERN_BLOCK_BITS)
+#define INTERN_MAX_BLOCKS 65536 /* 64M strings */
+#define INTERN_SHARDS 64        /* locks and maps a pool is split into by hash */
+#define INTERN_CACHE_SIZE 64    /* recent lookups each thread remembers */
+
+/**
+ * Stores one canonical copy of every distinct string handed to it and
+ * identifies it by a small integer id. Equal strings always get the same id
+ * and the same address, and an interned string is never moved or freed.
+ * intern() is thread-safe: each thread first checks the few strings it
+ * interned last, then locks only the shard the string hashes to. get()
+ * never takes a lock.
+ * A pool only grows. A username stays interned after every account using it
+ * is removed, so a process that sees more than maxBlocks * INTERN_BLOCK_SIZE
+ * distinct strings over its lifetime gets std::length_error from intern().
+ */
+class StringPool
+{
+public:
+    explicit StringPool(int maxBlocks = INTERN_MAX_BLOCKS);
+    ~StringPool();
+
+    StringPool(const StringPool &) = delete;
+    StringPool &operator=(const StringPool &) = delete;
+
+    int intern(std::string_view str);
+    const std::string &get(int id) const
+    {
+        return _blocks[id >> INTERN_BLOCK_BITS].load(std::memory_order_acquire)[id & (INTERN_BLOCK_SIZE - 1)];
+    }
+    int size() const { return _size.load(std::memory_order_acquire); }
+
+private:
+    /* The strings whose hash picks this shard */
+    struct alignas(64) Shard
+    {
+        std::mutex lock;
+        std::unordered_map<std::string_view, int> ids; /* views into the blocks */
+    };
+
+    std::atomic<std::string *> _blocks[INTERN_MAX_BLOCKS];
+    std::atomic<int> _size; /* ids handed out */
+    int _maxBlocks;
+    uint64_t _serial; /* tells this pool's entries in the thread caches apart */
+    Shard _shards[INTERN_SHARDS];
+
+    int add(std::string_view str);
+};
+
+StringPool &usernamePool();
+StringPool &vocabularyPool();
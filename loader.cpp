@@ -0,0 +1,611 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Loader.cpp
+ * Implementation for the memory-mapped .csv account loader.
+ */
+
+#include "loader.h"
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Destructor, unmaps the file.
+ */
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/**
+ * Maps the whole file read-only into memory.
+ * @param path path of the file to map
+ * @param sequential true if the file will be read front to back, false for random access
+ * @return true if the file could be opened and mapped, false otherwise
+ */
+bool MappedFile::open(const string &path, bool sequential)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    /* An empty file is valid but cannot be mapped */
+    if (info.st_size > 0)
+    {
+        void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        madvise(addr, info.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        _data = static_cast<const char *>(addr);
+        _size = info.st_size;
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+    ::close(fd);
+    return true;
+}
+
+/**
+ * Releases the mapping, if any.
+ */
+void MappedFile::close()
+{
+    if (_data != nullptr)
+        munmap(const_cast<char *>(_data), _size);
+    _data = nullptr;
+    _size = 0;
+}
+
+/**
+ * Syncs the directory holding a file, so a file just created or renamed
+ * there is still found under its name after a crash.
+ * @param path path of the file
+ * @return true if the directory was synced, false otherwise
+ */
+bool syncDirectory(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    string directory = (slash == string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+/**
+ * Constructor, nothing is open yet.
+ * @param bufferSize bytes read at a time
+ */
+StreamReader::StreamReader(size_t bufferSize)
+    : _bufferSize(bufferSize), _fd(-1), _current(nullptr), _free(STREAM_NUM_BUFFERS), _filled(STREAM_NUM_BUFFERS), _failed(false), _opened(false)
+{
+    for (char *&buffer : _buffers)
+        buffer = nullptr;
+}
+
+/**
+ * Destructor, stops the reader thread and frees the buffers.
+ */
+StreamReader::~StreamReader()
+{
+    close();
+}
+
+/**
+ * Opens a file and starts reading it ahead. A reader is opened only once.
+ * @param path path of the file to read
+ * @return true if the file could be opened and its buffers allocated, false otherwise
+ */
+bool StreamReader::open(const string &path)
+{
+    if (_opened)
+        return false;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) < 0 || S_ISDIR(info.st_mode))
+    {
+        ::close(fd);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t capacity = (_bufferSize + STREAM_BUFFER_ALIGN - 1) / STREAM_BUFFER_ALIGN * STREAM_BUFFER_ALIGN;
+    bool allocated = true;
+    for (char *&buffer : _buffers)
+    {
+        buffer = static_cast<char *>(aligned_alloc(STREAM_BUFFER_ALIGN, capacity));
+        allocated = allocated && buffer != nullptr;
+    }
+    if (!allocated)
+    {
+        for (char *&buffer : _buffers)
+        {
+            free(buffer);
+            buffer = nullptr;
+        }
+        ::close(fd);
+        return false;
+    }
+    for (char *buffer : _buffers)
+        _free.push(buffer);
+    _fd = fd;
+    _opened = true;
+    _reader = std::thread(&StreamReader::readLoop, this);
+    return true;
+}
+
+/**
+ * Waits for the next part of the file. The previous part is handed back to
+ * be refilled, so it must no longer be used.
+ * @param data receives the start of the part
+ * @param size receives its size
+ * @return true if a part was read, false at the end of the file or if reading failed
+ */
+bool StreamReader::next(const char *&data, size_t &size)
+{
+    if (_current != nullptr)
+        _free.push(_current);
+    _current = nullptr;
+
+    Filled filled;
+    if (!_filled.pop(filled))
+        return false;
+    _current = filled.data;
+    data = filled.data;
+    size = filled.size;
+    return true;
+}
+
+/**
+ * Stops reading ahead, closes the file and frees the buffers.
+ */
+void StreamReader::close()
+{
+    _free.close();
+    _filled.close();
+    if (_reader.joinable())
+        _reader.join();
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+    for (char *&buffer : _buffers)
+    {
+        free(buffer);
+        buffer = nullptr;
+    }
+    _current = nullptr;
+}
+
+/**
+ * Body of the reader thread: fills free buffers until the end of the file.
+ */
+void StreamReader::readLoop()
+{
+    /* Pipes cannot be read at an offset */
+    bool seekable = lseek(_fd, 0, SEEK_CUR) >= 0;
+    off_t offset = 0;
+    char *buffer;
+    while (_free.pop(buffer))
+    {
+        size_t size = 0;
+        while (size < _bufferSize)
+        {
+            ssize_t count = seekable ? pread(_fd, buffer + size, _bufferSize - size, offset + size)
+                                     : read(_fd, buffer + size, _bufferSize - size);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                _failed.store(true, std::memory_order_release);
+            if (count <= 0)
+                break;
+            size += count;
+        }
+        offset += size;
+        if (size == 0 || hasFailed() || !_filled.push({buffer, size}))
+            break;
+    }
+    _filled.close();
+}
+
+/**
+ * Advances to the next line. The line excludes its '\n' and a trailing '\r'.
+ * @param line view of the line inside the buffer
+ * @return true if a line was found, false at the end of the buffer
+ */
+bool LineCursor::next(std::string_view &line)
+{
+    if (_pos >= _size)
+        return false;
+
+    _start = _pos;
+    _line++;
+
+    const char *end = static_cast<const char *>(memchr(_data + _pos, '\n', _size - _pos));
+    size_t length = (end == nullptr) ? _size - _pos : end - (_data + _pos);
+    _pos += length + 1;
+
+    if (length > 0 && _data[_start + length - 1] == '\r')
+        length--;
+    line = std::string_view(_data + _start, length);
+
+    return true;
+}
+
+/**
+ * Advances to the next line and cuts it into fields. The line excludes its
+ * '\n' and a trailing '\r', and so does its last field.
+ * @param line view of the line inside the buffer
+ * @param fields receives the first CSV_NUM_FIELDS fields of the line
+ * @param numFields receives the number of fields in the line, which may exceed CSV_NUM_FIELDS
+ * @return true if a line was found, false at the end of the buffer
+ */
+bool CsvScanner::next(std::string_view &line, std::string_view *fields, int &numFields)
+{
+    if (_pos >= _size)
+        return false;
+
+    _start = _pos;
+    _line++;
+    numFields = 0;
+
+    size_t special;
+    while ((special = nextSpecial(_pos)) < _size && _data[special] == CSV_DELIM)
+    {
+        if (numFields < CSV_NUM_FIELDS)
+            fields[numFields] = std::string_view(_data + _pos, special - _pos);
+        numFields++;
+        _pos = special + 1;
+    }
+
+    size_t end = special;
+    if (end > _start && _data[end - 1] == '\r')
+        end--;
+    if (numFields < CSV_NUM_FIELDS)
+        fields[numFields] = std::string_view(_data + _pos, (end > _pos) ? end - _pos : 0);
+    numFields++;
+
+    line = std::string_view(_data + _start, end - _start);
+    _pos = special + 1;
+    return true;
+}
+/**
+ * Returns the offset of the first delimiter or newline at or after from,
+ * the size of the buffer if there is none.
+ */
+size_t CsvScanner::nextSpecial(size_t from)
+{
+    while (from < _size)
+    {
+        size_t block = from - from % CSV_BLOCK;
+        if (block != _block)
+        {
+            _mask = scanBlock(block);
+            _block = block;
+        }
+        uint64_t mask = _mask >> (from - block);
+        if (mask != 0)
+            return from + __builtin_ctzll(mask);
+        from = block + CSV_BLOCK;
+    }
+    return _size;
+}
+/**
+ * Marks the delimiters and newlines of one block. A block at the end of the
+ * buffer is scanned byte by byte, so nothing past the buffer is read.
+ */
+uint64_t CsvScanner::scanBlock(size_t block) const
+{
+    const char *data = _data + block;
+#ifdef __SSE2__
+    if (_size - block >= CSV_BLOCK)
+    {
+        const __m128i delim = _mm_set1_epi8(CSV_DELIM), newline = _mm_set1_epi8('\n');
+        uint64_t mask = 0;
+        for (int i = 0; i < CSV_BLOCK / 16; i++)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i));
+            __m128i found = _mm_or_si128(_mm_cmpeq_epi8(bytes, delim), _mm_cmpeq_epi8(bytes, newline));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(found) << (16 * i);
+        }
+        return mask;
+    }
+#endif
+
+    uint64_t mask = 0;
+    size_t count = std::min<size_t>(CSV_BLOCK, _size - block);
+    for (size_t i = 0; i < count; i++)
+        if (data[i] == CSV_DELIM || data[i] == '\n')
+            mask |= (uint64_t)1 << i;
+    return mask;
+}
+
+/**
+ * Divides a buffer into at most numChunks ranges that each end right after a
+ * '\n' (or at the end of the buffer), so no line is split between chunks.
+ * @param data buffer to divide
+ * @param size size of the buffer
+ * @param numChunks number of chunks wanted
+ * @return the non-empty chunks in buffer order
+ */
+std::vector<ChunkResult> splitChunks(const char *data, size_t size, int numChunks)
+{
+    std::vector<ChunkResult> chunks;
+    size_t begin = 0;
+    for (int i = 1; i <= numChunks && begin < size; i++)
+    {
+        size_t end = (i == numChunks) ? size : size / numChunks * i;
+        if (end < begin)
+            end = begin;
+
+        /* Move the boundary just past the next newline */
+        const char *newline = static_cast<const char *>(memchr(data + end, '\n', size - end));
+        end = (newline == nullptr || i == numChunks) ? size : newline - data + 1;
+
+        ChunkResult chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunk.lines = 0;
+        chunks.push_back(std::move(chunk));
+        begin = end;
+    }
+
+    return chunks;
+}
+
+/**
+ * Parses every line of a chunk into its accounts and errors.
+ * @param data buffer the chunk belongs to
+ * @param chunk chunk to parse, its accounts, errors and line count are filled in
+ */
+void parseChunk(const char *data, ChunkResult &chunk)
+{
+    CsvScanner scanner(data + chunk.begin, chunk.end - chunk.begin);
+    std::string_view line, fields[CSV_NUM_FIELDS];
+    int numFields;
+    Account newAcct;
+    string error;
+    while (scanner.next(line, fields, numFields))
+    {
+        if (!parseFields(fields, numFields, newAcct, error))
+        {
+            chunk.errors.push_back({scanner.lineNumber(), chunk.begin + scanner.lineOffset(), error});
+            continue;
+        }
+        chunk.accounts.push_back(newAcct);
+    }
+    chunk.lines = scanner.lineNumber();
+}
+
+/**
+ * Collects the errors of every chunk in file order, turning chunk-relative
+ * line numbers into file line numbers.
+ * @param chunks parsed chunks in file order
+ * @param errors receives the errors
+ */
+void mergeChunkErrors(std::vector<ChunkResult> &chunks, std::vector<LoadError> &errors)
+{
+    size_t lines = 0;
+    for (ChunkResult &chunk : chunks)
+    {
+        for (LoadError &error : chunk.errors)
+        {
+            error.line += lines;
+            errors.push_back(std::move(error));
+        }
+        lines += chunk.lines;
+    }
+}
+
+/**
+ * Parses a file as it is read and hands the accounts on in batches. The
+ * whole lines of each buffer are scanned in place; a line split between two
+ * buffers is put back together in a copy. Closes batches when done.
+ * @param reader opened reader of the file
+ * @param batches receives the accounts, in file order
+ * @param errors receives the line number, byte offset and reason of every malformed line
+ * @param batchSize accounts per batch
+ * @return true if the whole file was read, false if reading failed or batches was closed
+ */
+bool parseStream(StreamReader &reader, BoundedQueue<std::vector<Account>> &batches, std::vector<LoadError> &errors,
+                 size_t batchSize)
+{
+    std::vector<Account> batch;
+    Account newAcct;
+    string error;
+    size_t line = 0;
+    auto add = [&](bool parsed, size_t offset) {
+        line++;
+        if (!parsed)
+        {
+            errors.push_back({line, offset, error});
+            return true;
+        }
+        batch.push_back(newAcct);
+        if (batch.size() < batchSize)
+            return true;
+        bool open = batches.push(std::move(batch));
+        batch.clear();
+        return open;
+    };
+    auto addCarried = [&](std::string_view text, size_t offset) {
+        if (!text.empty() && text.back() == '\r')
+            text.remove_suffix(1);
+        return add(parseAccount(text, newAcct, error), offset);
+    };
+
+    string carry;           /* start of a line continued in the next buffer */
+    size_t carryOffset = 0; /* byte offset of that line */
+    size_t offset = 0;      /* byte offset of the current buffer */
+    bool open = true;
+    const char *data;
+    size_t size;
+    while (open && reader.next(data, size))
+    {
+        /* Finish the line carried over from the previous buffer */
+        size_t pos = 0;
+        if (!carry.empty())
+        {
+            const char *end = static_cast<const char *>(memchr(data, '\n', size));
+            if (end == nullptr)
+            {
+                carry.append(data, size);
+                offset += size;
+                continue;
+            }
+            carry.append(data, end - data);
+            open = addCarried(carry, carryOffset);
+            carry.clear();
+            pos = end - data + 1;
+        }
+
+        /* Whole lines are scanned in place, what follows the last newline is carried */
+        const char *last = static_cast<const char *>(memrchr(data + pos, '\n', size - pos));
+        size_t whole = (last == nullptr) ? pos : last - data + 1;
+        CsvScanner scanner(data + pos, whole - pos);
+        std::string_view text, fields[CSV_NUM_FIELDS];
+        int numFields;
+        while (open && scanner.next(text, fields, numFields))
+            open = add(parseFields(fields, numFields, newAcct, error), offset + pos + scanner.lineOffset());
+        if (open && whole < size)
+        {
+            carryOffset = offset + whole;
+            carry.assign(data + whole, size - whole);
+        }
+        offset += size;
+    }
+
+    bool complete = open && !reader.hasFailed();
+    if (complete && !carry.empty())
+        complete = addCarried(carry, carryOffset);
+    if (complete && !batch.empty())
+        complete = batches.push(std::move(batch));
+    if (reader.hasFailed())
+        errors.push_back({line + 1, offset, "file could not be read"});
+    batches.close();
+    return complete;
+}
+
+/**
+ * Splits a line into exactly CSV_NUM_FIELDS views.
+ * @param line line to split
+ * @param fields array of CSV_NUM_FIELDS views to fill
+ * @return true if the line has exactly CSV_NUM_FIELDS fields, false otherwise
+ */
+bool splitFields(std::string_view line, std::string_view *fields)
+{
+    int field = 0;
+    size_t start = 0;
+    for (size_t c = 0; c < line.size(); c++)
+    {
+        if (line[c] != CSV_DELIM)
+            continue;
+        if (field == CSV_NUM_FIELDS - 1)
+            return false;
+        fields[field++] = line.substr(start, c - start);
+        start = c + 1;
+    }
+    if (field != CSV_NUM_FIELDS - 1)
+        return false;
+
+    fields[field] = line.substr(start);
+    return true;
+}
+
+/**
+ * Parses an optionally signed decimal integer that spans the whole field.
+ * @param field text to parse
+ * @param value parsed integer
+ * @return true if the field is a valid integer, false otherwise
+ */
+bool parseInt(std::string_view field, int &value)
+{
+    /* from_chars takes a '-' but no '+' */
+    if (!field.empty() && field[0] == '+')
+    {
+        field.remove_prefix(1);
+        if (field.empty() || field[0] == '-')
+            return false;
+    }
+
+    const char *end = field.data() + field.size();
+    std::from_chars_result result = std::from_chars(field.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+/**
+ * Builds an Account from the fields of one line of the accounts .csv file.
+ * The discriminator range is checked here, so a bad line never throws.
+ * @param fields fields of a line in the "username,disc,nitro,badge,status" format
+ * @param numFields number of fields in the line
+ * @param account Account object to fill
+ * @param error description of the problem if the line is malformed
+ * @return true if the account was parsed, false otherwise
+ */
+bool parseFields(const std::string_view *fields, int numFields, Account &account, string &error)
+{
+    static const string outOfRange = "Discriminator out of valid range (" + std::to_string(MIN_DISC) + "-" + std::to_string(MAX_DISC) + ")";
+    if (numFields != CSV_NUM_FIELDS)
+    {
+        error = "expected 5 fields deliminated by a ','";
+        return false;
+    }
+
+    int disc, nitro;
+    if (!parseInt(fields[1], disc))
+    {
+        error = "invalid discriminator";
+        return false;
+    }
+    if (!parseInt(fields[2], nitro))
+    {
+        error = "invalid nitro flag";
+        return false;
+    }
+    if (disc < MIN_DISC || disc > MAX_DISC)
+    {
+        error = outOfRange;
+        return false;
+    }
+
+    account = Account(fields[0], disc, nitro, fields[3], fields[4]);
+    return true;
+}
+
+/**
+ * Builds an Account from one line of the accounts .csv file.
+ * @param line line in the "username,disc,nitro,badge,status" format
+ * @param account Account object to fill
+ * @param error description of the problem if the line is malformed
+ * @return true if the account was parsed, false otherwise
+ */
+bool parseAccount(std::string_view line, Account &account, string &error)
+{
+    std::string_view fields[CSV_NUM_FIELDS];
+    return parseFields(fields, splitFields(line, fields) ? CSV_NUM_FIELDS : 0, account, error);
+}
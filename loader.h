@@ -0,0 +1,234 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Loader.h
+ * An interface for the memory-mapped .csv account loader.
+ */
+
+#pragma once
+
+#include "dtree.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define CSV_DELIM ','
+#define CSV_NUM_FIELDS 5
+
+#define CSV_BLOCK 64 /* bytes scanned for delimiters at a time */
+
+#define STREAM_BUFFER_SIZE (4 << 20) /* bytes read at a time */
+#define STREAM_NUM_BUFFERS 2         /* one is filled while the other is parsed */
+#define STREAM_BUFFER_ALIGN 4096
+#define STREAM_BATCH_SIZE 4096 /* accounts handed to the builder at a time */
+#define STREAM_QUEUE_DEPTH 4   /* batches parsed ahead of the builder */
+
+/**
+ * Location and reason of a line that could not be turned into an Account.
+ */
+struct LoadError
+{
+    size_t line;   /* 1-based line number */
+    size_t offset; /* byte offset of the start of the line */
+    string message;
+};
+
+/**
+ * Read-only memory mapping of a whole file. The mapping is released when
+ * the object is destroyed.
+ */
+class MappedFile
+{
+public:
+    MappedFile() : _data(nullptr), _size(0) {}
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const string &path, bool sequential = true);
+    void close();
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const char *_data;
+    size_t _size;
+};
+
+/**
+ * Queue between two threads that holds at most a fixed number of items:
+ * push blocks while it is full and pop blocks while it is empty. Once
+ * closed, push refuses new items and pop drains the rest, then fails.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _notFull.wait(lock, [this]() { return _closed || _items.size() < _capacity; });
+        if (_closed)
+            return false;
+        _items.push_back(std::move(item));
+        _notEmpty.notify_one();
+        return true;
+    }
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _notEmpty.wait(lock, [this]() { return _closed || !_items.empty(); });
+        if (_items.empty())
+            return false;
+        item = std::move(_items.front());
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _closed = true;
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    bool _closed;
+    std::deque<T> _items;
+    std::mutex _lock;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+};
+
+/**
+ * Reads a file front to back on its own thread, into a fixed set of aligned
+ * buffers, so reading the next buffer overlaps with parsing the last one.
+ * Regular files are read with pread; pipes and other streams with read.
+ * Memory use is fixed by the buffer size, whatever the size of the file.
+ */
+class StreamReader
+{
+public:
+    explicit StreamReader(size_t bufferSize = STREAM_BUFFER_SIZE);
+    ~StreamReader();
+
+    StreamReader(const StreamReader &) = delete;
+    StreamReader &operator=(const StreamReader &) = delete;
+
+    bool open(const string &path);
+    bool next(const char *&data, size_t &size);
+    void close();
+
+    bool hasFailed() const { return _failed.load(std::memory_order_acquire); }
+
+private:
+    /* A buffer and how many of its bytes were read */
+    struct Filled
+    {
+        char *data;
+        size_t size;
+    };
+
+    size_t _bufferSize;
+    int _fd;
+    char *_buffers[STREAM_NUM_BUFFERS];
+    char *_current; /* handed out by next(), returned to the reader by the following call */
+    BoundedQueue<char *> _free;
+    BoundedQueue<Filled> _filled;
+    std::atomic<bool> _failed;
+    bool _opened; /* a reader is only opened once */
+    std::thread _reader;
+
+    void readLoop();
+};
+
+/**
+ * Walks a buffer line by line without copying it. Each line is handed out as
+ * a view into the buffer together with its line number and byte offset.
+ */
+class LineCursor
+{
+public:
+    LineCursor(const char *data, size_t size) : _data(data), _size(size), _pos(0), _line(0) {}
+
+    bool next(std::string_view &line);
+    size_t lineNumber() const { return _line; }
+    size_t lineOffset() const { return _start; }
+
+private:
+    const char *_data;
+    size_t _size;
+    size_t _pos;
+    size_t _line;
+    size_t _start;
+};
+
+/**
+ * Walks a buffer line by line like LineCursor, also cutting each line into
+ * fields. Delimiters and newlines are found CSV_BLOCK bytes at a time: one
+ * bitmask per block marks them all, and each field boundary is then the
+ * next set bit. Uses SSE2 where available, plain comparisons otherwise.
+ */
+class CsvScanner
+{
+public:
+    CsvScanner(const char *data, size_t size) : _data(data), _size(size), _pos(0), _line(0), _block(SIZE_MAX), _mask(0) {}
+
+    bool next(std::string_view &line, std::string_view *fields, int &numFields);
+    size_t lineNumber() const { return _line; }
+    size_t lineOffset() const { return _start; }
+
+private:
+    const char *_data;
+    size_t _size;
+    size_t _pos;
+    size_t _line;
+    size_t _start;
+    size_t _block;  /* offset of the block _mask describes */
+    uint64_t _mask; /* bit i set if byte _block + i is a delimiter or newline */
+
+    size_t nextSpecial(size_t from);
+    uint64_t scanBlock(size_t block) const;
+};
+
+/**
+ * Accounts and errors parsed from one newline-aligned chunk of a file.
+ * Error line numbers are relative to the chunk until the chunks are stitched
+ * back together with mergeChunkErrors.
+ */
+struct ChunkResult
+{
+    size_t begin; /* byte offset of the chunk in the file */
+    size_t end;
+    size_t lines; /* number of lines in the chunk */
+    std::vector<Account> accounts;
+    std::vector<LoadError> errors;
+};
+
+bool syncDirectory(const string &path);
+
+std::vector<ChunkResult> splitChunks(const char *data, size_t size, int numChunks);
+void parseChunk(const char *data, ChunkResult &chunk);
+void mergeChunkErrors(std::vector<ChunkResult> &chunks, std::vector<LoadError> &errors);
+bool parseStream(StreamReader &reader, BoundedQueue<std::vector<Account>> &batches, std::vector<LoadError> &errors,
+                 size_t batchSize = STREAM_BATCH_SIZE);
+
+bool splitFields(std::string_view line, std::string_view *fields);
+bool parseInt(std::string_view field, int &value);
+bool parseFields(const std::string_view *fields, int numFields, Account &account, string &error);
+bool parseAccount(std::string_view line, Account &account, string &error);
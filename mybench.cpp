@@ -0,0 +1,783 @@
+/**
+ * Benchmarks for the UTree and DTree classes.
+ * Usage: mybench [rows] [benchmark]
+ * The lookup and concurrent benchmarks only run when named, their rows are
+ * users: mybench 10000000 lookup
+ * The wal benchmark also only runs when named, it syncs to /tmp.
+ * The parse benchmark only runs when named, its rows are megabytes of
+ * accounts file: mybench 1024 parse
+ */
+
+#include "utree.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+#define BENCH_ROWS 2000000
+#define BENCH_USERS 200000
+
+using Clock = std::chrono::steady_clock;
+
+/* Every heap allocation made by the program is counted. The replacements
+ * are never inlined, so the compiler pairs each delete with its new rather
+ * than seeing free() called on memory from operator new */
+static std::atomic<long> numAllocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+__attribute__((noinline)) void operator delete[](void *ptr) noexcept
+{
+    operator delete(ptr);
+}
+__attribute__((noinline)) void operator delete[](void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+class Bencher
+{
+public:
+    Bencher(int rows) : _rows(rows) {}
+
+    void benchParallelLoad();
+    void benchAllocations();
+    void benchDTreeInsert();
+    void benchUserChurn();
+    void benchUserLookup();
+    void benchFrozenLookup();
+    void benchConcurrent();
+    void benchSnapshot();
+    void benchSaveOpen();
+    void benchWal();
+    void benchStreamLoad();
+    void benchParse();
+    void benchPrint();
+
+private:
+    int _rows;
+
+    string writeAccounts(int rows, int users);
+    double seconds(Clock::time_point start) const;
+};
+
+/**
+ * Writes a synthetic accounts .csv file with random usernames and discriminators.
+ * @return path of the file
+ */
+string Bencher::writeAccounts(int rows, int users)
+{
+    string path = "/tmp/mybench_accounts.csv";
+    std::mt19937 rng(10);
+    std::uniform_int_distribution<> distUser(0, users - 1);
+    std::uniform_int_distribution<> distDisc(MIN_DISC, MAX_DISC);
+
+    std::ofstream out(path);
+    for (int i = 0; i < rows; i++)
+        out << "user" << distUser(rng) << "," << distDisc(rng) << "," << (i & 1) << ",early,online\n";
+    return path;
+}
+
+double Bencher::seconds(Clock::time_point start) const
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Parse + build time of a fresh load for an increasing number of threads.
+ */
+void Bencher::benchParallelLoad()
+{
+    string path = writeAccounts(_rows, BENCH_USERS);
+    int maxThreads = std::max(32u, std::thread::hardware_concurrency());
+
+    cout << "Parallel load of " << _rows << " rows (" << std::thread::hardware_concurrency() << " hardware threads)" << endl;
+    double base = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        UTree utree;
+        std::vector<LoadError> errors;
+        Clock::time_point start = Clock::now();
+        utree.loadData(path, false, errors, threads);
+        double elapsed = seconds(start);
+        if (threads == 1)
+            base = elapsed;
+        cout << "\tthreads " << threads << ": " << elapsed << " s, " << _rows / elapsed / 1e6 << " Mrows/s, speedup " << base / elapsed << endl;
+    }
+    std::remove(path.c_str());
+}
+
+/**
+ * Heap allocations and time per operation on a populated tree.
+ */
+void Bencher::benchAllocations()
+{
+    const int users = 1000;
+    const int ops = _rows / 10;
+    UTree utree;
+    std::vector<string> names;
+    for (int u = 0; u < users; u++)
+        names.push_back("user" + std::to_string(u));
+    for (int i = 0; i < ops; i++)
+        utree.insert(Account(names[i % users], (i / users) * 2, 0, "early", "online"));
+
+    cout << "Allocations per operation (" << users << " users, " << ops << " accounts)" << endl;
+    auto report = [&](const char *name, Clock::time_point start, long before) {
+        double elapsed = seconds(start);
+        cout << "\t" << name << ": " << double(numAllocations - before) / ops << " allocations, "
+             << elapsed / ops * 1e9 << " ns" << endl;
+    };
+
+    std::vector<Account> accounts;
+    for (int i = 0; i < ops; i++)
+        accounts.push_back(Account(names[i % users], (i / users) * 2 + 1, 0, "early", "online"));
+
+    long before = numAllocations;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ops; i++)
+        utree.insert(accounts[i]);
+    report("insert", start, before);
+
+    long found = 0;
+    before = numAllocations;
+    start = Clock::now();
+    for (int i = 0; i < ops; i++)
+        found += utree.retrieveUser(names[i % users], (i / users) * 2) != nullptr;
+    report("retrieveUser", start, before);
+
+    before = numAllocations;
+    start = Clock::now();
+    for (int i = 0; i < ops; i++)
+        found += utree.numUsers(names[i % users]);
+    report("numUsers", start, before);
+
+    before = numAllocations;
+    start = Clock::now();
+    for (int i = 0; i < ops; i++)
+    {
+        DNode *removed;
+        if (utree.removeUser(names[i % users], (i / users) * 2 + 1, removed))
+            delete removed;
+    }
+    report("removeUser", start, before);
+
+    if (found == 0)
+        cout << "\tnothing found" << endl;
+}
+
+/**
+ * Latency distribution of DTree::insert, in random and ascending order.
+ */
+void Bencher::benchDTreeInsert()
+{
+    const int perTree = DENSE_THRESHOLD - 1;
+    const int trees = std::max(1, _rows / perTree);
+    std::mt19937 rng(10);
+    std::vector<int> discs(NUM_DISCS);
+    for (int i = 0; i < NUM_DISCS; i++)
+        discs[i] = MIN_DISC + i;
+
+    cout << "DTree insert latency (" << trees << " trees of " << perTree << " accounts)" << endl;
+    for (int ascending = 0; ascending <= 1; ascending++)
+    {
+        std::vector<double> latencies;
+        latencies.reserve(trees * perTree);
+        for (int t = 0; t < trees; t++)
+        {
+            if (ascending)
+                std::sort(discs.begin(), discs.begin() + perTree);
+            else
+                std::shuffle(discs.begin(), discs.end(), rng);
+
+            DTree dtree;
+            for (int i = 0; i < perTree; i++)
+            {
+                Account acct("bench", discs[i], 0, "", "");
+                Clock::time_point start = Clock::now();
+                dtree.insert(acct);
+                latencies.push_back(seconds(start) * 1e9);
+            }
+        }
+
+        double total = 0;
+        for (double latency : latencies)
+            total += latency;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))]; };
+        cout << "\t" << (ascending ? "ascending" : "random") << ": mean " << total / latencies.size() << " ns, p50 "
+             << percentile(0.5) << " ns, p99 " << percentile(0.99) << " ns, p99.9 " << percentile(0.999)
+             << " ns, p99.99 " << percentile(0.9999) << " ns, max " << latencies.back() << " ns" << endl;
+    }
+}
+
+/**
+ * Time per operation and tree height while whole users are inserted and
+ * deleted at random, so every removal deletes a UNode.
+ */
+void Bencher::benchUserChurn()
+{
+    const int users = std::max(1, _rows / 10);
+    std::mt19937 rng(10);
+    std::uniform_int_distribution<> distUser(0, users - 1);
+    std::vector<string> names;
+    for (int u = 0; u < users; u++)
+        names.push_back("user" + std::to_string(u));
+
+    UTree utree;
+    std::vector<bool> present(users, false);
+    int numPresent = 0;
+    long inserts = 0, removes = 0;
+
+    cout << "User churn (" << users << " usernames, " << _rows << " operations)" << endl;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < _rows; i++)
+    {
+        int user = distUser(rng);
+        if (!present[user])
+        {
+            utree.insert(Account(names[user], user % NUM_DISCS, 0, "early", "online"));
+            numPresent++;
+            inserts++;
+        }
+        else
+        {
+            DNode *removed;
+            if (utree.removeUser(names[user], user % NUM_DISCS, removed))
+                delete removed;
+            numPresent--;
+            removes++;
+        }
+        present[user] = !present[user];
+    }
+    double elapsed = seconds(start);
+
+    cout << "\t" << inserts << " inserts, " << removes << " removes: " << elapsed / _rows * 1e9 << " ns/op" << endl;
+    cout << "\t" << numPresent << " users left, height " << utree.getHeight()
+         << " (AVL bound " << 1.44 * std::log2(numPresent + 2) << ")" << endl;
+}
+
+/**
+ * Lookup throughput of the AVL and BTree username indexes over rows users,
+ * each with one account, one retrieveUser at a time and through the batch
+ * retrieveUsers. Usernames are random, so lookups miss the cache.
+ */
+void Bencher::benchUserLookup()
+{
+    const int lookups = 1000000;
+    std::vector<string> names(_rows);
+    for (int u = 0; u < _rows; u++)
+    {
+        /* splitmix64 scrambles u into 14 hex digits, short enough to stay inline */
+        uint64_t z = (u + 1) * 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        char name[16];
+        snprintf(name, sizeof(name), "u%014llx", (unsigned long long)(z >> 8));
+        names[u] = name;
+    }
+    std::vector<Account> accounts; /* interned before anything is timed */
+    accounts.reserve(_rows);
+    for (int u = 0; u < _rows; u++)
+        accounts.push_back(Account(names[u], u % NUM_DISCS, 0, "early", "online"));
+
+    std::mt19937 rng(10);
+    std::uniform_int_distribution<> distUser(0, _rows - 1);
+    std::vector<int> order(lookups);
+    std::vector<std::pair<std::string_view, int>> queries(lookups);
+    for (int i = 0; i < lookups; i++)
+    {
+        order[i] = distUser(rng);
+        queries[i] = {names[order[i]], order[i] % NUM_DISCS};
+    }
+    std::vector<DNode *> results(lookups);
+
+    cout << "User lookup (" << _rows << " users, " << lookups << " random lookups)" << endl;
+    const char *labels[] = {"avl", "btree"};
+    UserIndex indexes[] = {UserIndex::AVL, UserIndex::BTREE};
+    for (int i = 0; i < 2; i++)
+    {
+        UTree utree(true, indexes[i]);
+        Clock::time_point start = Clock::now();
+        for (const Account &acct : accounts)
+            utree.insert(acct);
+        double build = seconds(start);
+
+        long found = 0;
+        start = Clock::now();
+        for (int user : order)
+            found += utree.retrieveUser(names[user], user % NUM_DISCS) != nullptr;
+        double elapsed = seconds(start);
+
+        long batchFound = 0;
+        start = Clock::now();
+        utree.retrieveUsers(queries.data(), lookups, results.data());
+        double batch = seconds(start);
+        for (DNode *result : results)
+            batchFound += result != nullptr;
+
+        cout << "\t" << labels[i] << ": insert " << build / _rows * 1e9 << " ns, lookup " << elapsed / lookups * 1e9
+             << " ns (" << lookups / elapsed / 1e6 << " M/s), height " << utree.getHeight() << ", found " << found << endl;
+        cout << "\t" << labels[i] << " batch: lookup " << batch / lookups * 1e9 << " ns (" << lookups / batch / 1e6
+             << " M/s), found " << batchFound << endl;
+    }
+}
+
+/**
+ * DTree::retrieve on linked trees against the same trees frozen, with enough
+ * trees that they do not all fit in the cache.
+ */
+void Bencher::benchFrozenLookup()
+{
+    const int perTree = DENSE_THRESHOLD / 2;
+    const int trees = std::max(1, _rows / perTree);
+    const int lookups = 2000000;
+    std::mt19937 rng(10);
+    std::uniform_int_distribution<> distDisc(MIN_DISC, MAX_DISC);
+    std::uniform_int_distribution<> distTree(0, trees - 1);
+
+    std::vector<DTree> dtrees(trees);
+    for (DTree &dtree : dtrees)
+        while (dtree.getNumUsers() < perTree)
+            dtree.insert(Account("bench", distDisc(rng), 0, "", ""));
+    std::vector<std::pair<int, int>> queries(lookups);
+    for (auto &query : queries)
+        query = {distTree(rng), distDisc(rng)};
+
+    cout << "DTree lookup (" << trees << " trees of " << perTree << " accounts, " << lookups << " lookups)" << endl;
+    for (int frozen = 0; frozen <= 1; frozen++)
+    {
+        if (frozen)
+            for (DTree &dtree : dtrees)
+                dtree.freeze();
+
+        long found = 0;
+        Clock::time_point start = Clock::now();
+        for (auto &query : queries)
+            found += dtrees[query.first].retrieve(query.second) != nullptr;
+        double elapsed = seconds(start);
+        cout << "\t" << (frozen ? "frozen" : "linked") << ": " << elapsed / lookups * 1e9 << " ns, found " << found << endl;
+    }
+}
+
+/**
+ * Throughput on 1 to 32 threads, with a plain UTree behind one mutex and
+ * with a concurrent UTree: first of a read-mostly workload, 500 findUser
+ * calls to each insert or remove, over rows users with four accounts each;
+ * then of writes alone, to 64 users sharing rows accounts.
+ */
+void Bencher::benchConcurrent()
+{
+    const int opsPerThread = 200000;
+    const int maxThreads = 32;
+    cout << "Concurrent UTree (" << _rows << " rows, " << opsPerThread << " ops per thread, "
+         << std::thread::hardware_concurrency() << " hardware threads)" << endl;
+
+    auto measure = [&](const char *label, int users, int writeEvery) {
+        std::vector<string> names(users);
+        for (int u = 0; u < users; u++)
+            names[u] = "c" + std::to_string(u * 2654435761U % 1000000007U);
+        int perUser = std::max(4, _rows / users);
+
+        for (int concurrent = 0; concurrent <= 1; concurrent++)
+        {
+            UTree utree(true, UserIndex::AVL, concurrent);
+            for (int u = 0; u < users; u++)
+                for (int disc = 0; disc < perUser; disc++)
+                    utree.insert(Account(names[u], disc, 0, "early", "online"));
+
+            std::mutex global;
+            auto work = [&](int t, long &found) {
+                std::mt19937 rng(t);
+                std::uniform_int_distribution<> distUser(0, users - 1);
+                for (int i = 0; i < opsPerThread; i++)
+                {
+                    int user = distUser(rng);
+                    bool write = rng() % writeEvery == 0;
+                    std::unique_lock<std::mutex> guard(global, std::defer_lock);
+                    if (!concurrent)
+                        guard.lock();
+
+                    Account acct;
+                    if (!write)
+                        found += utree.findUser(names[user], i % perUser, acct);
+                    else if (!utree.insert(Account(names[user], perUser + t, 0, "early", "online")))
+                    {
+                        DNode *removed;
+                        utree.removeUser(names[user], perUser + t, removed);
+                        delete removed;
+                    }
+                }
+            };
+
+            for (int threads = 1; threads <= maxThreads; threads *= 2)
+            {
+                std::vector<long> found(threads * 8, 0); /* one cache line apart */
+                std::vector<std::thread> workers;
+                Clock::time_point start = Clock::now();
+                for (int t = 0; t < threads; t++)
+                    workers.emplace_back(work, t, std::ref(found[t * 8]));
+                for (std::thread &worker : workers)
+                    worker.join();
+                double elapsed = seconds(start);
+
+                cout << "\t" << label << ", " << (concurrent ? "concurrent" : "mutex") << " " << threads << " threads: "
+                     << (double)threads * opsPerThread / elapsed / 1e6 << " M ops/s" << endl;
+            }
+        }
+    };
+
+    measure("read-mostly", _rows, 500);
+    measure("writes", 64, 1);
+}
+
+/**
+ * Cost of a snapshot of rows accounts spread over BENCH_USERS users against
+ * deep copies of every DTree, and what keeping snapshots possible costs a
+ * write.
+ */
+void Bencher::benchSnapshot()
+{
+    const int snapshots = 10000;
+    const int writes = 200000;
+    const int users = std::min(BENCH_USERS, std::max(1, _rows / 10));
+    std::mt19937 rng(10);
+    std::uniform_int_distribution<> distUser(0, users - 1);
+    std::vector<string> names;
+    for (int u = 0; u < users; u++)
+        names.push_back("user" + std::to_string(u));
+
+    UTree utree;
+    for (int i = 0; i < _rows; i++)
+        utree.insert(Account(names[i % users], i / users % MAX_DISC, 0, "early", "online"));
+    auto churn = [&]() {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < writes; i++)
+        {
+            int user = distUser(rng);
+            DNode *removed;
+            if (utree.removeUser(names[user], MAX_DISC, removed))
+                delete removed;
+            else
+                utree.insert(Account(names[user], MAX_DISC, 0, "early", "online"));
+        }
+        return seconds(start) / writes * 1e9;
+    };
+
+    cout << "Snapshots (" << _rows << " accounts, " << users << " users)" << endl;
+    double plainWrite = churn();
+
+    Clock::time_point start = Clock::now();
+    std::vector<DTree> copies(users);
+    for (int u = 0; u < users; u++)
+        copies[u] = *utree.retrieve(names[u])->getDTree();
+    double deepCopy = seconds(start);
+    copies.clear();
+
+    start = Clock::now();
+    UTree::Snapshot first = utree.snapshot();
+    double build = seconds(start);
+    start = Clock::now();
+    for (int i = 0; i < snapshots; i++)
+        UTree::Snapshot snapshot = utree.snapshot();
+    double take = seconds(start) / snapshots;
+
+    double persistentWrite = churn();
+    cout << "\tdeep copy of every DTree: " << deepCopy * 1e3 << " ms" << endl;
+    cout << "\tfirst snapshot (builds the index): " << build * 1e3 << " ms, later snapshots: " << take * 1e9 << " ns" << endl;
+    cout << "\twrite: " << plainWrite << " ns plain, " << persistentWrite << " ns keeping snapshots" << endl;
+}
+
+/**
+ * Time until the first lookup answers when starting from the .csv file
+ * against starting from a saved user file, and the cost of saving it.
+ */
+void Bencher::benchSaveOpen()
+{
+    string csv = writeAccounts(_rows, BENCH_USERS);
+    string saved = "/tmp/mybench_accounts.utree";
+    Account found;
+
+    cout << "Save and open (" << _rows << " rows)" << endl;
+    Clock::time_point start = Clock::now();
+    UTree loaded;
+    std::vector<LoadError> errors;
+    loaded.loadData(csv, false, errors, 0);
+    loaded.findUser("user1", MIN_DISC, found);
+    cout << "\tloadData + first lookup: " << seconds(start) * 1e3 << " ms" << endl;
+
+    start = Clock::now();
+    loaded.save(saved);
+    cout << "\tsave: " << seconds(start) * 1e3 << " ms" << endl;
+
+    /* The loaded tree is kept until the end, freeing it would leave the
+     * allocator consolidating its nodes during the timing below */
+    start = Clock::now();
+    UTree utree;
+    utree.open(saved);
+    utree.findUser("user1", MIN_DISC, found);
+    cout << "\topen + first lookup: " << seconds(start) * 1e3 << " ms" << endl;
+
+    std::remove(csv.c_str());
+    std::remove(saved.c_str());
+}
+
+/**
+ * Latency of a write to a concurrent tree with and without the write-ahead
+ * log, for an increasing number of writer threads, and how many records
+ * each sync covers.
+ */
+void Bencher::benchWal()
+{
+    const int writesPerThread = 500; /* every thread inserts its own discriminators */
+    const int maxThreads = 16;
+    string snapshotPath = "/tmp/mybench_wal.utree", logPath = "/tmp/mybench_wal.log";
+
+    cout << "Write-ahead log (" << writesPerThread << " inserts per thread)" << endl;
+    for (int logged = 0; logged <= 1; logged++)
+        for (int threads = 1; threads <= maxThreads; threads *= 4)
+        {
+            std::remove(snapshotPath.c_str());
+            std::remove(logPath.c_str());
+            UTree utree(false, UserIndex::AVL, true);
+            if (logged)
+                utree.recover(snapshotPath, logPath);
+
+            std::vector<std::vector<double>> latencies(threads);
+            std::vector<std::thread> workers;
+            Clock::time_point start = Clock::now();
+            for (int t = 0; t < threads; t++)
+                workers.emplace_back([&, t]() {
+                    for (int i = 0; i < writesPerThread; i++)
+                    {
+                        Clock::time_point begin = Clock::now();
+                        utree.insert(Account("w" + std::to_string(i % 100), t * writesPerThread + i, 0, "early", "online"));
+                        latencies[t].push_back(seconds(begin) * 1e6);
+                    }
+                });
+            for (std::thread &worker : workers)
+                worker.join();
+            double elapsed = seconds(start);
+
+            std::vector<double> all;
+            for (std::vector<double> &mine : latencies)
+                all.insert(all.end(), mine.begin(), mine.end());
+            std::sort(all.begin(), all.end());
+            cout << "\t" << (logged ? "logged" : "unlogged") << " " << threads << " threads: "
+                 << all.size() / elapsed / 1e3 << " K writes/s, latency p50 " << all[all.size() / 2]
+                 << " us, p99 " << all[all.size() * 99 / 100] << " us, max " << all.back() << " us";
+            if (logged)
+                cout << ", " << (double)utree.getLog()->getNumRecords() / utree.getLog()->getNumSyncs() << " records per sync";
+            cout << endl;
+        }
+    std::remove(snapshotPath.c_str());
+    std::remove(logPath.c_str());
+}
+
+/**
+ * Appending load of a whole file, and how much the peak resident memory grew
+ * while loading it, the tree included.
+ */
+void Bencher::benchStreamLoad()
+{
+    string path = writeAccounts(_rows, BENCH_USERS);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long before = usage.ru_maxrss;
+
+    cout << "Appending load of " << _rows << " rows" << endl;
+    UTree utree;
+    std::vector<LoadError> errors;
+    Clock::time_point start = Clock::now();
+    int inserted = utree.loadData(path, true, errors);
+    double elapsed = seconds(start);
+    getrusage(RUSAGE_SELF, &usage);
+
+    cout << "\t" << inserted << " accounts in " << elapsed << " s, " << _rows / elapsed / 1e6 << " Mrows/s, peak resident memory grew "
+         << (usage.ru_maxrss - before) / 1024 << " MB" << endl;
+    std::remove(path.c_str());
+}
+
+/**
+ * Throughput of cutting a synthetic accounts file of _rows megabytes into
+ * fields, and of parsing it into Accounts, line by line against the block
+ * scanner. Nothing is kept, so the file may be larger than memory.
+ */
+void Bencher::benchParse()
+{
+    string path = "/tmp/mybench_parse.csv";
+    {
+        std::mt19937 rng(10);
+        std::ostringstream block;
+        while (block.tellp() < (1 << 20))
+            block << "user" << rng() % BENCH_USERS << "," << rng() % (MAX_DISC + 1) << "," << (rng() & 1) << ",early,online\n";
+        string text = block.str();
+        std::ofstream out(path, std::ios::binary);
+        for (int mb = 0; mb < _rows; mb++)
+            out << text;
+    }
+    MappedFile file;
+    file.open(path);
+    double megabytes = file.size() / 1e6;
+
+    /* Fault every page in first, so no variant pays for the mapping */
+    volatile long touched = 0;
+    for (size_t offset = 0; offset < file.size(); offset += 4096)
+        touched += file.data()[offset];
+
+    cout << "CSV parsing (" << megabytes << " MB)" << endl;
+    auto report = [&](const char *name, Clock::time_point start, long lines) {
+        cout << "\t" << name << ": " << megabytes / seconds(start) << " MB/s (" << lines << " lines)" << endl;
+    };
+
+    Clock::time_point start = Clock::now();
+    LineCursor cursor(file.data(), file.size());
+    std::string_view line, fields[CSV_NUM_FIELDS];
+    long lines = 0;
+    while (cursor.next(line))
+        lines += splitFields(line, fields);
+    report("split, line by line", start, lines);
+
+    start = Clock::now();
+    CsvScanner scanner(file.data(), file.size());
+    int numFields;
+    lines = 0;
+    while (scanner.next(line, fields, numFields))
+        lines += numFields == CSV_NUM_FIELDS;
+    report("split, block scanner", start, lines);
+
+    start = Clock::now();
+    LineCursor accounts(file.data(), file.size());
+    Account acct;
+    string error;
+    lines = 0;
+    while (accounts.next(line))
+        lines += parseAccount(line, acct, error);
+    report("parse, line by line", start, lines);
+
+    start = Clock::now();
+    CsvScanner scanned(file.data(), file.size());
+    lines = 0;
+    while (scanned.next(line, fields, numFields))
+        lines += parseFields(fields, numFields, acct, error);
+    report("parse, block scanner", start, lines);
+
+    std::remove(path.c_str());
+}
+
+/**
+ * Time and heap allocations of printing and dumping a loaded UTree to
+ * /dev/null, one flushed ostream line per account against a buffered sink.
+ */
+void Bencher::benchPrint()
+{
+    string path = writeAccounts(_rows, BENCH_USERS);
+    UTree utree;
+    utree.loadData(path, false);
+    std::remove(path.c_str());
+
+    string printed, dumped;
+    {
+        StringSink out(printed);
+        utree.printUsers(out);
+    }
+    {
+        StringSink out(dumped);
+        utree.dump(out);
+    }
+    double printedMB = printed.size() / 1e6, dumpedMB = dumped.size() / 1e6;
+    printed = dumped = string();
+
+    cout << "Printing " << _rows << " accounts (" << printedMB << " MB, dump " << dumpedMB << " MB)" << endl;
+    std::ofstream devNull("/dev/null");
+    int fd = open("/dev/null", O_WRONLY);
+    auto run = [&](const char *name, double megabytes, const std::function<void()> &print) {
+        long allocations = numAllocations.load();
+        Clock::time_point start = Clock::now();
+        print();
+        double elapsed = seconds(start);
+        cout << "\t" << name << ": " << elapsed << " s, " << megabytes / elapsed << " MB/s, "
+             << numAllocations.load() - allocations << " allocations" << endl;
+    };
+
+    run("ostream, endl per account", printedMB, [&]() {
+        for (UTree::const_iterator it = utree.begin(); it != utree.end(); ++it)
+            devNull << *it << endl;
+    });
+    run("printUsers to an ostream", printedMB, [&]() {
+        StreamSink out(devNull);
+        utree.printUsers(out);
+    });
+    run("printUsers to a descriptor", printedMB, [&]() {
+        FdSink out(fd);
+        utree.printUsers(out);
+    });
+    run("dump to a descriptor", dumpedMB, [&]() {
+        FdSink out(fd);
+        utree.dump(out);
+    });
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    int rows = (argc > 1) ? std::atoi(argv[1]) : BENCH_ROWS;
+    string only = (argc > 2) ? argv[2] : "";
+    Bencher bencher(rows);
+
+    if (only.empty() || only == "load")
+        bencher.benchParallelLoad();
+    if (only.empty() || only == "alloc")
+        bencher.benchAllocations();
+    if (only.empty() || only == "dinsert")
+        bencher.benchDTreeInsert();
+    if (only.empty() || only == "churn")
+        bencher.benchUserChurn();
+    if (only == "lookup")
+        bencher.benchUserLookup();
+    if (only.empty() || only == "frozen")
+        bencher.benchFrozenLookup();
+    if (only == "concurrent")
+        bencher.benchConcurrent();
+    if (only.empty() || only == "snapshot")
+        bencher.benchSnapshot();
+    if (only.empty() || only == "save")
+        bencher.benchSaveOpen();
+    if (only == "wal")
+        bencher.benchWal();
+    if (only.empty() || only == "stream")
+        bencher.benchStreamLoad();
+    if (only == "parse")
+        bencher.benchParse();
+    if (only.empty() || only == "print")
+        bencher.benchPrint();
+
+    return 0;
+}
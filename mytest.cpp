@@ -1,5 +1,14 @@
 #include "utree.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
 #include <random>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #define NUMACCTS 30
 #define RANDDISC (distAcct(rng))
@@ -22,15 +31,43 @@ public:
     bool testUTreeBST(UTree &dtree);
     bool testBasicUTreeRemove(UTree &utree);
     bool testUTreeEdgeCase(UTree &utree);
+    bool testLoadDataErrors(UTree &utree);
+    bool testBulkLoad(UTree &utree);
+    bool testParallelLoad(UTree &utree);
+    bool testPooledTrees(UTree &utree);
+    bool testMoveDTree(DTree &dtree);
+    bool testDenseDTree(DTree &dtree);
+    bool testInterning(UTree &utree);
+    bool testTreeCursor(DTree &dtree);
+    bool testIterators(UTree &utree);
+    bool testPartialRebuild(DTree &dtree);
+    bool testCompaction(DTree &dtree);
+    bool testUTreeRemoveBalance(UTree &utree);
+    bool testInsertOrGet(UTree &utree);
+    bool testBTreeIndex(UTree &utree);
+    bool testFrozenDTree(DTree &dtree);
+    bool testBatchRetrieve(UTree &utree);
+    bool testConcurrentUTree(UTree &utree);
+    bool testReadIndex(UTree &utree);
+    int helpTestReadHeights(const ReadNode *root);
+    int helpTestAccountHeights(const AccountNode *root);
+    bool testSnapshots(UTree &utree);
+    bool testSaveOpen(UTree &utree);
+    bool testWriteAheadLog(UTree &utree);
+    bool testStreamingLoad(UTree &utree);
+    bool testCsvScanner(UTree &utree);
+    bool testOutputSink(UTree &utree);
 
 private:
     bool compareDNode(DNode *&copy, DNode *&dtree);
     bool helpTestDTreeBST(DNode *root);
+    bool helpTestDTreeBalanced(DTree &dtree, DNode *root);
 
     bool testBalanceUNode(UNode *node);
     int checkImbalance(UNode *node);
     int checkHeight(UNode *root);
     bool helpTestUTreeBST(UNode *root);
+    int helpTestUTreeHeights(UNode *root);
 };
 
 bool Tester::testBasicDTreeInsert(DTree &dtree)
@@ -218,285 +255,2347 @@ int main()
         }
     }
 
+    {
+        /* utree loader tests: malformed lines are reported, not fatal */
+        UTree utree;
+
+        cout << "\nTesting UTree loadData error reporting...\t";
+        if (tester.testLoadDataErrors(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree loader tests: non-append loads are built in one pass */
+        UTree utree;
+
+        cout << "\nTesting UTree bulk build...\t";
+        if (tester.testBulkLoad(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree loader tests: parallel loads match sequential loads */
+        UTree utree;
+
+        cout << "\nTesting UTree parallel load...\t";
+        if (tester.testParallelLoad(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* pooled trees: nodes are recycled through the pools */
+        UTree utree(true);
+
+        cout << "\nTesting pooled UTree and DTree...\t";
+        if (tester.testPooledTrees(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* dtree copy and move construction */
+        DTree dtree;
+
+        cout << "\nTesting DTree copy and move...\t";
+        if (tester.testMoveDTree(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* dtree switches to a dense table and back */
+        DTree dtree;
+
+        cout << "\nTesting DTree dense representation...\t";
+        if (tester.testDenseDTree(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* accounts share interned usernames, badges and statuses */
+        UTree utree;
+
+        cout << "\nTesting Account string interning...\t";
+        if (tester.testInterning(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* in-order cursors and non-recursive traversal of deep trees */
+        DTree dtree;
+
+        cout << "\nTesting DTree cursor and deep traversal...\t";
+        if (tester.testTreeCursor(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* STL iterators and bounds over both trees */
+        UTree utree;
+
+        cout << "\nTesting UTree and DTree iterators...\t";
+        if (tester.testIterators(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* dtree rebuilds only unbalanced subtrees, reusing their nodes */
+        DTree dtree;
+
+        cout << "\nTesting DTree partial rebuilding...\t";
+        if (tester.testPartialRebuild(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* dtree frees vacant nodes a few at a time as accounts churn */
+        DTree dtree;
+
+        cout << "\nTesting DTree compaction...\t";
+        if (tester.testCompaction(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree stays an AVL tree while users come and go */
+        UTree utree(true);
+
+        cout << "\nTesting UTree removal rebalancing...\t";
+        if (tester.testUTreeRemoveBalance(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* insertOrGet hands back the node holding the account */
+        UTree utree;
+
+        cout << "\nTesting UTree and DTree insertOrGet...\t";
+        if (tester.testInsertOrGet(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree indexes its usernames with a BTree instead of an AVL tree */
+        UTree utree(true, UserIndex::BTREE);
+
+        cout << "\nTesting UTree with a BTree index...\t";
+        if (tester.testBTreeIndex(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* dtree is frozen into an array and thawed by the next change */
+        DTree dtree;
+
+        cout << "\nTesting DTree freezing...\t";
+        if (tester.testFrozenDTree(dtree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree answers a batch of lookups the same as one lookup at a time */
+        UTree utree;
+
+        cout << "\nTesting UTree batch retrieval...\t";
+        if (tester.testBatchRetrieve(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree is written and read by several threads at once */
+        UTree utree(true, UserIndex::AVL, true);
+
+        cout << "\nTesting concurrent UTree...\t";
+        if (tester.testConcurrentUTree(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree answers lookups from a copy that writers replace path by path */
+        UTree utree(false, UserIndex::AVL, true);
+
+        cout << "\nTesting lock-free UTree reads...\t";
+        if (tester.testReadIndex(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree hands out snapshots that later writes leave alone */
+        UTree utree;
+
+        cout << "\nTesting UTree snapshots...\t";
+        if (tester.testSnapshots(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree is built straight from a saved file, without parsing */
+        UTree utree;
+
+        cout << "\nTesting UTree save and open...\t";
+        if (tester.testSaveOpen(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree logs every change and recovers from its last checkpoint */
+        UTree utree;
+
+        cout << "\nTesting UTree write-ahead log...\t";
+        if (tester.testWriteAheadLog(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree appends a file while it is still being read */
+        UTree utree;
+
+        cout << "\nTesting UTree streaming load...\t";
+        if (tester.testStreamingLoad(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    {
+        /* utree loads through the block scanner and the range-checked field parser */
+        UTree utree;
+
+        cout << "\nTesting CSV scanner and field parsing...\t";
+        if (tester.testCsvScanner(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+    {
+        /* print and dump write through a buffered OutputSink */
+        UTree utree(false, UserIndex::BTREE);
+
+        cout << "\nTesting buffered output sinks...\t";
+        if (tester.testOutputSink(utree))
+        {
+            cout << "test passed" << endl;
+        }
+        else
+        {
+            cout << "test failed" << endl;
+        }
+    }
+
+    return 0;
+}
+
+bool Tester::testAssigmentOperatorDTree(DTree &dtree)
+{
+    DTree copy = dtree;
+    if (!((copy._root == nullptr) && (dtree._root == nullptr)))
+        return false;
+
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        Account newAcct = Account("", disc, 0, "", "");
+        if (!dtree.insert(newAcct))
+            return false;
+    }
+
+    if (copy.getNumUsers() == dtree.getNumUsers())
+        return false;
+
+    copy = dtree;
+
+    if (!compareDNode(copy._root, dtree._root))
+        return false;
+
+    return true;
+}
+/**
+ * Compare Two DTree Nodes
+ * @return true if they duplicate but different objects, false if they are the same object.
+ */
+bool Tester::compareDNode(DNode *&copy, DNode *&dtree)
+{
+    if ((copy == nullptr) && (dtree == nullptr))
+        return true;
+
+    if (((copy == nullptr) && !(dtree == nullptr)) || (!(copy == nullptr) && (dtree == nullptr)))
+        return false;
+
+    if (!((copy->getDiscriminator() == dtree->getDiscriminator()) && (copy != dtree)))
+        return false;
+
+    return compareDNode(copy->_left, dtree->_left) && compareDNode(copy->_right, dtree->_right);
+}
+
+bool Tester::testBalanceDTree(DTree &dtree)
+{
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        Account newAcct = Account("", disc, 0, "", "");
+        if (!dtree.insert(newAcct))
+            return false;
+    }
+
+    return !dtree.checkImbalance(dtree._root);
+}
+bool Tester::testDTreeBST(DTree &dtree)
+{
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        Account newAcct = Account("", disc, 0, "", "");
+        if (!dtree.insert(newAcct))
+            return false;
+    }
+
+    return helpTestDTreeBST(dtree._root);
+}
+/**
+ * BST property Test Helper
+ */
+bool Tester::helpTestDTreeBST(DNode *root)
+{
+    if (root == nullptr)
+        return true;
+
+    if (!(root->_left == nullptr))
+        if (!(root->getDiscriminator() > root->_left->getDiscriminator()))
+            return false;
+
+    if (!(root->_right == nullptr))
+        if (!(root->getDiscriminator() < root->_right->getDiscriminator()))
+            return false;
+
+    return helpTestDTreeBST(root->_left) && helpTestDTreeBST(root->_right);
+}
+bool Tester::testBasicDTreeRemove(DTree &dtree)
+{
+
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = 2 * i;
+        Account newAcct = Account("", disc, 0, "", "");
+        if (!dtree.insert(newAcct))
+            return false;
+    }
+
+    for (int i = 0; i < NUMACCTS / 2; i++)
+    {
+        int disc = 2 * i;
+        DNode *temp;
+        dtree.remove(disc, temp);
+        delete temp;
+    }
+
+    if (dtree._root->getNumVacant() == 0)
+        return false;
+
+    for (int i = NUMACCTS; i < NUMACCTS + 10; i++)
+    {
+        int disc = 2 * i;
+        Account newAcct = Account("", disc, 0, "", "");
+        if (!dtree.insert(newAcct))
+            return false;
+    }
+
+    if (!(dtree._root->getNumVacant() == 0))
+        return false;
+
+    return true;
+}
+bool Tester::testEdgeCase(DTree &dtree)
+{
+    int disc = 2;
+    Account newAcct = Account("", disc, 0, "", "");
+    if (!dtree.insert(newAcct))
+        return false;
+
+    DNode *temp;
+    if (!dtree.remove(disc, temp))
+        return false;
+    delete temp;
+
+    DNode *temp2;
+    if (dtree.remove(disc, temp2))
+        return false;
+    delete temp2;
+
+    return true;
+}
+bool Tester::testUTreeInsert(UTree &utree)
+{
+    int x = 0;
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    bool allInserted = true;
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        if (x > 7)
+            x = 0;
+        Account newAcct = Account(username[x], disc, 0, "", "");
+        if (!utree.insert(newAcct))
+        {
+            cout << "Insertion on node " << disc << " did not return true" << endl;
+            allInserted = false;
+        }
+        x++;
+    }
+
+    return allInserted && testBalanceUNode(utree._root);
+}
+bool Tester::testBalanceUNode(UNode *node)
+{
+
+    if (node == nullptr)
+        return true;
+    if (checkImbalance(node))
+        return false;
+
+    return testBalanceUNode(node->_left) && testBalanceUNode(node->_right);
+}
+int Tester::checkImbalance(UNode *node)
+{
+    if (checkHeight(node->_left) > checkHeight(node->_right))
+    {
+        if (checkHeight(node->_left) - checkHeight(node->_right) > 1)
+            return 1;
+    }
+
+    if (checkHeight(node->_right) > checkHeight(node->_left))
+    {
+        if (checkHeight(node->_right) - checkHeight(node->_left) > 1)
+            return 1;
+    }
+
     return 0;
 }
+int Tester::checkHeight(UNode *root)
+{
+    if (root == nullptr)
+        return -1;
+
+    if ((root->_left == nullptr) && (root->_right == nullptr))
+        return 0;
+
+    return root->getHeight();
+}
+bool Tester::testUTreeBST(UTree &utree)
+{
+    int x = 0;
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        if (x > 7)
+            x = 0;
+        Account newAcct = Account(username[x], disc, 0, "", "");
+        if (!utree.insert(newAcct))
+            return false;
+        x++;
+    }
+
+    return helpTestUTreeBST(utree._root);
+}
+/**
+ * BST property Test Helper
+ */
+bool Tester::helpTestUTreeBST(UNode *root)
+{
+    if (root == nullptr)
+        return true;
+
+    if (!(root->_left == nullptr))
+        if (!(root->getUsername() > root->_left->getUsername()))
+            return false;
+
+    if (!(root->_right == nullptr))
+        if (!(root->getUsername() < root->_right->getUsername()))
+            return false;
+
+    return helpTestUTreeBST(root->_left) && helpTestUTreeBST(root->_right);
+}
+bool Tester::testBasicUTreeRemove(UTree &utree)
+{
+
+    utree.insert(Account("lex", 40, 0, "", ""));
+    int x = 0;
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    for (int i = 0; i < NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        if (x > 7)
+            x = 0;
+        Account newAcct = Account(username[x], disc, 0, "", "");
+        if (!utree.insert(newAcct))
+            return false;
+        x++;
+    }
+
+    DNode *del;
+    if (!utree.removeUser("lex", 40, del))
+        return false;
+
+    if (del == nullptr)
+        return false;
+
+    if (utree.retrieve("lex") != nullptr)
+        return false;
+
+    return true;
+}
+bool Tester::testUTreeEdgeCase(UTree &utree)
+{
+    string username = "lex";
+    int disc = 40;
+    Account newAcct = Account(username, disc, 0, "", "");
+    if (!utree.insert(newAcct))
+        return false;
+
+    DNode *del;
+    if (!utree.removeUser("lex", 40, del))
+        return false;
+
+    if (del == nullptr)
+        return false;
+
+    if (utree.retrieve("lex") != nullptr)
+        return false;
+
+    return true;
+}
+bool Tester::testLoadDataErrors(UTree &utree)
+{
+    string dataFile = "/tmp/mytest_accounts.csv";
+    std::ofstream out(dataFile);
+    out << "felix,1,0,,online\n"
+        << "felix,2,1,dev\n"
+        << "john,12345,0,,\n"
+        << "john,7,0,early,idle\r\n"
+        << "sam,x,0,,\n"
+        << "sam,3,1,,busy";
+    out.close();
+
+    std::vector<LoadError> errors;
+    int inserted = utree.loadData(dataFile, true, errors);
+    std::remove(dataFile.c_str());
+
+    if (inserted != 3 || errors.size() != 3)
+        return false;
+
+    /* Line numbers are 1-based, offsets point at the start of the line */
+    if (errors[0].line != 2 || errors[0].offset != 18)
+        return false;
+    if (errors[1].line != 3 || errors[2].line != 5)
+        return false;
+
+    if (utree.numUsers("felix") != 1 || utree.numUsers("john") != 1 || utree.numUsers("sam") != 1)
+        return false;
+
+    if (utree.retrieve("john")->getDTree()->_root->getAccount().getStatus() != "idle")
+        return false;
+
+    /* The throwing overload reports the first bad line with its own reason */
+    auto thrown = [](const string &path) {
+        UTree tree;
+        try
+        {
+            tree.loadData(path);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            return string(e.what());
+        }
+        return string();
+    };
+    std::ofstream(dataFile) << "felix,1,0,,online\njohn,12345,0,,\nsam,3,1\n";
+    string outOfRange = thrown(dataFile);
+    std::remove(dataFile.c_str());
+    string missing = thrown("/tmp/mytest_missing.csv");
+    return outOfRange.find("line 2 (byte 18)") != string::npos &&
+           outOfRange.find("Discriminator out of valid range") != string::npos &&
+           missing.find("could not be opened") != string::npos;
+}
+bool Tester::testBulkLoad(UTree &utree)
+{
+    string dataFile = "/tmp/mytest_bulk.csv";
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    std::ofstream out(dataFile);
+    for (int i = 0; i < 40 * NUMACCTS; i++)
+        out << username[i % 8] << "," << (i * 7919) % 10000 << ",0,,\n";
+    /* Duplicate of the first line, must be ignored */
+    out << "felix,0,1,dup,dup\n";
+    out.close();
+
+    /* Anything already in the tree is discarded */
+    utree.insert(Account("lex", 40, 0, "", ""));
+
+    std::vector<LoadError> errors;
+    int inserted = utree.loadData(dataFile, false, errors);
+    std::remove(dataFile.c_str());
+
+    if (inserted != 40 * NUMACCTS || !errors.empty())
+        return false;
+    if (utree.retrieve("lex") != nullptr || utree.numUsers("sam") != 5 * NUMACCTS)
+        return false;
+    if (utree.retrieve("felix")->getDTree()->checkImbalance(utree.retrieve("felix")->getDTree()->_root))
+        return false;
+
+    return testBalanceUNode(utree._root) && helpTestUTreeBST(utree._root);
+}
+bool Tester::testParallelLoad(UTree &utree)
+{
+    string dataFile = "/tmp/mytest_parallel.csv";
+    std::ofstream out(dataFile);
+    for (int i = 0; i < 100 * NUMACCTS; i++)
+    {
+        out << "user" << (i * 31) % 97 << "," << (i * 7919) % 10000 << ",1,,\n";
+        if (i % 500 == 0)
+            out << "broken line\n";
+    }
+    out.close();
+
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        for (int append = 0; append <= 1; append++)
+        {
+            UTree sequential;
+            std::vector<LoadError> seqErrors, errors;
+            int seqInserted = sequential.loadData(dataFile, append, seqErrors);
+
+            utree.clear();
+            int inserted = utree.loadData(dataFile, append, errors, threads);
+            if (inserted != seqInserted || errors.size() != seqErrors.size())
+                return false;
+            for (unsigned int i = 0; i < errors.size(); i++)
+                if (errors[i].line != seqErrors[i].line || errors[i].offset != seqErrors[i].offset)
+                    return false;
+            for (int u = 0; u < 97; u++)
+                if (utree.numUsers("user" + std::to_string(u)) != sequential.numUsers("user" + std::to_string(u)))
+                    return false;
+            if (!testBalanceUNode(utree._root) || !helpTestUTreeBST(utree._root))
+                return false;
+        }
+    }
+    std::remove(dataFile.c_str());
+
+    return true;
+}
+bool Tester::testPooledTrees(UTree &utree)
+{
+    NodePool<DNode> pool;
+    {
+        DTree dtree(&pool);
+        for (int i = 0; i < 10 * NUMACCTS; i++)
+            dtree.insert(Account("", i, 0, "", ""));
 
-bool Tester::testAssigmentOperatorDTree(DTree &dtree)
+        /* Every rebalance rebuilt the tree from recycled nodes */
+        if (pool.getNumLive() != dtree._root->getSize() || pool.getCapacity() > DEFAULT_SLAB_SIZE)
+            return false;
+        if (dtree.checkImbalance(dtree._root) || !helpTestDTreeBST(dtree._root))
+            return false;
+    }
+    if (pool.getNumLive() != 0)
+        return false;
+
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < 8 * NUMACCTS; i++)
+            if (!utree.insert(Account(username[i % 8], i, 0, "", "")))
+                return false;
+        if (utree._dnodePool->getNumLive() < 8 * NUMACCTS || utree._unodePool->getNumLive() != 8)
+            return false;
+        if (utree.numUsers("sam") != NUMACCTS || !testBalanceUNode(utree._root))
+            return false;
+
+        utree.clear();
+        if (utree._dnodePool->getNumLive() != 0 || utree._unodePool->getNumLive() != 0)
+            return false;
+    }
+
+    return utree._unodePool->getCapacity() == DEFAULT_SLAB_SIZE;
+}
+bool Tester::testMoveDTree(DTree &dtree)
+{
+    for (int i = 0; i < NUMACCTS; i++)
+        dtree.insert(Account("", RANDDISC, 0, "", ""));
+
+    DTree copy(dtree);
+    if (!compareDNode(copy._root, dtree._root))
+        return false;
+
+    DNode *root = dtree._root;
+    int numUsers = dtree.getNumUsers();
+    DTree moved(std::move(dtree));
+    if (moved._root != root || dtree._root != nullptr)
+        return false;
+
+    copy = std::move(moved);
+    return copy._root == root && moved._root == nullptr && copy.getNumUsers() == numUsers;
+}
+bool Tester::testDenseDTree(DTree &dtree)
 {
+    for (int disc = 0; disc < 2 * DENSE_THRESHOLD; disc++)
+        if (!dtree.insert(Account("dense", 3 * disc, 0, "", "")))
+            return false;
+    if (!dtree.isDense() || dtree._root != nullptr || dtree.getNumUsers() != 2 * DENSE_THRESHOLD)
+        return false;
+    if (dtree.insert(Account("dense", 3, 0, "", "")) || dtree.getUsername() != "dense")
+        return false;
+    if (dtree.retrieve(6) == nullptr || dtree.retrieve(7) != nullptr || dtree.retrieve(6)->getDiscriminator() != 6)
+        return false;
+
+    /* A default Account holds no valid discriminator and is never stored */
+    bool inserted;
+    if (dtree.insertOrGet(Account(), inserted) != nullptr || inserted || dtree.getNumUsers() != 2 * DENSE_THRESHOLD)
+        return false;
+
+    /* Nodes keep discriminator order within each word through random inserts and removals */
+    DTree mixed;
+    std::vector<bool> present(NUM_DISCS, false);
+    std::mt19937 local(6);
+    for (int i = 0; i < 20000; i++)
+    {
+        int disc = local() % NUM_DISCS;
+        DNode *gone;
+        if (present[disc] != (i % 3 == 0 ? mixed.remove(disc, gone) : !mixed.insert(Account("mixed", disc, 0, "", ""))))
+            return false;
+        if (i % 3 == 0 && present[disc])
+            delete gone;
+        present[disc] = (i % 3 != 0);
+    }
+    if (!mixed.isDense())
+        return false;
+
+    /* The running count matches the bitmap after the churn */
+    int occupied = 0;
+    for (int word = 0; word < DENSE_WORDS; word++)
+        occupied += __builtin_popcountll(mixed._dense->bits[word]);
+    if (mixed._dense->count() != occupied ||
+        mixed.getNumUsers() != (int)std::count(present.begin(), present.end(), true))
+        return false;
+    for (int disc = MIN_DISC; disc <= MAX_DISC; disc++)
+        if ((mixed.retrieve(disc) != nullptr) != present[disc] || (present[disc] && mixed.retrieve(disc)->getDiscriminator() != disc))
+            return false;
+
+    /* Copies stay dense and do not share nodes */
     DTree copy = dtree;
-    if (!((copy._root == nullptr) && (dtree._root == nullptr)))
+    if (!copy.isDense() || copy.retrieve(6) == dtree.retrieve(6))
+        return false;
+
+    for (int disc = 0; disc < 2 * DENSE_THRESHOLD; disc += 2)
+    {
+        DNode *removed;
+        if (!dtree.remove(3 * disc, removed) || removed->getDiscriminator() != 3 * disc)
+            return false;
+        delete removed;
+    }
+    DNode *removed;
+    if (dtree.remove(0, removed) || removed != nullptr)
+        return false;
+
+    /* Dropped below the sparse threshold: a balanced tree again */
+    while (dtree.getNumUsers() >= SPARSE_THRESHOLD)
+    {
+        int disc = dtree._dense->next(MIN_DISC);
+        dtree.remove(disc, removed);
+        delete removed;
+    }
+    if (dtree.isDense() || dtree.checkImbalance(dtree._root) || !helpTestDTreeBST(dtree._root))
+        return false;
+
+    return dtree.getNumUsers() == SPARSE_THRESHOLD - 1 && copy.getNumUsers() == 2 * DENSE_THRESHOLD;
+}
+bool Tester::testInterning(UTree &utree)
+{
+    Account first("felix", 1, 1, "early", "online");
+    Account second(string("fel") + "ix", 2, 0, "early", "idle");
+    if (&first.getUsername() != &second.getUsername() || first._badge != second._badge || first._status == second._status)
+        return false;
+    if (first.getBadge() != "early" || second.getStatus() != "idle" || sizeof(Account) > 32)
         return false;
 
+    utree.insert(first);
+    utree.insert(second);
+    UNode *node = utree.retrieve("felix");
+    if (node == nullptr || node->_username != &first.getUsername())
+        return false;
+
+    if (&node->getDTree()->retrieve(2)->getUsername() != &first.getUsername())
+        return false;
+
+    /* Threads interning the same strings in different orders agree on their ids */
+    std::unique_ptr<StringPool> shared(new StringPool());
+    const int numNames = 3 * INTERN_BLOCK_SIZE;
+    std::vector<std::vector<int>> ids(4, std::vector<int>(numNames));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&shared, &ids, t]() {
+            for (int i = 0; i < 2 * numNames; i++)
+            {
+                int name = (i * (6 * t + 1)) % numNames; /* a step coprime to numNames */
+                ids[t][name] = shared->intern("name" + std::to_string(name));
+            }
+        });
+    for (std::thread &thread : threads)
+        thread.join();
+    if (shared->size() != numNames)
+        return false;
+    for (int name = 0; name < numNames; name++)
+        for (int t = 0; t < 4; t++)
+            if (ids[t][name] != ids[0][name] || shared->get(ids[0][name]) != "name" + std::to_string(name))
+                return false;
+
+    /* A pool only grows; a full one refuses new strings but still finds the old ones */
+    std::unique_ptr<StringPool> small(new StringPool(1));
+    for (int i = 0; i < INTERN_BLOCK_SIZE; i++)
+        small->intern(std::to_string(i));
+    bool full = false;
+    try
+    {
+        small->intern("one too many");
+    }
+    catch (const std::length_error &)
+    {
+        full = true;
+    }
+    return full && small->intern("7") == 7 && small->size() == INTERN_BLOCK_SIZE;
+}
+bool Tester::testTreeCursor(DTree &dtree)
+{
+    std::vector<int> discs;
     for (int i = 0; i < NUMACCTS; i++)
     {
         int disc = RANDDISC;
-        Account newAcct = Account("", disc, 0, "", "");
-        if (!dtree.insert(newAcct))
+        if (dtree.insert(Account("", disc, 0, "", "")))
+            discs.push_back(disc);
+    }
+    std::sort(discs.begin(), discs.end());
+
+    TreeCursor<DNode> cursor;
+    unsigned int i = 0;
+    for (cursor.first(dtree._root); cursor.valid(); cursor.next())
+        if (i == discs.size() || cursor.get()->getDiscriminator() != discs[i++])
             return false;
+    if (i != discs.size())
+        return false;
+    for (cursor.last(dtree._root); cursor.valid(); cursor.prev())
+        if (i == 0 || cursor.get()->getDiscriminator() != discs[--i])
+            return false;
+    if (i != 0)
+        return false;
+
+    /* A degenerate chain far deeper than the call stack could recurse */
+    const int depth = 1000000;
+    DTree chain;
+    DNode **link = &chain._root;
+    for (int disc = 0; disc < depth; disc++)
+    {
+        *link = new DNode(Account("", disc % (MAX_DISC + 1), 0, "", ""));
+        link = &(*link)->_right;
     }
+    int count = 0;
+    for (cursor.last(chain._root); cursor.valid(); cursor.prev())
+        count++;
 
-    if (copy.getNumUsers() == dtree.getNumUsers())
+    return count == depth;
+}
+bool Tester::testIterators(UTree &utree)
+{
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    std::vector<std::pair<string, int>> expected;
+    for (int i = 0; i < 8 * NUMACCTS; i++)
+    {
+        /* "sam" gets enough accounts to become dense */
+        int count = (i % 8 == 2) ? DENSE_THRESHOLD : 1;
+        for (int j = 0; j < count; j++)
+        {
+            int disc = (i * 37 + j * 7) % 10000;
+            if (utree.insert(Account(username[i % 8], disc, 0, "", "")))
+                expected.push_back({username[i % 8], disc});
+        }
+    }
+
+    /* Leave some vacant nodes behind */
+    for (unsigned int i = 0; i < expected.size(); i += 5)
+    {
+        DNode *removed;
+        if (!utree.removeUser(expected[i].first, expected[i].second, removed))
+            return false;
+        delete removed;
+        expected[i].second = INVALID_DISC;
+    }
+    expected.erase(std::remove_if(expected.begin(), expected.end(), [](const std::pair<string, int> &e) { return e.second == INVALID_DISC; }), expected.end());
+    std::sort(expected.begin(), expected.end());
+    if (!utree.retrieve("sam")->getDTree()->isDense())
         return false;
 
-    copy = dtree;
+    unsigned int i = 0;
+    for (const Account &acct : utree)
+        if (i == expected.size() || acct.getUsername() != expected[i].first || acct.getDiscriminator() != expected[i++].second)
+            return false;
+    if (i != expected.size())
+        return false;
+    for (UTree::const_iterator it = utree.end(); it != utree.begin();)
+    {
+        --it;
+        if (i == 0 || it->getUsername() != expected[i - 1].first || it->getDiscriminator() != expected[--i].second)
+            return false;
+    }
+    if (i != 0)
+        return false;
 
-    if (!compareDNode(copy._root, dtree._root))
+    /* Bounds land on the same entries as in the sorted vector */
+    for (unsigned int k = 0; k < expected.size(); k += 7)
+    {
+        for (int delta = -1; delta <= 1; delta++)
+        {
+            std::pair<string, int> key(expected[k].first, expected[k].second + delta);
+            auto lower = std::lower_bound(expected.begin(), expected.end(), key);
+            auto upper = std::upper_bound(expected.begin(), expected.end(), key);
+            UTree::const_iterator lowerIt = utree.lower_bound(key.first, key.second);
+            UTree::const_iterator upperIt = utree.upper_bound(key.first, key.second);
+            if ((lower == expected.end()) != (lowerIt == utree.end()) || (upper == expected.end()) != (upperIt == utree.end()))
+                return false;
+            if (lower != expected.end() && (lowerIt->getUsername() != lower->first || lowerIt->getDiscriminator() != lower->second))
+                return false;
+            if (upper != expected.end() && (upperIt->getUsername() != upper->first || upperIt->getDiscriminator() != upper->second))
+                return false;
+        }
+    }
+    if (utree.lower_bound("zzz", 0) != utree.end() || utree.lower_bound("", 0) != utree.begin())
         return false;
 
-    return true;
+    /* DTree bounds, in both representations */
+    const DTree &felix = *utree.retrieve("felix")->getDTree();
+    const DTree &sam = *utree.retrieve("sam")->getDTree();
+    if (felix.lower_bound(MIN_DISC) != felix.begin() || felix.upper_bound(MAX_DISC) != felix.end())
+        return false;
+    if (sam.lower_bound(MIN_DISC) != sam.begin() || sam.upper_bound(MAX_DISC) != sam.end())
+        return false;
+
+    return std::distance(sam.begin(), sam.end()) == sam.getNumUsers() &&
+           std::distance(felix.begin(), felix.end()) == felix.getNumUsers();
+}
+bool Tester::helpTestDTreeBalanced(DTree &dtree, DNode *root)
+{
+    if (root == nullptr)
+        return true;
+    if (dtree.checkImbalance(root))
+        return false;
+
+    return helpTestDTreeBalanced(dtree, root->_left) && helpTestDTreeBalanced(dtree, root->_right);
+}
+bool Tester::testPartialRebuild(DTree &dtree)
+{
+    dtree.insert(Account("", 5000, 0, "", ""));
+    DNode *first = dtree.retrieve(5000);
+
+    for (int i = 0; i < 30 * NUMACCTS; i++)
+    {
+        int disc = RANDDISC;
+        dtree.insert(Account("", disc, 0, "", ""));
+        if (i % 3 == 0)
+        {
+            DNode *removed;
+            if (dtree.remove(RANDDISC, removed))
+                delete removed;
+        }
+
+        /* The rule holds at every node, not just the root */
+        if (!helpTestDTreeBalanced(dtree, dtree._root) || !helpTestDTreeBST(dtree._root))
+            return false;
+    }
+
+    /* Rebuilds relink the existing nodes instead of copying them */
+    if (!dtree.isDense() && dtree.retrieve(5000) != nullptr && dtree.retrieve(5000) != first)
+        return false;
+
+    /* A degenerate chain far deeper than the call stack could recurse is
+     * rebuilt, and its vacant nodes released, without recursing */
+    const int depth = 1000000;
+    DTree chain;
+    DNode **link = &chain._root;
+    for (int i = 0; i < depth; i++)
+    {
+        *link = new DNode(Account("", i % (MAX_DISC + 1), 0, "", ""));
+        (*link)->_size = depth - i;
+        (*link)->_numVacant = (depth - i) / 2;
+        (*link)->_vacant = (depth - i) % 2 == 0;
+        link = &(*link)->_right;
+    }
+    chain.rebalance(chain._root);
+    int height = 0;
+    for (DNode *node = chain._root; node != nullptr; node = node->_left)
+        height++;
+    return chain._root->_size == depth / 2 && chain._root->_numVacant == 0 && height <= 20;
+}
+bool Tester::testCompaction(DTree &dtree)
+{
+    /* With compaction off, removes only leave vacant nodes behind */
+    CompactionPolicy off;
+    off.maxVacantRatio = 1;
+    dtree.setCompaction(off);
+    for (int i = 0; i < 10 * NUMACCTS; i++)
+        dtree.insert(Account("", 3 * i, 0, "", ""));
+    for (int i = 0; i < 5 * NUMACCTS; i++)
+    {
+        DNode *removed;
+        dtree.remove(6 * i, removed);
+        delete removed;
+    }
+    if (dtree.getNumVacant() != 5 * NUMACCTS || dtree.getNumReclaimed() != 0)
+        return false;
+
+    /* A full compaction frees them all at once */
+    if (dtree.compact() != 5 * NUMACCTS || dtree.getNumVacant() != 0 || dtree._root->getSize() != 5 * NUMACCTS ||
+        dtree.getNumReclaimed() != 5 * NUMACCTS || !helpTestDTreeBalanced(dtree, dtree._root))
+        return false;
+
+    /* Churn with small steps: the tree stays bounded, sorted and balanced */
+    CompactionPolicy steps;
+    steps.stepNodes = 16;
+    dtree.setCompaction(steps);
+    for (int i = 0; i < 100 * NUMACCTS; i++)
+    {
+        int disc = RANDDISC % (20 * NUMACCTS);
+        if (dtree.retrieve(disc) == nullptr)
+            dtree.insert(Account("", disc, 0, "", ""));
+        else
+        {
+            DNode *removed;
+            dtree.remove(disc, removed);
+            delete removed;
+        }
+
+        int numVacant = dtree.getNumVacant();
+        if (numVacant > steps.minVacant && numVacant > 2 * steps.maxVacantRatio * dtree._root->getSize())
+            return false;
+        if (!helpTestDTreeBalanced(dtree, dtree._root) || !helpTestDTreeBST(dtree._root))
+            return false;
+    }
+
+    return !dtree.isDense() && dtree.getNumReclaimed() > 10 * NUMACCTS;
 }
 /**
- * Compare Two DTree Nodes
- * @return true if they duplicate but different objects, false if they are the same object.
+ * Recomputes the heights of a subtree, returning -2 if any stored height is wrong
  */
-bool Tester::compareDNode(DNode *&copy, DNode *&dtree)
+int Tester::helpTestUTreeHeights(UNode *root)
 {
-    if ((copy == nullptr) && (dtree == nullptr))
-        return true;
+    if (root == nullptr)
+        return -1;
 
-    if (((copy == nullptr) && !(dtree == nullptr)) || (!(copy == nullptr) && (dtree == nullptr)))
+    int left = helpTestUTreeHeights(root->_left);
+    int right = helpTestUTreeHeights(root->_right);
+    if (left == -2 || right == -2 || root->getHeight() != std::max(left, right) + 1)
+        return -2;
+    return root->getHeight();
+}
+bool Tester::testUTreeRemoveBalance(UTree &utree)
+{
+    const int users = 20 * NUMACCTS;
+    std::vector<bool> present(users, false);
+    int numPresent = 0;
+
+    for (int i = 0; i < 20 * users; i++)
+    {
+        int user = RANDDISC % users;
+        string username = "user" + std::to_string(user);
+        if (!present[user])
+        {
+            if (!utree.insert(Account(username, user, 0, "", "")))
+                return false;
+            numPresent++;
+        }
+        else
+        {
+            DNode *removed;
+            if (!utree.removeUser(username, user, removed) || utree.retrieve(username) != nullptr)
+                return false;
+            delete removed;
+            numPresent--;
+        }
+        present[user] = !present[user];
+
+        /* Deleted UNodes go back to the pool instead of leaking */
+        if (utree._unodePool->getNumLive() != numPresent)
+            return false;
+        if (!testBalanceUNode(utree._root) || !helpTestUTreeBST(utree._root) || helpTestUTreeHeights(utree._root) == -2)
+            return false;
+    }
+
+    return true;
+}
+bool Tester::testInsertOrGet(UTree &utree)
+{
+    DTree dtree;
+    bool inserted;
+    for (int i = 0; i < DENSE_THRESHOLD; i++)
+    {
+        int disc = (7 * i) % NUM_DISCS;
+        DNode *node = dtree.insertOrGet(Account("", disc, 0, "", ""), inserted);
+        if (!inserted || node->getDiscriminator() != disc)
+            return false;
+
+        /* The node survives rebuilds and the switch to a DenseTable */
+        if (dtree.retrieve(disc) != node)
+            return false;
+        if (dtree.insertOrGet(Account("", disc, 1, "", ""), inserted) != node || inserted || node->getAccount().hasNitro())
+            return false;
+    }
+    if (!dtree.isDense())
         return false;
 
-    if (!((copy->getDiscriminator() == dtree->getDiscriminator()) && (copy != dtree)))
+    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
+    for (int i = 0; i < 8 * NUMACCTS; i++)
+    {
+        DNode *node = utree.insertOrGet(Account(username[i % 8], i, 0, "", ""), inserted);
+        if (!inserted || utree.retrieveUser(username[i % 8], i) != node)
+            return false;
+    }
+    for (int i = 0; i < 8 * NUMACCTS; i++)
+    {
+        DNode *node = utree.insertOrGet(Account(username[i % 8], i, 1, "", ""), inserted);
+        if (inserted || node != utree.retrieveUser(username[i % 8], i) || node->getAccount().hasNitro())
+            return false;
+    }
+
+    /* An account without a valid discriminator adds no user */
+    if (utree.insertOrGet(Account(), inserted) != nullptr || inserted || utree.retrieve(Account().getUsername()) != nullptr)
         return false;
 
-    return compareDNode(copy->_left, dtree->_left) && compareDNode(copy->_right, dtree->_right);
+    return utree.numUsers("felix") == NUMACCTS;
 }
+bool Tester::testBTreeIndex(UTree &utree)
+{
+    /* Long shared prefixes defeat the inline prefixes and need full compares */
+    std::vector<string> names;
+    for (int u = 0; u < 100 * NUMACCTS; u++)
+        names.push_back((u % 3 == 0 ? "sharedprefix_" : (u % 3 == 1 ? "u" : "")) + std::to_string(u * 7919 % 100000));
 
-bool Tester::testBalanceDTree(DTree &dtree)
+    UTree avl;
+    for (int i = 0; i < 400 * NUMACCTS; i++)
+    {
+        string &username = names[RANDDISC % names.size()];
+        int disc = RANDDISC % 4;
+        if (avl.retrieveUser(username, disc) == nullptr)
+        {
+            if (!utree.insert(Account(username, disc, 0, "", "")) || !avl.insert(Account(username, disc, 0, "", "")))
+                return false;
+        }
+        else
+        {
+            DNode *removed, *avlRemoved;
+            if (!utree.removeUser(username, disc, removed) || !avl.removeUser(username, disc, avlRemoved))
+                return false;
+            delete removed;
+            delete avlRemoved;
+        }
+    }
+
+    /* Same users, in the same order, and each is found through the index */
+    if (!std::equal(utree.begin(), utree.end(), avl.begin(), avl.end(), [](const Account &a, const Account &b) {
+            return &a.getUsername() == &b.getUsername() && a.getDiscriminator() == b.getDiscriminator();
+        }))
+        return false;
+    int numNames = 0;
+    for (string &username : names)
+    {
+        if (utree.numUsers(username) != avl.numUsers(username))
+            return false;
+        if (utree.numUsers(username) > 0)
+            numNames++;
+    }
+    if (utree._btree->size() != numNames || utree._unodePool->getNumLive() != numNames || utree.getHeight() < 2)
+        return false;
+    if (std::distance(utree.lower_bound("u5", 0), utree.end()) != std::distance(avl.lower_bound("u5", 0), avl.end()))
+        return false;
+    if (std::distance(std::make_reverse_iterator(utree.end()), std::make_reverse_iterator(utree.begin())) != std::distance(avl.begin(), avl.end()))
+        return false;
+
+    /* Removing every account empties the index */
+    for (string &username : names)
+        for (int disc = 0; disc < 4; disc++)
+        {
+            DNode *removed;
+            if (utree.removeUser(username, disc, removed))
+                delete removed;
+        }
+    if (utree.begin() != utree.end() || utree._btree->size() != 0 || utree.getHeight() != -1)
+        return false;
+
+    /* A bulk load builds the index bottom-up */
+    string dataFile = "/tmp/mytest_btree.csv";
+    std::ofstream out(dataFile);
+    for (int i = 0; i < 100 * NUMACCTS; i++)
+        out << names[i % names.size()] << "," << i % 7 << ",0,,\n";
+    out.close();
+    std::vector<LoadError> errors;
+    utree.loadData(dataFile, false, errors);
+    avl.loadData(dataFile, false, errors);
+    std::remove(dataFile.c_str());
+
+    return std::equal(utree.begin(), utree.end(), avl.begin(), avl.end(), [](const Account &a, const Account &b) {
+               return &a.getUsername() == &b.getUsername() && a.getDiscriminator() == b.getDiscriminator();
+           }) &&
+           utree.numUsers(names[0]) == avl.numUsers(names[0]) && utree.retrieve(names[1]) != nullptr;
+}
+bool Tester::testFrozenDTree(DTree &dtree)
 {
-    for (int i = 0; i < NUMACCTS; i++)
+    int sizes[] = {0, 1, 2, 3, 7, 8, 9, NUMACCTS, 20 * NUMACCTS};
+    for (int size : sizes)
     {
-        int disc = RANDDISC;
-        Account newAcct = Account("", disc, 0, "", "");
-        if (!dtree.insert(newAcct))
+        dtree.clear();
+        for (int i = 0; i < size; i++)
+            dtree.insert(Account("frozen", 3 * (RANDDISC % 3000), 0, "", ""));
+        DNode *removed;
+        if (size > 0 && dtree.remove(dtree.begin()->getDiscriminator(), removed))
+            delete removed;
+
+        std::vector<int> discs;
+        for (const Account &acct : dtree)
+            discs.push_back(acct.getDiscriminator());
+
+        dtree.freeze();
+        if (!dtree.isFrozen() || dtree.getNumUsers() != (int)discs.size() || dtree._root != nullptr)
+            return false;
+
+        /* Subtree sizes match a count of the implicit tree, taken bottom-up */
+        std::vector<int> below(2 * discs.size() + 2, 0);
+        for (int i = discs.size(); i >= 1; i--)
+        {
+            below[i] = 1 + below[2 * i] + below[2 * i + 1];
+            if (dtree._frozen->size(i) != below[i])
+                return false;
+        }
+
+        /* Every lookup and walk sees the same accounts as the tree did */
+        for (int disc = -1; disc <= 9001; disc++)
+        {
+            bool present = std::binary_search(discs.begin(), discs.end(), disc);
+            DNode *node = dtree.retrieve(disc);
+            if (present != (node != nullptr) || (present && node->getDiscriminator() != disc))
+                return false;
+
+            auto lower = std::lower_bound(discs.begin(), discs.end(), disc);
+            DTree::const_iterator it = dtree.lower_bound(disc);
+            if ((lower == discs.end()) != (it == dtree.end()) || (it != dtree.end() && it->getDiscriminator() != *lower))
+                return false;
+        }
+        if (!std::equal(dtree.begin(), dtree.end(), discs.begin(), discs.end(), [](const Account &a, int disc) { return a.getDiscriminator() == disc; }))
+            return false;
+        if (!std::equal(std::make_reverse_iterator(dtree.end()), std::make_reverse_iterator(dtree.begin()), discs.rbegin(), discs.rend(),
+                        [](const Account &a, int disc) { return a.getDiscriminator() == disc; }))
+            return false;
+
+        /* A copy stays frozen, a change thaws */
+        DTree copy(dtree);
+        if (!copy.isFrozen() || copy.getNumUsers() != dtree.getNumUsers())
+            return false;
+        if (!dtree.insert(Account("frozen", 1, 0, "", "")) || dtree.isFrozen() || dtree.getNumUsers() != (int)discs.size() + 1)
+            return false;
+        if (!helpTestDTreeBST(dtree._root) || !helpTestDTreeBalanced(dtree, dtree._root))
             return false;
     }
 
-    return !dtree.checkImbalance(dtree._root);
+    return true;
 }
-bool Tester::testDTreeBST(DTree &dtree)
+
+bool Tester::testBatchRetrieve(UTree &utree)
 {
-    for (int i = 0; i < NUMACCTS; i++)
+    UTree btree(true, UserIndex::BTREE);
+    std::vector<string> names;
+    for (int u = 0; u < 50 * NUMACCTS; u++)
+        names.push_back("user" + std::to_string(u * 7919 % 100000));
+
+    /* Sparse, dense and frozen DTrees, with some vacant nodes among them */
+    for (UTree *tree : {&utree, &btree})
     {
-        int disc = RANDDISC;
-        Account newAcct = Account("", disc, 0, "", "");
-        if (!dtree.insert(newAcct))
+        for (int i = 0; i < 200 * NUMACCTS; i++)
+            tree->insert(Account(names[i % names.size()], i / names.size() * 3, 0, "", ""));
+        for (int disc = 0; disc < 1500; disc++)
+            tree->insert(Account("dense", disc, 0, "", ""));
+        for (int disc = 0; disc < 100; disc++)
+            tree->insert(Account("frozen", disc, 0, "", ""));
+        tree->freeze();
+        for (int i = 0; i < 20 * NUMACCTS; i += 7)
+        {
+            DNode *removed;
+            if (tree->removeUser(names[i % names.size()], i / names.size() * 3, removed))
+                delete removed;
+        }
+    }
+    if (utree.numUsers("dense") != 1500 || btree.numUsers("frozen") != 100)
+        return false;
+
+    /* Hits, misses on either level, and a count that is not a whole number of groups */
+    const string missing[] = {"missing0", "missing1", "missing2"};
+    std::vector<std::pair<std::string_view, int>> queries;
+    for (int i = 0; i < 1000; i++)
+    {
+        int kind = RANDDISC % 4;
+        if (kind == 0)
+            queries.emplace_back("dense", RANDDISC % 2000);
+        else if (kind == 1)
+            queries.emplace_back("frozen", RANDDISC % 150);
+        else if (kind == 2)
+            queries.emplace_back(missing[i % 3], 0);
+        else
+            queries.emplace_back(names[RANDDISC % names.size()], RANDDISC % 30);
+    }
+    queries.emplace_back("", 0);
+
+    for (UTree *tree : {&utree, &btree})
+    {
+        std::vector<DNode *> results(queries.size());
+        tree->retrieveUsers(queries.data(), queries.size(), results.data());
+        int found = 0;
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            if (results[i] != tree->retrieveUser(queries[i].first, queries[i].second))
+                return false;
+            if (results[i] != nullptr)
+                found++;
+        }
+        if (found == 0 || found == (int)queries.size())
             return false;
     }
 
-    return helpTestDTreeBST(dtree._root);
+    UTree empty;
+    DNode *result = utree.retrieveUser("dense", 0);
+    empty.retrieveUsers(queries.data(), 1, &result);
+    return result == nullptr;
+}
+bool Tester::testConcurrentUTree(UTree &utree)
+{
+    const int writers = 4;
+    const int discs = 16 * writers;
+    std::vector<string> names;
+    for (int u = 0; u < 40; u++)
+        names.push_back("user" + std::to_string(u * 7919 % 1000));
+
+    UTree btree(true, UserIndex::BTREE, true);
+    for (UTree *tree : {&utree, &btree})
+    {
+        /* Each writer owns the discriminators equal to it mod writers, so it
+         * knows whether every account it touches is present */
+        std::vector<std::vector<bool>> present(writers, std::vector<bool>(names.size() * discs, false));
+        std::atomic<bool> ok(true), done(false);
+        auto write = [&](int t) {
+            std::mt19937 local(t);
+            for (int i = 0; i < 200 * NUMACCTS; i++)
+            {
+                int user = local() % names.size();
+                int disc = local() % (discs / writers) * writers + t;
+                std::vector<bool>::reference mine = present[t][user * discs + disc];
+                if (mine)
+                {
+                    DNode *removed;
+                    if (!tree->removeUser(names[user], disc, removed))
+                        ok = false;
+                    delete removed;
+                }
+                else if (!tree->insert(Account(names[user], disc, 0, "", "")))
+                    ok = false;
+                mine = !mine;
+            }
+        };
+        auto read = [&](int t) {
+            std::mt19937 local(writers + t);
+            while (!done)
+            {
+                int user = local() % names.size();
+                int disc = local() % discs;
+                Account found;
+                if (tree->findUser(names[user], disc, found) &&
+                    (found.getUsername() != names[user] || found.getDiscriminator() != disc))
+                    ok = false;
+                if (tree->numUsers(names[user]) > discs)
+                    ok = false;
+            }
+        };
+
+        std::vector<std::thread> readers, threads;
+        for (int t = 0; t < 2; t++)
+            readers.emplace_back(read, t);
+        for (int t = 0; t < writers; t++)
+            threads.emplace_back(write, t);
+        for (std::thread &thread : threads)
+            thread.join();
+        done = true;
+        for (std::thread &thread : readers)
+            thread.join();
+        if (!ok)
+            return false;
+
+        /* Every writer's last word stands */
+        int numNames = 0;
+        for (size_t user = 0; user < names.size(); user++)
+        {
+            int expected = 0;
+            for (int disc = 0; disc < discs; disc++)
+            {
+                bool mine = present[disc % writers][user * discs + disc];
+                if (mine != (tree->retrieveUser(names[user], disc) != nullptr))
+                    return false;
+                expected += mine;
+            }
+            if (tree->numUsers(names[user]) != expected)
+                return false;
+            numNames += expected > 0;
+        }
+        if (tree->_btree != nullptr ? tree->_btree->size() != numNames : helpTestUTreeHeights(tree->_root) == -2)
+            return false;
+    }
+
+    return utree.isConcurrent() && !UTree().isConcurrent();
 }
 /**
- * BST property Test Helper
+ * Recomputes the heights of a ReadIndex subtree, returning -2 if any stored
+ * height is wrong or any node is out of balance, in it or in the accounts
+ * of its users
  */
-bool Tester::helpTestDTreeBST(DNode *root)
+int Tester::helpTestReadHeights(const ReadNode *root)
 {
     if (root == nullptr)
-        return true;
-
-    if (!(root->_left == nullptr))
-        if (!(root->getDiscriminator() > root->_left->getDiscriminator()))
-            return false;
+        return -1;
 
-    if (!(root->_right == nullptr))
-        if (!(root->getDiscriminator() < root->_right->getDiscriminator()))
-            return false;
+    int left = helpTestReadHeights(root->_left);
+    int right = helpTestReadHeights(root->_right);
+    if (left == -2 || right == -2 || std::abs(left - right) > 1 || root->height != std::max(left, right) + 1 ||
+        helpTestAccountHeights(root->user->accounts.load()->root) == -2)
+        return -2;
+    return root->height;
+}
+/**
+ * Recomputes the heights of the accounts of one ReadIndex user, returning
+ * -2 if any stored height is wrong or any node is out of balance
+ */
+int Tester::helpTestAccountHeights(const AccountNode *root)
+{
+    if (root == nullptr)
+        return -1;
 
-    return helpTestDTreeBST(root->_left) && helpTestDTreeBST(root->_right);
+    int left = helpTestAccountHeights(root->_left);
+    int right = helpTestAccountHeights(root->_right);
+    if (left == -2 || right == -2 || std::abs(left - right) > 1 || root->height != std::max(left, right) + 1)
+        return -2;
+    return root->height;
 }
-bool Tester::testBasicDTreeRemove(DTree &dtree)
+bool Tester::testReadIndex(UTree &utree)
 {
+    std::vector<string> names;
+    for (int u = 0; u < 10 * NUMACCTS; u++)
+        names.push_back("reader" + std::to_string(u * 7919 % 10000));
 
-    for (int i = 0; i < NUMACCTS; i++)
+    /* The copy follows every insert and remove, and stays balanced */
+    UTree plain;
+    for (int i = 0; i < 300 * NUMACCTS; i++)
     {
-        int disc = 2 * i;
-        Account newAcct = Account("", disc, 0, "", "");
-        if (!dtree.insert(newAcct))
-            return false;
+        string &username = names[RANDDISC % names.size()];
+        int disc = RANDDISC % 20;
+        if (plain.retrieveUser(username, disc) == nullptr)
+        {
+            plain.insert(Account(username, disc, i % 2, "", ""));
+            utree.insert(Account(username, disc, i % 2, "", ""));
+        }
+        else
+        {
+            DNode *removed, *plainRemoved;
+            if (!utree.removeUser(username, disc, removed) || !plain.removeUser(username, disc, plainRemoved))
+                return false;
+            delete removed;
+            delete plainRemoved;
+        }
     }
-
-    for (int i = 0; i < NUMACCTS / 2; i++)
+    for (string &username : names)
     {
-        int disc = 2 * i;
-        DNode *temp;
-        dtree.remove(disc, temp);
-        delete temp;
+        if (utree.numUsers(username) != plain.numUsers(username))
+            return false;
+        for (int disc = 0; disc < 20; disc++)
+        {
+            Account found, plainFound;
+            bool present = plain.findUser(username, disc, plainFound);
+            if (utree.findUser(username, disc, found) != present ||
+                (present && (&found.getUsername() != &plainFound.getUsername() || found.hasNitro() != plainFound.hasNitro())))
+                return false;
+        }
     }
-
-    if (dtree._root->getNumVacant() == 0)
+    if (helpTestReadHeights(utree._readIndex->_root.load()) == -2)
         return false;
 
-    for (int i = NUMACCTS; i < NUMACCTS + 10; i++)
+    /* A reader inside an epoch keeps the nodes it started from */
+    EpochDomain &domain = epochDomain();
     {
-        int disc = 2 * i;
-        Account newAcct = Account("", disc, 0, "", "");
-        if (!dtree.insert(newAcct))
+        EpochGuard guard(domain);
+        const ReadNode *old = utree._readIndex->_root.load();
+        const AccountSet *oldAccounts = old->user->accounts.load();
+        int oldUsers = plain.numUsers(old->username->c_str());
+        for (int disc = 0; disc < 20; disc++)
+        {
+            DNode *removed;
+            if (utree.removeUser(*old->username, disc, removed))
+                delete removed;
+        }
+        for (int i = 0; i < 4; i++)
+            domain.collect();
+        if (domain.getNumRetired() == 0 || oldAccounts->count != oldUsers || utree.numUsers(*old->username) != 0)
             return false;
     }
-
-    if (!(dtree._root->getNumVacant() == 0))
+    for (int i = 0; i < 4; i++)
+        domain.collect();
+    if (domain.getNumRetired() != 0)
         return false;
 
-    return true;
-}
-bool Tester::testEdgeCase(DTree &dtree)
-{
-    int disc = 2;
-    Account newAcct = Account("", disc, 0, "", "");
-    if (!dtree.insert(newAcct))
+    /* A write to a user with many accounts copies a path, not all of them */
+    ReadIndex index;
+    const int dense = 100 * NUMACCTS;
+    for (int disc = 1; disc <= dense; disc++)
+        index.put(Account(names[0], disc, 0, "", ""));
+    for (int i = 0; i < 4; i++)
+        domain.collect();
+    int before = domain.getNumRetired();
+    index.put(Account(names[0], dense + 1, 0, "", ""));
+    if (domain.getNumRetired() - before > helpTestAccountHeights(index._root.load()->user->accounts.load()->root) + 4 ||
+        helpTestReadHeights(index._root.load()) == -2 || index.numUsers(names[0]) != dense + 1)
         return false;
 
-    DNode *temp;
-    if (!dtree.remove(disc, temp))
+    /* Writers of different users run at once; a snapshot sees none of them */
+    ReadIndex::Snapshot snapshot = index.snapshot();
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++)
+        writers.emplace_back([&index, &names, t]() {
+            for (int disc = 1; disc <= NUMACCTS * 10; disc++)
+            {
+                index.put(Account(names[t], disc, 1, "", ""));
+                if (disc % 3 == 0)
+                    index.erase(names[t], disc - 1);
+            }
+        });
+    for (std::thread &writer : writers)
+        writer.join();
+    Account snapped;
+    if (snapshot.numUsers(names[0]) != dense + 1 || snapshot.numUsers(names[1]) != 0 ||
+        !snapshot.findUser(names[0], 1, snapped) || snapped.hasNitro() ||
+        std::distance(snapshot.begin(), snapshot.end()) != dense + 1 || helpTestReadHeights(index._root.load()) == -2)
         return false;
-    delete temp;
-
-    DNode *temp2;
-    if (dtree.remove(disc, temp2))
+    for (int t = 1; t < 4; t++)
+        if (index.numUsers(names[t]) != NUMACCTS * 10 - NUMACCTS * 10 / 3)
+            return false;
+    snapshot.release();
+
+    /* A fresh load rebuilds the copy, clear empties it */
+    string dataFile = "/tmp/mytest_readindex.csv";
+    std::ofstream out(dataFile);
+    for (int i = 0; i < 100 * NUMACCTS; i++)
+        out << names[i % names.size()] << "," << i % 7 << ",0,,\n";
+    out.close();
+    std::vector<LoadError> errors;
+    utree.loadData(dataFile, false, errors);
+    std::remove(dataFile.c_str());
+    Account found;
+    if (utree.numUsers(names[0]) != 7 || !utree.findUser(names[1], 1, found) || utree.findUser(names[1], 8, found) ||
+        helpTestReadHeights(utree._readIndex->_root.load()) == -2)
         return false;
-    delete temp2;
+    utree.clear();
 
-    return true;
+    return utree.numUsers(names[0]) == 0 && !utree.findUser(names[1], 1, found);
 }
-bool Tester::testUTreeInsert(UTree &utree)
+bool Tester::testSnapshots(UTree &utree)
 {
-    int x = 0;
-    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
-    bool allInserted = true;
-    for (int i = 0; i < NUMACCTS; i++)
-    {
-        int disc = RANDDISC;
-        if (x > 7)
-            x = 0;
-        Account newAcct = Account(username[x], disc, 0, "", "");
-        if (!utree.insert(newAcct))
+    using Key = std::pair<const string *, int>;
+    auto keys = [](auto begin, auto end) {
+        std::vector<Key> result;
+        for (auto it = begin; it != end; ++it)
+            result.emplace_back(&it->getUsername(), it->getDiscriminator());
+        return result;
+    };
+    auto churn = [](UTree &tree, std::mt19937 &local, int count) {
+        for (int i = 0; i < count; i++)
         {
-            cout << "Insertion on node " << disc << " did not return true" << endl;
-            allInserted = false;
+            string username = "snap" + std::to_string(local() % 200);
+            int disc = local() % 20;
+            DNode *removed;
+            if (tree.removeUser(username, disc, removed))
+                delete removed;
+            else
+                tree.insert(Account(username, disc, 0, "", ""));
         }
-        x++;
+    };
+    std::mt19937 local(20);
+
+    /* Each snapshot keeps the accounts it was taken with */
+    churn(utree, local, 50 * NUMACCTS);
+    std::vector<Key> expected0 = keys(utree.begin(), utree.end());
+    UTree::Snapshot first = utree.snapshot();
+    churn(utree, local, 50 * NUMACCTS);
+    std::vector<Key> expected1 = keys(utree.begin(), utree.end());
+    UTree::Snapshot second = utree.snapshot();
+    churn(utree, local, 50 * NUMACCTS);
+    if (expected0 == expected1 || keys(first.begin(), first.end()) != expected0 || keys(second.begin(), second.end()) != expected1)
+        return false;
+    for (const Key &key : expected0)
+    {
+        Account found;
+        if (!first.findUser(*key.first, key.second, found) || &found.getUsername() != key.first ||
+            first.numUsers(*key.first) != std::count_if(expected0.begin(), expected0.end(), [&](const Key &k) { return k.first == key.first; }))
+            return false;
     }
+    if (keys(utree.snapshot().begin(), utree.snapshot().end()) != keys(utree.begin(), utree.end()))
+        return false;
+    UTree::Snapshot moved = std::move(first);
+    if (!first.empty() || keys(moved.begin(), moved.end()) != expected0)
+        return false;
+    utree.clear();
+    if (keys(second.begin(), second.end()) != expected1 || !utree.snapshot().empty())
+        return false;
 
-    return allInserted && testBalanceUNode(utree._root);
-}
-bool Tester::testBalanceUNode(UNode *node)
-{
+    /* A snapshot of a concurrent tree holds still while a writer carries on */
+    UTree shared(true, UserIndex::BTREE, true);
+    churn(shared, local, 50 * NUMACCTS);
+    std::vector<Key> expected = keys(shared.begin(), shared.end());
+    UTree::Snapshot still = shared.snapshot();
+    std::thread writer([&shared, &churn] {
+        std::mt19937 mine(21);
+        churn(shared, mine, 200 * NUMACCTS);
+    });
+    bool same = true;
+    for (int i = 0; i < 20; i++)
+        same = same && keys(still.begin(), still.end()) == expected;
+    writer.join();
+    if (!same || keys(shared.snapshot().begin(), shared.snapshot().end()) == expected)
+        return false;
 
-    if (node == nullptr)
-        return true;
-    if (checkImbalance(node))
+    /* A snapshot outlives the tree it was taken from */
+    UTree::Snapshot orphan;
+    {
+        UTree gone;
+        churn(gone, local, 10 * NUMACCTS);
+        expected = keys(gone.begin(), gone.end());
+        orphan = gone.snapshot();
+    }
+    if (keys(orphan.begin(), orphan.end()) != expected)
         return false;
 
-    return testBalanceUNode(node->_left) && testBalanceUNode(node->_right);
-}
-int Tester::checkImbalance(UNode *node)
-{
-    if (checkHeight(node->_left) > checkHeight(node->_right))
+    /* A tree that is not concurrent drops its index after the last snapshot */
+    UTree plain;
+    churn(plain, local, 10 * NUMACCTS);
     {
-        if (checkHeight(node->_left) - checkHeight(node->_right) > 1)
-            return 1;
+        UTree::Snapshot temporary = plain.snapshot();
+        churn(plain, local, NUMACCTS);
+        if (plain._readIndex == nullptr)
+            return false;
     }
+    churn(plain, local, 1);
+    if (plain._readIndex != nullptr || keys(plain.snapshot().begin(), plain.snapshot().end()) != keys(plain.begin(), plain.end()))
+        return false;
 
-    if (checkHeight(node->_right) > checkHeight(node->_left))
+    /* A snapshot of one index does not hold back what another retires */
     {
-        if (checkHeight(node->_right) - checkHeight(node->_left) > 1)
-            return 1;
+        ReadIndex held, busy;
+        for (int disc = 0; disc < 8; disc++)
+            held.put(Account("held", disc, 0, "", ""));
+        ReadIndex::Snapshot pinned = held.snapshot();
+        held.put(Account("held", 0, 1, "", ""));
+        for (int i = 0; i < 20 * EPOCH_COLLECT_INTERVAL; i++)
+            busy.put(Account("busy" + std::to_string(i % 20), i, 0, "", ""));
+        for (int i = 0; i < 4; i++)
+            epochDomain().collect();
+        Account found;
+        if (epochDomain().getNumRetired(busy._owner) != 0 || epochDomain().getNumRetired(held._owner) == 0 ||
+            !pinned.findUser("held", 0, found) || found.hasNitro() || held.numUsers("held") != 8)
+            return false;
     }
 
-    return 0;
+    /* Released snapshots let the replaced nodes go */
+    moved.release();
+    second.release();
+    still.release();
+    orphan.release();
+    for (int i = 0; i < 4; i++)
+        epochDomain().collect();
+    return epochDomain().getNumRetired() == 0;
 }
-int Tester::checkHeight(UNode *root)
+bool Tester::testSaveOpen(UTree &utree)
 {
-    if (root == nullptr)
-        return -1;
+    auto same = [](const Account &a, const Account &b) {
+        return &a.getUsername() == &b.getUsername() && a.getDiscriminator() == b.getDiscriminator() &&
+               a.hasNitro() == b.hasNitro() && a.getBadge() == b.getBadge() && a.getStatus() == b.getStatus();
+    };
+    UTree source;
+    for (int i = 0; i < 20 * NUMACCTS; i++)
+        source.insert(Account("saved" + std::to_string(i % 50), i % 37, i % 2, (i % 3) ? "gold" : "", "online"));
+    string path = "/tmp/mytest_saved.utree";
+    if (!source.save(path))
+        return false;
 
-    if ((root->_left == nullptr) && (root->_right == nullptr))
-        return 0;
+    /* The whole tree is built on open, balanced, and answers lookups */
+    if (!utree.open(path) || utree._root == nullptr || utree.getHeight() > 6 ||
+        !std::equal(utree.begin(), utree.end(), source.begin(), source.end(), same))
+        return false;
+    Account found;
+    if (!utree.findUser("saved7", 7, found) || !same(found, source.retrieveUser("saved7", 7)->getAccount()) ||
+        utree.findUser("saved7", 8, found) || utree.findUser("missing", 0, found) ||
+        utree.numUsers("saved7") != source.numUsers("saved7") || utree.numUsers("missing") != 0)
+        return false;
 
-    return root->getHeight();
+    /* The opened tree takes writes like any other */
+    DNode *removed;
+    if (!utree.removeUser("saved3", 3, removed) || removed->getDiscriminator() != 3)
+        return false;
+    delete removed;
+    if (utree.numUsers("saved3") != source.numUsers("saved3") - 1 || utree.findUser("saved3", 3, found))
+        return false;
+    utree.insert(Account("saved4", 5000, 1, "new", ""));
+    if (utree.numUsers("saved4") != source.numUsers("saved4") + 1 || utree.retrieveUser("saved5", 5) == nullptr)
+        return false;
+
+    /* A user removed entirely stays removed */
+    std::vector<int> discs;
+    for (auto it = source.lower_bound("saved9", 0); it != source.end() && it->getUsername() == "saved9"; ++it)
+        discs.push_back(it->getDiscriminator());
+    for (int disc : discs)
+        if (utree.removeUser("saved9", disc, removed))
+            delete removed;
+    if (utree.numUsers("saved9") != 0 || utree.findUser("saved9", discs[0], found))
+        return false;
+
+    /* Iterating sees every change made since opening */
+    for (int disc : discs)
+        if (source.removeUser("saved9", disc, removed))
+            delete removed;
+    source.removeUser("saved3", 3, removed);
+    delete removed;
+    source.insert(Account("saved4", 5000, 1, "new", ""));
+    if (!std::equal(utree.begin(), utree.end(), source.begin(), source.end(), same))
+        return false;
+
+    /* The BTree index opens the same file */
+    UTree btree(false, UserIndex::BTREE);
+    if (!btree.open(path) || btree.numUsers("saved1") != source.numUsers("saved1") || btree.getHeight() < 0 ||
+        btree.numUsers("saved9") == 0)
+        return false;
+
+    /* Files that are not user files are refused and leave the tree alone */
+    std::ofstream(path + ".bad") << "not a user file at all, just some text that is long enough for a header";
+    bool refused = !utree.open(path + ".bad") && !utree.open("/tmp/mytest_missing.utree") && utree.numUsers("saved1") > 0;
+    string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(path + ".bad", std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() / 2);
+    refused = refused && !utree.open(path + ".bad");
+
+    /* So are files whose tables are out of range or out of order */
+    auto opens = [&](auto corrupt) {
+        string copy = bytes;
+        const UserFileHeader &header = *reinterpret_cast<const UserFileHeader *>(copy.data());
+        corrupt(reinterpret_cast<UserFileUser *>(&copy[header.usersOffset]),
+                reinterpret_cast<UserFileAccount *>(&copy[header.accountsOffset]), header);
+        std::ofstream(path + ".bad", std::ios::binary | std::ios::trunc) << copy;
+        return utree.open(path + ".bad");
+    };
+    using Header = const UserFileHeader &;
+    refused = refused &&
+              !opens([](UserFileUser *, UserFileAccount *accounts, Header) { accounts[0].disc = MAX_DISC + 1; }) &&
+              !opens([](UserFileUser *, UserFileAccount *accounts, Header) { accounts[0].disc = MIN_DISC - 1; }) &&
+              !opens([](UserFileUser *, UserFileAccount *accounts, Header) { std::swap(accounts[0].disc, accounts[1].disc); }) &&
+              !opens([](UserFileUser *, UserFileAccount *accounts, Header header) { accounts[0].badge = header.numVocabulary; }) &&
+              !opens([](UserFileUser *users, UserFileAccount *, Header) { std::swap(users[0].name, users[1].name); }) &&
+              !opens([](UserFileUser *users, UserFileAccount *, Header) { users[1].firstAccount++; }) &&
+              !opens([](UserFileUser *users, UserFileAccount *, Header header) { users[0].numAccounts = header.numAccounts + 1; }) &&
+              !opens([](UserFileUser *users, UserFileAccount *, Header) { users[0].numAccounts = 0; }) &&
+              opens([](UserFileUser *, UserFileAccount *, Header) {});
+    std::remove((path + ".bad").c_str());
+    std::remove(path.c_str());
+    return refused;
 }
-bool Tester::testUTreeBST(UTree &utree)
+bool Tester::testWriteAheadLog(UTree &utree)
 {
-    int x = 0;
-    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
-    for (int i = 0; i < NUMACCTS; i++)
+    string snapshotPath = "/tmp/mytest_wal.utree", logPath = "/tmp/mytest_wal.log";
+    auto copyFile = [](const string &from, const string &to) {
+        std::ifstream in(from, std::ios::binary);
+        std::ofstream(to, std::ios::binary | std::ios::trunc) << in.rdbuf();
+    };
+    auto same = [](const UTree &a, const UTree &b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Account &x, const Account &y) {
+            return &x.getUsername() == &y.getUsername() && x.getDiscriminator() == y.getDiscriminator() &&
+                   x.hasNitro() == y.hasNitro() && x.getBadge() == y.getBadge() && x.getStatus() == y.getStatus();
+        });
+    };
+    auto churn = [](UTree &tree, std::mt19937 &local, int count) {
+        for (int i = 0; i < count; i++)
+        {
+            string username = "wal" + std::to_string(local() % 30);
+            int disc = local() % 40;
+            DNode *removed;
+            if (local() % 3 == 0 && tree.removeUser(username, disc, removed))
+                delete removed;
+            else
+                tree.insert(Account(username, disc, i % 2, (i % 5) ? "gold" : "", std::to_string(i)));
+        }
+    };
+    std::remove(snapshotPath.c_str());
+    std::remove(logPath.c_str());
+    std::mt19937 local(22);
+
+    /* Every change has reached the log by the time it returns, so a copy
+     * taken now is what a crash would leave behind */
+    if (utree.recover(snapshotPath, logPath) != 0)
+        return false;
+    churn(utree, local, 20 * NUMACCTS);
+    string crashed = logPath + ".crashed";
+    copyFile(logPath, crashed);
+    UTree recovered;
+    int replayed = recovered.recover(snapshotPath, crashed);
+    if (replayed <= 0 || replayed != (int)utree.getLog()->getNumRecords() || !same(utree, recovered))
+        return false;
+
+    /* A record torn by the crash is dropped, and later records follow the last whole one */
     {
-        int disc = RANDDISC;
-        if (x > 7)
-            x = 0;
-        Account newAcct = Account(username[x], disc, 0, "", "");
-        if (!utree.insert(newAcct))
-            return false;
-        x++;
+        std::ifstream in(logPath, std::ios::binary);
+        string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::ofstream(crashed, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() - 3);
     }
+    UTree torn;
+    if (torn.recover(snapshotPath, crashed) != replayed - 1)
+        return false;
+    torn.insert(Account("wal-after", 1, 0, "", ""));
+    UTree reopened;
+    if (reopened.recover(snapshotPath, crashed) != replayed || reopened.numUsers("wal-after") != 1)
+        return false;
 
-    return helpTestUTreeBST(utree._root);
+    /* A checkpoint empties the log; a crash before it emptied the log replays onto the new snapshot */
+    copyFile(logPath, crashed);
+    if (!utree.checkpoint() || utree.getLog()->getNumRecords() != (uint64_t)replayed)
+        return false;
+    UTree fromSnapshot, twice;
+    if (fromSnapshot.recover(snapshotPath, logPath) != 0 || !same(utree, fromSnapshot) ||
+        twice.recover(snapshotPath, crashed) != replayed || !same(utree, twice))
+        return false;
+
+    /* Changes after a checkpoint, a clear among them, replay onto the snapshot */
+    churn(utree, local, NUMACCTS);
+    utree.clear();
+    churn(utree, local, NUMACCTS);
+    UTree afterClear;
+    if (afterClear.recover(snapshotPath, logPath) != (int)utree.getLog()->getNumRecords() - replayed ||
+        !same(utree, afterClear))
+        return false;
+
+    /* Writers on several threads share syncs and still recover exactly */
+    std::remove(logPath.c_str());
+    std::remove(snapshotPath.c_str());
+    UTree shared(false, UserIndex::AVL, true);
+    if (shared.recover(snapshotPath, logPath) != 0)
+        return false;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++)
+        writers.emplace_back([&shared, t]() {
+            std::mt19937 mine(t);
+            for (int i = 0; i < 5 * NUMACCTS; i++)
+                shared.insert(Account("walt" + std::to_string(mine() % 20), mine() % 100, 0, "", ""));
+        });
+    for (std::thread &writer : writers)
+        writer.join();
+    copyFile(logPath, crashed);
+    UTree sharedRecovered;
+    bool ok = sharedRecovered.recover(snapshotPath, crashed) > 0 && same(shared, sharedRecovered) &&
+              shared.getLog()->getNumSyncs() <= shared.getLog()->getNumRecords();
+
+    /* Once the log cannot be written, every change is reported as failed and has no effect */
+    DNode *removed = nullptr;
+    ok = ok && shared.insert(Account("wal-kept", 1, 0, "", ""));
+    int full = ::open("/dev/full", O_WRONLY);
+    ok = ok && full >= 0 && dup2(full, shared._log->_fd) >= 0;
+    if (full >= 0)
+        close(full);
+    ok = ok && !shared.clear() && shared.numUsers("wal-kept") == 1 && shared.getLog()->hasFailed();
+    ok = ok && !shared.insert(Account("wal-lost", 1, 0, "", "")) && shared.numUsers("wal-lost") == 0;
+    ok = ok && !shared.removeUser("wal-kept", 1, removed) && removed == nullptr &&
+         shared.numUsers("wal-kept") == 1;
+
+    /* Records appended while a failed sync was under way are not written once
+     * the log is reopened. A full pipe holds the flusher in its write. */
+    std::remove(logPath.c_str());
+    WriteAheadLog log;
+    int ends[2];
+    ok = ok && log.open(logPath) && pipe(ends) == 0;
+    void (*savedHandler)(int) = signal(SIGPIPE, SIG_IGN);
+    if (ok)
+    {
+        char fill[4096] = {};
+        fcntl(ends[1], F_SETFL, O_NONBLOCK);
+        while (write(ends[1], fill, sizeof(fill)) > 0)
+            ;
+        fcntl(ends[1], F_SETFL, 0);
+        dup2(ends[1], log._fd);
+    }
+    WalRecord stale = {WAL_INSERT, "wal-stale", 1, false, "", ""};
+    ok = ok && log.append(stale) == 1;
+    for (bool taken = false; ok && !taken; std::this_thread::yield())
+    {
+        std::lock_guard<std::mutex> guard(log._lock);
+        taken = log._buffer.empty();
+    }
+    uint64_t unsynced = ok ? log.append(stale) : 0;
+    if (ok)
+    {
+        close(ends[0]);
+        close(ends[1]);
+    }
+    ok = ok && unsynced == 2 && !log.waitDurable(unsynced) && log.open(logPath);
+    signal(SIGPIPE, savedHandler);
+    WalRecord fresh = {WAL_INSERT, "wal-fresh", 2, false, "", ""};
+    uint64_t sequence = ok ? log.append(fresh) : 0;
+    ok = ok && sequence == 1 && log.waitDurable(sequence);
+    log.close();
+    std::vector<string> written;
+    ok = ok && WriteAheadLog::replay(logPath, [&written](const WalRecord &record) {
+                   written.push_back(string(record.username));
+               }) == 1 &&
+         written == std::vector<string>{"wal-fresh"};
+
+    /* A file that is not a log is refused */
+    std::ofstream(crashed, std::ios::trunc) << "not a log";
+    UTree refused;
+    ok = ok && refused.recover(snapshotPath, crashed) == -1;
+
+    std::remove(crashed.c_str());
+    std::remove(logPath.c_str());
+    std::remove(snapshotPath.c_str());
+    return ok;
 }
-/**
- * BST property Test Helper
- */
-bool Tester::helpTestUTreeBST(UNode *root)
+bool Tester::testStreamingLoad(UTree &utree)
 {
-    if (root == nullptr)
+    string dataFile = "/tmp/mytest_stream.csv", fifo = "/tmp/mytest_stream.fifo";
+    std::ofstream out(dataFile);
+    for (int i = 0; i < 10 * NUMACCTS; i++)
+    {
+        out << "stream" << i % 13 << "," << (i * 7919) % 10000 << "," << i % 2 << ",early," << string(i % 40, 's');
+        out << ((i % 3 == 0) ? "\r\n" : "\n");
+        if (i % 17 == 0)
+            out << "broken line\n\n";
+    }
+    out << "last" << string(300, 'x') << ",1,0,,no newline";
+    out.close();
+
+    /* Parsing the whole mapped file at once is the reference */
+    MappedFile file;
+    file.open(dataFile);
+    ChunkResult whole = {0, file.size(), 0, {}, {}};
+    parseChunk(file.data(), whole);
+    string contents(file.data(), file.size());
+    auto sameAs = [&whole](const std::vector<Account> &accounts, const std::vector<LoadError> &errors) {
+        if (accounts.size() != whole.accounts.size() || errors.size() != whole.errors.size())
+            return false;
+        for (size_t i = 0; i < accounts.size(); i++)
+            if (&accounts[i].getUsername() != &whole.accounts[i].getUsername() ||
+                accounts[i].getDiscriminator() != whole.accounts[i].getDiscriminator() ||
+                accounts[i].hasNitro() != whole.accounts[i].hasNitro() || accounts[i].getStatus() != whole.accounts[i].getStatus())
+                return false;
+        for (size_t i = 0; i < errors.size(); i++)
+            if (errors[i].line != whole.errors[i].line || errors[i].offset != whole.errors[i].offset ||
+                errors[i].message != whole.errors[i].message)
+                return false;
         return true;
-
-    if (!(root->_left == nullptr))
-        if (!(root->getUsername() > root->_left->getUsername()))
+    };
+    auto stream = [](StreamReader &reader, std::vector<Account> &accounts, std::vector<LoadError> &errors) {
+        BoundedQueue<std::vector<Account>> batches(2);
+        std::thread parser([&]() { parseStream(reader, batches, errors, 3); });
+        std::vector<Account> batch;
+        while (batches.pop(batch))
+            accounts.insert(accounts.end(), batch.begin(), batch.end());
+        parser.join();
+    };
+
+    /* Lines and line endings split across buffers of every size read the same */
+    size_t sizes[] = {1, 2, 7, 64, 1000, 1 << 16};
+    for (size_t size : sizes)
+    {
+        StreamReader reader(size);
+        std::vector<Account> accounts;
+        std::vector<LoadError> errors;
+        if (!reader.open(dataFile))
             return false;
-
-    if (!(root->_right == nullptr))
-        if (!(root->getUsername() < root->_right->getUsername()))
+        stream(reader, accounts, errors);
+        if (!sameAs(accounts, errors) || reader.hasFailed())
             return false;
+    }
 
-    return helpTestUTreeBST(root->_left) && helpTestUTreeBST(root->_right);
-}
-bool Tester::testBasicUTreeRemove(UTree &utree)
-{
+    /* A pipe is read as it is written */
+    std::remove(fifo.c_str());
+    if (mkfifo(fifo.c_str(), 0600) != 0)
+        return false;
+    std::thread writer([&]() { std::ofstream(fifo) << contents; });
+    {
+        StreamReader reader(7);
+        std::vector<Account> accounts;
+        std::vector<LoadError> errors;
+        bool opened = reader.open(fifo);
+        if (opened)
+            stream(reader, accounts, errors);
+        writer.join();
+        std::remove(fifo.c_str());
+        if (!opened || !sameAs(accounts, errors))
+            return false;
+    }
 
-    utree.insert(Account("lex", 40, 0, "", ""));
-    int x = 0;
-    string username[] = {"felix", "john", "sam", "tom", "noah", "salam", "seleh", "heems"};
-    for (int i = 0; i < NUMACCTS; i++)
+    /* A builder that stops early does not leave the reader or parser waiting */
     {
-        int disc = RANDDISC;
-        if (x > 7)
-            x = 0;
-        Account newAcct = Account(username[x], disc, 0, "", "");
-        if (!utree.insert(newAcct))
+        StreamReader reader(7);
+        BoundedQueue<std::vector<Account>> batches(1);
+        std::vector<LoadError> errors;
+        reader.open(dataFile);
+        bool complete = true;
+        std::thread parser([&]() { complete = parseStream(reader, batches, errors, 3); });
+        std::vector<Account> batch;
+        batches.pop(batch);
+        batches.close();
+        parser.join();
+        if (complete)
             return false;
-        x++;
     }
 
-    DNode *del;
-    if (!utree.removeUser("lex", 40, del))
+    /* loadData appends the same accounts, and reports a missing file instead of exiting */
+    std::vector<LoadError> errors;
+    utree.insert(Account("kept", 1, 0, "", ""));
+    int inserted = utree.loadData(dataFile, true, errors);
+    if (errors.size() != whole.errors.size() || utree.numUsers("kept") != 1 || inserted <= 0)
         return false;
+    UTree reference;
+    for (const Account &acct : whole.accounts)
+        reference.insert(acct);
+    reference.insert(Account("kept", 1, 0, "", ""));
+    if (!std::equal(utree.begin(), utree.end(), reference.begin(), reference.end(), [](const Account &a, const Account &b) {
+            return &a.getUsername() == &b.getUsername() && a.getDiscriminator() == b.getDiscriminator();
+        }))
+        return false;
+    std::remove(dataFile.c_str());
 
-    if (del == nullptr)
+    errors.clear();
+    if (utree.loadData(dataFile, true, errors) != -1 || errors.size() != 1)
         return false;
+    try
+    {
+        utree.loadData(dataFile);
+    }
+    catch (std::invalid_argument &e)
+    {
+        return utree.numUsers("kept") == 1;
+    }
+    return false;
+}
+bool Tester::testCsvScanner(UTree &utree)
+{
+    /* The scanner cuts lines and fields exactly like LineCursor and a plain split,
+     * at every alignment and with blocks cut short by the end of the buffer */
+    const char alphabet[] = {'a', 'b', '1', CSV_DELIM, CSV_DELIM, '\n', '\r', '-'};
+    std::mt19937 local(24);
+    for (int round = 0; round < 2000; round++)
+    {
+        string buffer(local() % 300, 'a');
+        for (char &c : buffer)
+            c = alphabet[local() % sizeof(alphabet)];
+        size_t skip = local() % std::max<size_t>(1, buffer.size());
+
+        LineCursor cursor(buffer.data() + skip, buffer.size() - skip);
+        CsvScanner scanner(buffer.data() + skip, buffer.size() - skip);
+        std::string_view expected, line, fields[CSV_NUM_FIELDS];
+        int numFields;
+        while (cursor.next(expected))
+        {
+            if (!scanner.next(line, fields, numFields) || line.data() != expected.data() || line != expected ||
+                scanner.lineNumber() != cursor.lineNumber() || scanner.lineOffset() != cursor.lineOffset())
+                return false;
+            if (numFields != (int)std::count(expected.begin(), expected.end(), CSV_DELIM) + 1)
+                return false;
+            size_t start = 0;
+            for (int f = 0; f < std::min(numFields, CSV_NUM_FIELDS); f++)
+            {
+                size_t end = std::min(expected.find(CSV_DELIM, start), expected.size());
+                if (fields[f] != expected.substr(start, end - start))
+                    return false;
+                start = end + 1;
+            }
+        }
+        if (scanner.next(line, fields, numFields))
+            return false;
+    }
 
-    if (utree.retrieve("lex") != nullptr)
+    /* Integers are whole fields, with an optional sign */
+    int value;
+    if (!parseInt("+5", value) || value != 5 || !parseInt("-2147483648", value) || value != INT_MIN ||
+        parseInt("+-5", value) || parseInt("+", value) || parseInt("", value) || parseInt("12a", value) ||
+        parseInt(" 1", value) || parseInt("2147483648", value))
         return false;
 
+    /* Discriminators out of range are reported like any other bad line */
+    string dataFile = "/tmp/mytest_scanner.csv";
+    std::ofstream out(dataFile);
+    out << "ana,+7,0,,\n"
+        << "ana,10000,0,,\n"
+        << "ana,-1,x,,\n"
+        << "ana,-1,0,,\n"
+        << "ana,8,0,,a,b\n";
+    out.close();
+    for (int append = 0; append <= 1; append++)
+    {
+        std::vector<LoadError> errors;
+        int inserted = utree.loadData(dataFile, append, errors);
+        if (inserted != (1 - append) || errors.size() != 4 || utree.retrieveUser("ana", 7) == nullptr ||
+            errors[0].message != "Discriminator out of valid range (0-9999)" || errors[1].message != "invalid nitro flag" ||
+            errors[2].line != 4 || errors[3].message != "expected 5 fields deliminated by a ','")
+            return false;
+    }
+    std::remove(dataFile.c_str());
     return true;
 }
-bool Tester::testUTreeEdgeCase(UTree &utree)
+
+bool Tester::testOutputSink(UTree &utree)
 {
-    string username = "lex";
-    int disc = 40;
-    Account newAcct = Account(username, disc, 0, "", "");
-    if (!utree.insert(newAcct))
+    /* Captures what a print or dump writes to cout */
+    auto capture = [](const std::function<void()> &print) {
+        std::ostringstream text;
+        std::streambuf *saved = cout.rdbuf(text.rdbuf());
+        print();
+        cout.rdbuf(saved);
+        return text.str();
+    };
+
+    /* A small tree, checked by hand */
+    DTree dtree;
+    dtree.insert(Account("ana", 50, true, "b", "s"));
+    dtree.insert(Account("ana", 25, false, "", ""));
+    dtree.insert(Account("ana", 75, false, "", ""));
+    string printed, dumped;
+    {
+        StringSink out(printed);
+        dtree.printAccounts(out);
+    }
+    {
+        StringSink out(dumped);
+        dtree.dump(out);
+    }
+    if (dumped != "((25:1:0)50:3:0(75:1:0))" ||
+        printed.find("Account name: ana\n\tDiscriminator: 50\n\tNitro: 1\n\tBadge: b\n\tStatus: s\n") == string::npos ||
+        printed != capture([&]() { dtree.printAccounts(); }))
         return false;
 
-    DNode *del;
-    if (!utree.removeUser("lex", 40, del))
-        return false;
+    /* A dense DTree prints more than one buffer, and so does its frozen form */
+    for (int disc = 0; disc <= DENSE_THRESHOLD + 100; disc++)
+        dtree.insert(Account("bo", disc * 7 % (DENSE_THRESHOLD + 101), disc % 2, "badge", "status"));
+    for (int frozen = 0; frozen <= 1; frozen++)
+    {
+        if (frozen)
+            dtree.freeze();
+        string text;
+        {
+            StringSink out(text);
+            dtree.printAccounts(out);
+            dtree.dump(out);
+        }
+        if (text.size() <= OUTPUT_BUFFER_SIZE ||
+            text != capture([&]() { dtree.printAccounts(); dtree.dump(); }))
+            return false;
+    }
 
-    if (del == nullptr)
-        return false;
+    /* Both kinds of UTree index print what they did through cout */
+    UTree avl;
+    for (int i = 0; i < 3000; i++)
+    {
+        Account acct("user" + std::to_string(i % 500), i, i % 3 == 0, "b" + std::to_string(i % 4), "s");
+        utree.insert(acct);
+        avl.insert(acct);
+    }
+    for (UTree *tree : {&utree, &avl})
+    {
+        string text;
+        {
+            StringSink out(text);
+            tree->printUsers(out);
+            tree->dump(out);
+        }
+        if (text != capture([&]() { tree->printUsers(); tree->dump(); }))
+            return false;
+    }
 
-    if (utree.retrieve("lex") != nullptr)
+    /* A stream is flushed, as endl did, and its boolalpha flag is followed */
+    struct CountingBuf : std::stringbuf
+    {
+        int syncs = 0;
+        int sync() override
+        {
+            syncs++;
+            return std::stringbuf::sync();
+        }
+    } counted;
+    std::ostream stream(&counted);
+    stream << std::boolalpha;
+    {
+        StreamSink out(stream);
+        out << true << ' ' << false;
+        if (!out.flush() || counted.syncs != 1 || counted.str() != "true false")
+            return false;
+    }
+    cout << std::boolalpha;
+    string spelled = capture([&]() { dtree.printAccounts(); });
+    cout << std::noboolalpha;
+    if (spelled.find("\tNitro: true\n") == string::npos)
         return false;
 
-    return true;
-}
\ No newline at end of file
+    /* A descriptor receives the same bytes, and a failed one is reported */
+    string path = "/tmp/mytest_sink.txt", expected, written;
+    {
+        StringSink out(expected);
+        avl.printUsers(out);
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    {
+        FdSink out(fd);
+        avl.printUsers(out);
+        if (!out.flush())
+            return false;
+    }
+    close(fd);
+    std::ifstream in(path, std::ios::binary);
+    written.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+    FdSink closed(-1);
+    closed << "lost";
+    return written == expected && !closed.flush() && closed.hasFailed();
+}
@@ -0,0 +1,114 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * NodePool.h
+ * A slab allocator for tree nodes.
+ */
+
+#pragma once
+
+#include <new>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_SLAB_SIZE 1024
+
+/**
+ * Hands out objects of type T from large slabs instead of one heap
+ * allocation per object. Destroyed objects go on a free list and are reused
+ * first. reset() makes every slot available again at once, so a whole tree
+ * can be dropped without giving memory back one node at a time.
+ * A pool is not thread-safe.
+ */
+template <class T>
+class NodePool
+{
+public:
+    explicit NodePool(int slabSize = DEFAULT_SLAB_SIZE)
+        : _slabSize(slabSize), _slab(0), _used(0), _free(nullptr), _numLive(0) {}
+
+    /* Objects still alive when the pool goes away are not destroyed */
+    ~NodePool()
+    {
+        for (Slot *slab : _slabs)
+            delete[] slab;
+    }
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+
+    /**
+     * Constructs a new object in a free slot.
+     * @param args arguments forwarded to T's constructor
+     * @return the new object
+     */
+    template <class... Args>
+    T *create(Args &&...args)
+    {
+        T *node = new (allocate()) T(std::forward<Args>(args)...);
+        _numLive++;
+        return node;
+    }
+
+    /**
+     * Destroys an object created by this pool and puts its slot on the free list.
+     * @param node object to destroy, may be nullptr
+     */
+    void destroy(T *node)
+    {
+        if (node == nullptr)
+            return;
+        node->~T();
+        Slot *slot = reinterpret_cast<Slot *>(node);
+        slot->next = _free;
+        _free = slot;
+        _numLive--;
+    }
+
+    /**
+     * Makes every slot available again, keeping the slabs for reuse.
+     * Objects still alive are abandoned without running their destructors.
+     */
+    void reset()
+    {
+        _slab = 0;
+        _used = 0;
+        _free = nullptr;
+        _numLive = 0;
+    }
+
+    int getNumLive() const { return _numLive; }
+    int getCapacity() const { return _slabs.size() * _slabSize; }
+
+private:
+    union Slot
+    {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    int _slabSize;
+    std::vector<Slot *> _slabs;
+    unsigned int _slab; /* slab currently being carved */
+    int _used;          /* slots handed out from that slab */
+    Slot *_free;
+    int _numLive;
+
+    void *allocate()
+    {
+        if (_free != nullptr)
+        {
+            Slot *slot = _free;
+            _free = slot->next;
+            return slot;
+        }
+        if (_slab < _slabs.size() && _used == _slabSize)
+        {
+            _slab++;
+            _used = 0;
+        }
+        if (_slab == _slabs.size())
+            _slabs.push_back(new Slot[_slabSize]);
+        return &_slabs[_slab][_used++];
+    }
+};
@@ -0,0 +1,92 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * OutputSink.cpp
+ * Implementation for the buffered text output of the print and dump functions.
+ */
+
+#include "outputsink.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <unistd.h>
+
+/**
+ * Appends a string, handing full buffers to the destination on the way.
+ * @param str text to append
+ * @return this sink
+ */
+OutputSink &OutputSink::operator<<(std::string_view str)
+{
+    while (!str.empty())
+    {
+        if (_used == OUTPUT_BUFFER_SIZE)
+            flush();
+        size_t count = std::min(str.size(), (size_t)OUTPUT_BUFFER_SIZE - _used);
+        memcpy(_buffer.get() + _used, str.data(), count);
+        _used += count;
+        str.remove_prefix(count);
+    }
+    return *this;
+}
+/**
+ * Appends an integer in decimal.
+ * @param value integer to append
+ * @return this sink
+ */
+OutputSink &OutputSink::operator<<(int value)
+{
+    char digits[16];
+    std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    return *this << std::string_view(digits, result.ptr - digits);
+}
+
+/**
+ * Hands everything buffered to the destination.
+ * @return true if every write so far succeeded, false otherwise
+ */
+bool OutputSink::flush()
+{
+    if (_used > 0 && !_failed)
+        _failed = !write(_buffer.get(), _used);
+    _used = 0;
+    return !_failed;
+}
+
+/**
+ * Writes a buffer to the stream and flushes it.
+ */
+bool StreamSink::write(const char *data, size_t size)
+{
+    _out.write(data, size);
+    _out.flush();
+    return (bool)_out;
+}
+
+/**
+ * Writes a buffer to the descriptor, retrying short writes.
+ */
+bool FdSink::write(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::write(_fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Appends a buffer to the string.
+ */
+bool StringSink::write(const char *data, size_t size)
+{
+    _out.append(data, size);
+    return true;
+}
@@ -0,0 +1,114 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * OutputSink.h
+ * An interface for the buffered text output of the print and dump functions.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+/**
+ * Destination of formatted text. Text collects in one buffer, allocated
+ * once, and is handed to the destination only when the buffer fills up or
+ * flush() is called, instead of once per line. Numbers are formatted without
+ * a locale, in the same digits an ostream prints by default; bools print as
+ * 1 and 0 unless the sink is told to spell them out. A derived sink flushes
+ * when it is destroyed.
+ */
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+
+    OutputSink(const OutputSink &) = delete;
+    OutputSink &operator=(const OutputSink &) = delete;
+
+    OutputSink &operator<<(char c)
+    {
+        if (_used == OUTPUT_BUFFER_SIZE)
+            flush();
+        _buffer[_used++] = c;
+        return *this;
+    }
+    OutputSink &operator<<(std::string_view str);
+    OutputSink &operator<<(const char *str) { return *this << std::string_view(str); }
+    OutputSink &operator<<(const std::string &str) { return *this << std::string_view(str); }
+    OutputSink &operator<<(int value);
+    OutputSink &operator<<(bool value)
+    {
+        if (_boolalpha)
+            return *this << (value ? "true" : "false");
+        return *this << (value ? '1' : '0');
+    }
+
+    bool flush();
+    bool hasFailed() const { return _failed; }
+
+protected:
+    OutputSink() : _boolalpha(false), _buffer(new char[OUTPUT_BUFFER_SIZE]), _used(0), _failed(false) {}
+
+    virtual bool write(const char *data, size_t size) = 0;
+
+    bool _boolalpha; /* bools print as true and false */
+
+private:
+    std::unique_ptr<char[]> _buffer;
+    size_t _used;
+    bool _failed; /* a write failed, later text was dropped */
+};
+
+/**
+ * Writes to an ostream, such as cout or an ofstream, and flushes it with
+ * every buffer handed over, as endl did. Bools follow the stream's
+ * boolalpha flag as it is when the sink is made.
+ */
+class StreamSink : public OutputSink
+{
+public:
+    explicit StreamSink(std::ostream &out) : _out(out) { _boolalpha = (out.flags() & std::ios::boolalpha) != 0; }
+    ~StreamSink() { flush(); }
+
+private:
+    std::ostream &_out;
+
+    bool write(const char *data, size_t size) override;
+};
+
+/**
+ * Writes to a file descriptor, such as an open file, a pipe or a socket.
+ * The descriptor is not closed.
+ */
+class FdSink : public OutputSink
+{
+public:
+    explicit FdSink(int fd) : _fd(fd) {}
+    ~FdSink() { flush(); }
+
+private:
+    int _fd;
+
+    bool write(const char *data, size_t size) override;
+};
+
+/**
+ * Appends to a string.
+ */
+class StringSink : public OutputSink
+{
+public:
+    explicit StringSink(std::string &out) : _out(out) {}
+    ~StringSink() { flush(); }
+
+private:
+    std::string &_out;
+
+    bool write(const char *data, size_t size) override;
+};
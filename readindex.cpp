@@ -0,0 +1,775 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * ReadIndex.cpp
+ * Implementation for the ReadIndex class, a copy of a UTree read without locks.
+ */
+
+#include "readindex.h"
+#include <algorithm>
+#include <functional>
+
+/* Orders versions of every index against snapshots; only ever increases */
+static std::atomic<uint64_t> stampClock(0);
+
+static void deleteReadNode(void *node)
+{
+    delete static_cast<ReadNode *>(node);
+}
+static void deleteReadUser(void *user)
+{
+    delete static_cast<ReadUser *>(user);
+}
+static void deleteAccountSet(void *set)
+{
+    delete static_cast<AccountSet *>(set);
+}
+static void deleteAccountNode(void *node)
+{
+    delete static_cast<AccountNode *>(node);
+}
+static void deleteCount(void *count)
+{
+    delete static_cast<std::atomic<int> *>(count);
+}
+
+/**
+ * Destructor, retires every node, so snapshots still pinned keep reading
+ * them; no writer may still be inside.
+ */
+ReadIndex::~ReadIndex()
+{
+    Update update;
+    beginUpdate(update);
+    helpRetireAll(_root.load(std::memory_order_relaxed), update);
+    retireReplaced(update);
+    epochDomain().retire(_snapshots, deleteCount, _owner);
+}
+
+/**
+ * Copies out the account with a matching username and discriminator.
+ * Takes no lock.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param found receives the account if there is one
+ * @return true if the account was found, false otherwise
+ */
+bool ReadIndex::find(std::string_view username, int disc, Account &found) const
+{
+    EpochGuard guard(epochDomain());
+    return helpFindUser(_root.load(std::memory_order_acquire), username, disc, READ_LATEST, found);
+}
+/**
+ * Returns the number of accounts with a specific username. Takes no lock.
+ * @param username username to match
+ * @return number of accounts with the specified username
+ */
+int ReadIndex::numUsers(std::string_view username) const
+{
+    EpochGuard guard(epochDomain());
+    const ReadNode *node = helpFind(_root.load(std::memory_order_acquire), username);
+    return (node == nullptr) ? 0 : accountsAt(node->user, READ_LATEST)->count;
+}
+/**
+ * Takes a snapshot of the index in constant time. Holds the lock that
+ * adds and removes usernames only long enough to read the root and the
+ * clock together.
+ * @return the accounts as they are now
+ */
+ReadIndex::Snapshot ReadIndex::snapshot() const
+{
+    /* Pinned first, so the root loaded next cannot be freed */
+    uint64_t epoch = epochDomain().pin(_owner);
+    _snapshots->fetch_add(1);
+    std::lock_guard<std::mutex> guard(_writer);
+    return Snapshot(_root.load(std::memory_order_acquire), stampClock.load(), epoch, _owner, _snapshots);
+}
+/**
+ * Helper funtion for find.
+ */
+bool ReadIndex::helpFindUser(const ReadNode *root, std::string_view username, int disc, uint64_t stamp, Account &found)
+{
+    const ReadNode *node = helpFind(root, username);
+    if (node == nullptr)
+        return false;
+
+    const AccountSet *set = accountsAt(node->user, stamp);
+    if (set->root == nullptr)
+    {
+        int slot = slotFor(set, disc);
+        if (slot == set->count || set->accounts[slot].getDiscriminator() != disc)
+            return false;
+        found = set->accounts[slot];
+        return true;
+    }
+
+    const AccountNode *acct = set->root;
+    while (acct != nullptr)
+    {
+        int nodeDisc = acct->account.getDiscriminator();
+        if (disc == nodeDisc)
+        {
+            found = acct->account;
+            return true;
+        }
+        acct = (disc < nodeDisc) ? acct->_left : acct->_right;
+    }
+
+    return false;
+}
+/**
+ * Helper funtion for find and num users.
+ */
+const ReadNode *ReadIndex::helpFind(const ReadNode *node, std::string_view username)
+{
+    while (node != nullptr)
+    {
+        int order = username.compare(*node->username);
+        if (order == 0)
+            return node;
+        node = (order < 0) ? node->_left : node->_right;
+    }
+
+    return nullptr;
+}
+/**
+ * Returns the newest version of a user's accounts stamped no later than
+ * stamp. The first version of a user is stamped before any root that
+ * reaches it is published, so there always is one.
+ * @param user user to look at
+ * @param stamp READ_LATEST, or the stamp of a snapshot
+ */
+const AccountSet *ReadIndex::accountsAt(const ReadUser *user, uint64_t stamp)
+{
+    AccountSet *set = user->accounts.load(std::memory_order_acquire);
+    while (stampOf(set) > stamp)
+        set = set->older;
+    return set;
+}
+/**
+ * Returns the position of the first account kept in place in set whose
+ * discriminator is not less than disc.
+ */
+int ReadIndex::slotFor(const AccountSet *set, int disc)
+{
+    int slot = 0;
+    while (slot < set->count && set->accounts[slot].getDiscriminator() < disc)
+        slot++;
+    return slot;
+}
+/**
+ * Returns the stamp of a published version, giving it one if its writer
+ * has not yet. Whoever looks first decides, so every reader agrees on
+ * which snapshots the version is part of.
+ */
+uint64_t ReadIndex::stampOf(AccountSet *set)
+{
+    uint64_t stamp = set->stamp.load();
+    if (stamp != READ_UNSTAMPED)
+        return stamp;
+
+    uint64_t next = stampClock.fetch_add(1) + 1;
+    return set->stamp.compare_exchange_strong(stamp, next) ? next : stamp;
+}
+
+/**
+ * Adds an account, replacing one with the same username and discriminator.
+ * Only adding a new username waits for writers of other usernames.
+ * @param account account to add
+ */
+void ReadIndex::put(const Account &account)
+{
+    const string &username = account.getUsername();
+    std::shared_lock<std::shared_mutex> structure(_structure);
+    std::lock_guard<std::mutex> stripe(stripeFor(username));
+    Update update;
+    beginUpdate(update);
+
+    /* Only a writer holding this stripe can add or remove the user */
+    ReadUser *user = nullptr;
+    {
+        EpochGuard guard(epochDomain());
+        if (const ReadNode *node = helpFind(_root.load(std::memory_order_acquire), username))
+            user = node->user;
+    }
+    if (user != nullptr)
+    {
+        publish(user, helpPutAccount(user->accounts.load(std::memory_order_relaxed), account, update), update);
+        return;
+    }
+
+    std::lock_guard<std::mutex> writer(_writer);
+    publish(helpPut(_root.load(std::memory_order_relaxed), account, update), update);
+}
+/**
+ * Helper funtion for put, links in a username that is not in the tree.
+ */
+ReadNode *ReadIndex::helpPut(ReadNode *node, const Account &account, Update &update)
+{
+    if (node == nullptr)
+        return newNode(&account.getUsername(), newSet(&account, 1, nullptr, update), update);
+
+    node = own(node, update);
+    if (account.getUsername().compare(*node->username) < 0)
+        node->_left = helpPut(node->_left, account, update);
+    else
+        node->_right = helpPut(node->_right, account, update);
+    return balance(node, update);
+}
+/**
+ * Helper funtion for put, makes the next version of a user's accounts.
+ * Copies at most READ_INLINE_ACCOUNTS accounts, or a path of the tree.
+ */
+AccountSet *ReadIndex::helpPutAccount(AccountSet *set, const Account &account, Update &update)
+{
+    if (set->root != nullptr)
+    {
+        bool added = false;
+        AccountNode *root = helpPutAccount(set->root, account, added, update);
+        return new AccountSet{root, set->count + added, READ_UNSTAMPED, set, {}};
+    }
+
+    int disc = account.getDiscriminator();
+    int slot = slotFor(set, disc);
+    int replaced = (slot < set->count && set->accounts[slot].getDiscriminator() == disc) ? 1 : 0;
+    Account accounts[READ_INLINE_ACCOUNTS + 1];
+    std::copy(set->accounts, set->accounts + slot, accounts);
+    accounts[slot] = account;
+    std::copy(set->accounts + slot + replaced, set->accounts + set->count, accounts + slot + 1);
+    return newSet(accounts, set->count + 1 - replaced, set, update);
+}
+/**
+ * Helper funtion for put, adds or replaces an account in a tree.
+ * @param added set to true if the user had no account with the discriminator
+ */
+AccountNode *ReadIndex::helpPutAccount(AccountNode *node, const Account &account, bool &added, Update &update)
+{
+    if (node == nullptr)
+    {
+        added = true;
+        return newAccount(account, update);
+    }
+
+    int disc = account.getDiscriminator();
+    int nodeDisc = node->account.getDiscriminator();
+    node = own(node, update);
+    if (disc == nodeDisc)
+    {
+        node->account = account;
+        return node;
+    }
+    if (disc < nodeDisc)
+        node->_left = helpPutAccount(node->_left, account, added, update);
+    else
+        node->_right = helpPutAccount(node->_right, account, added, update);
+    return balance(node, update);
+}
+/**
+ * Removes an account. Only removing the last account of a user waits for
+ * writers of other usernames.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @return true if an account was removed, false otherwise
+ */
+bool ReadIndex::erase(std::string_view username, int disc)
+{
+    std::shared_lock<std::shared_mutex> structure(_structure);
+    std::lock_guard<std::mutex> stripe(stripeFor(username));
+    ReadUser *user;
+    {
+        EpochGuard guard(epochDomain());
+        const ReadNode *node = helpFind(_root.load(std::memory_order_acquire), username);
+        if (node == nullptr)
+            return false;
+        user = node->user;
+    }
+
+    Update update;
+    beginUpdate(update);
+    AccountSet *set = user->accounts.load(std::memory_order_relaxed);
+    if (set->count > 1)
+    {
+        AccountSet *next = helpEraseAccount(set, disc, update);
+        if (next != nullptr)
+            publish(user, next, update);
+        return next != nullptr;
+    }
+    if (set->accounts[0].getDiscriminator() != disc)
+        return false;
+
+    /* The last account takes the user with it */
+    std::lock_guard<std::mutex> writer(_writer);
+    bool erased = false;
+    ReadNode *root = helpErase(_root.load(std::memory_order_relaxed), [username](const ReadNode *node) {
+        return username.compare(*node->username);
+    }, erased, update);
+    helpRetireUser(user, update);
+    publish(root, update);
+    return true;
+}
+/**
+ * Helper funtion for erase, makes the next version of a user with more
+ * than one account, moving the accounts back in place once they fit.
+ * @return the new version, nullptr if the user has no such account
+ */
+AccountSet *ReadIndex::helpEraseAccount(AccountSet *set, int disc, Update &update)
+{
+    if (set->root != nullptr && set->count - 1 > READ_INLINE_ACCOUNTS)
+    {
+        bool erased = false;
+        AccountNode *root = helpErase(set->root, [disc](const AccountNode *node) {
+            return disc - node->account.getDiscriminator();
+        }, erased, update);
+        return erased ? new AccountSet{root, set->count - 1, READ_UNSTAMPED, set, {}} : nullptr;
+    }
+
+    Account accounts[READ_INLINE_ACCOUNTS + 1];
+    int count = 0;
+    if (set->root == nullptr)
+    {
+        for (int slot = 0; slot < set->count; slot++)
+            if (set->accounts[slot].getDiscriminator() != disc)
+                accounts[count++] = set->accounts[slot];
+    }
+    else
+    {
+        TreeCursor<const AccountNode> cursor;
+        for (cursor.first(set->root); cursor.valid() && count <= READ_INLINE_ACCOUNTS; cursor.next())
+            if (cursor.get()->account.getDiscriminator() != disc)
+                accounts[count++] = cursor.get()->account;
+    }
+    if (count == set->count)
+        return nullptr;
+
+    helpRetireAccounts(set->root, update);
+    return newSet(accounts, count, set, update);
+}
+/**
+ * Helper funtion for erase, for either kind of tree. Nodes are only copied
+ * once the key is known to exist.
+ * @param order compares the key to a node's, negative if the key is smaller
+ */
+template <class Node, class Order>
+Node *ReadIndex::helpErase(Node *node, Order order, bool &erased, Update &update)
+{
+    if (node == nullptr)
+        return nullptr;
+
+    int cmp = order(node);
+    if (cmp != 0)
+    {
+        Node *child = helpErase((cmp < 0) ? node->_left : node->_right, order, erased, update);
+        if (!erased)
+            return node;
+        node = own(node, update);
+        ((cmp < 0) ? node->_left : node->_right) = child;
+        return balance(node, update);
+    }
+
+    erased = true;
+    if (node->_left == nullptr || node->_right == nullptr)
+    {
+        Node *child = (node->_left != nullptr) ? node->_left : node->_right;
+        discard(node, update);
+        return child;
+    }
+    Node *successor;
+    Node *right = helpRemoveMin(node->_right, successor, update);
+    successor = own(successor, update);
+    successor->_left = node->_left;
+    successor->_right = right;
+    discard(node, update);
+    return balance(successor, update);
+}
+/**
+ * Helper funtion for erase, unlinks the leftmost node of a subtree.
+ * @param node root of the subtree
+ * @param min receives the unlinked node
+ * @return new root of the subtree
+ */
+template <class Node>
+Node *ReadIndex::helpRemoveMin(Node *node, Node *&min, Update &update)
+{
+    if (node->_left == nullptr)
+    {
+        min = node;
+        return node->_right;
+    }
+
+    node = own(node, update);
+    node->_left = helpRemoveMin(node->_left, min, update);
+    return balance(node, update);
+}
+
+/**
+ * Replaces the whole index with accounts. The new tree is built before
+ * any lock is taken.
+ * @param accounts accounts sorted by username, then discriminator, without duplicates
+ */
+void ReadIndex::buildSorted(const std::vector<Account> &accounts)
+{
+    /* runs[i] is where the accounts of the i-th username begin */
+    std::vector<int> runs;
+    for (size_t i = 0; i < accounts.size(); i++)
+        if (i == 0 || &accounts[i].getUsername() != &accounts[i - 1].getUsername())
+            runs.push_back(i);
+    runs.push_back(accounts.size());
+
+    Update update;
+    beginUpdate(update);
+    ReadNode *root = helpBuildSorted(accounts, runs, 0, (int)runs.size() - 2, update);
+
+    std::unique_lock<std::shared_mutex> structure(_structure);
+    std::lock_guard<std::mutex> writer(_writer);
+    helpRetireAll(_root.load(std::memory_order_relaxed), update);
+    publish(root, update);
+}
+/**
+ * Helper funtion for build sorted, builds the users min to max.
+ */
+ReadNode *ReadIndex::helpBuildSorted(const std::vector<Account> &accounts, const std::vector<int> &runs, int min, int max, Update &update)
+{
+    if (min > max)
+        return nullptr;
+
+    int mid = min + (max - min) / 2;
+    AccountSet *set = newSet(accounts.data() + runs[mid], runs[mid + 1] - runs[mid], nullptr, update);
+    ReadNode *node = newNode(&accounts[runs[mid]].getUsername(), set, update);
+    node->_left = helpBuildSorted(accounts, runs, min, mid - 1, update);
+    node->_right = helpBuildSorted(accounts, runs, mid + 1, max, update);
+    node->height = std::max(height(node->_left), height(node->_right)) + 1;
+    return node;
+}
+/**
+ * Helper funtion for new set, builds a tree of the accounts min to max.
+ */
+AccountNode *ReadIndex::helpBuildAccounts(const Account *accounts, int min, int max, Update &update)
+{
+    if (min > max)
+        return nullptr;
+
+    int mid = min + (max - min) / 2;
+    AccountNode *node = newAccount(accounts[mid], update);
+    node->_left = helpBuildAccounts(accounts, min, mid - 1, update);
+    node->_right = helpBuildAccounts(accounts, mid + 1, max, update);
+    node->height = std::max(height(node->_left), height(node->_right)) + 1;
+    return node;
+}
+/**
+ * Removes every account.
+ */
+void ReadIndex::clear()
+{
+    Update update;
+    beginUpdate(update);
+
+    std::unique_lock<std::shared_mutex> structure(_structure);
+    std::lock_guard<std::mutex> writer(_writer);
+    helpRetireAll(_root.load(std::memory_order_relaxed), update);
+    publish(nullptr, update);
+}
+
+/**
+ * Returns the lock for writers of a username.
+ */
+std::mutex &ReadIndex::stripeFor(std::string_view username)
+{
+    return _stripes[std::hash<std::string_view>()(username) % READ_STRIPES];
+}
+/**
+ * Starts a write, which may change the nodes it creates until it publishes them.
+ */
+void ReadIndex::beginUpdate(Update &update)
+{
+    update.version = _version.fetch_add(1) + 1;
+    update.owner = _owner;
+}
+/**
+ * Creates an unpublished version of a user's accounts.
+ * @param accounts accounts sorted by discriminator
+ * @param count number of accounts, kept in place if there are few enough
+ * @param older version it replaces, nullptr for a new user
+ */
+AccountSet *ReadIndex::newSet(const Account *accounts, int count, AccountSet *older, Update &update)
+{
+    AccountSet *set = new AccountSet{nullptr, count, READ_UNSTAMPED, older, {}};
+    if (count > READ_INLINE_ACCOUNTS)
+        set->root = helpBuildAccounts(accounts, 0, count - 1, update);
+    else
+        std::copy(accounts, accounts + count, set->accounts);
+    return set;
+}
+/**
+ * Creates a user with its first version of accounts, stamped at once; the
+ * lock that adds usernames keeps snapshots from reading the clock until
+ * the root reaching it is published.
+ */
+ReadNode *ReadIndex::newNode(const string *username, AccountSet *set, Update &update)
+{
+    stampOf(set);
+    return new ReadNode{username, new ReadUser{set}, 0, nullptr, nullptr, update.version};
+}
+/**
+ * Creates an account node for the current update.
+ */
+AccountNode *ReadIndex::newAccount(const Account &account, Update &update)
+{
+    return new AccountNode{account, 0, nullptr, nullptr, update.version};
+}
+/**
+ * Returns a node the current update may change: node itself if the update
+ * created it, otherwise a copy, with node retired.
+ */
+template <class Node>
+Node *ReadIndex::own(Node *node, Update &update)
+{
+    if (node->version == update.version)
+        return node;
+
+    Node *copy = new Node(*node);
+    copy->version = update.version;
+    update.retire(node);
+    return copy;
+}
+/**
+ * Drops a node the current update unlinked.
+ */
+template <class Node>
+void ReadIndex::discard(Node *node, Update &update)
+{
+    if (node->version == update.version)
+        delete node;
+    else
+        update.retire(node);
+}
+/**
+ * Makes root visible to readers, then retires what the update replaced;
+ * nothing is retired while a new reader could still reach it.
+ */
+void ReadIndex::publish(ReadNode *root, Update &update)
+{
+    _root.store(root, std::memory_order_release);
+    retireReplaced(update);
+}
+/**
+ * Makes a new version of a user's accounts visible to readers and stamps
+ * it, then retires the version it replaced. Snapshots stamped earlier can
+ * still reach that version through set->older until they are released.
+ */
+void ReadIndex::publish(ReadUser *user, AccountSet *set, Update &update)
+{
+    user->accounts.store(set, std::memory_order_release);
+    stampOf(set);
+    update.sets.push_back(set->older);
+    retireReplaced(update);
+}
+/**
+ * Retires everything an update replaced on behalf of its index, taking the
+ * lock of the domain only for the kinds of object there are.
+ */
+void ReadIndex::retireReplaced(Update &update)
+{
+    EpochDomain &domain = epochDomain();
+    auto retire = [&domain, &update](const std::vector<void *> &objects, void (*deleter)(void *)) {
+        if (!objects.empty())
+            domain.retire(objects.data(), objects.size(), deleter, update.owner);
+    };
+    retire(update.nodes, deleteReadNode);
+    retire(update.users, deleteReadUser);
+    retire(update.sets, deleteAccountSet);
+    retire(update.accounts, deleteAccountNode);
+}
+
+/**
+ * Restores the height and balance of a node the current update owns.
+ * @return new root of the subtree
+ */
+template <class Node>
+Node *ReadIndex::balance(Node *node, Update &update)
+{
+    node->height = std::max(height(node->_left), height(node->_right)) + 1;
+    int factor = height(node->_left) - height(node->_right);
+    if (factor > 1)
+    {
+        if (height(node->_left->_left) < height(node->_left->_right))
+            node->_left = rotateLeft(own(node->_left, update), update);
+        return rotateRight(node, update);
+    }
+    if (factor < -1)
+    {
+        if (height(node->_right->_right) < height(node->_right->_left))
+            node->_right = rotateRight(own(node->_right, update), update);
+        return rotateLeft(node, update);
+    }
+
+    return node;
+}
+/**
+ * Rotates an owned node left, copying its right child.
+ */
+template <class Node>
+Node *ReadIndex::rotateLeft(Node *node, Update &update)
+{
+    Node *right = own(node->_right, update);
+    node->_right = right->_left;
+    right->_left = node;
+    node->height = std::max(height(node->_left), height(node->_right)) + 1;
+    right->height = std::max(height(right->_left), height(right->_right)) + 1;
+    return right;
+}
+/**
+ * Rotates an owned node right, copying its left child.
+ */
+template <class Node>
+Node *ReadIndex::rotateRight(Node *node, Update &update)
+{
+    Node *left = own(node->_left, update);
+    node->_left = left->_right;
+    left->_right = node;
+    node->height = std::max(height(node->_left), height(node->_right)) + 1;
+    left->height = std::max(height(left->_left), height(left->_right)) + 1;
+    return left;
+}
+
+/**
+ * Retires every node of a published subtree, with its users and accounts.
+ */
+void ReadIndex::helpRetireAll(ReadNode *node, Update &update)
+{
+    if (node == nullptr)
+        return;
+    helpRetireAll(node->_left, update);
+    helpRetireAll(node->_right, update);
+    helpRetireUser(node->user, update);
+    update.retire(node);
+}
+/**
+ * Retires a user and its current accounts; older versions were retired
+ * when they were replaced.
+ */
+void ReadIndex::helpRetireUser(ReadUser *user, Update &update)
+{
+    AccountSet *set = user->accounts.load(std::memory_order_relaxed);
+    helpRetireAccounts(set->root, update);
+    update.sets.push_back(set);
+    update.users.push_back(user);
+}
+/**
+ * Helper funtion for help retire user.
+ */
+void ReadIndex::helpRetireAccounts(AccountNode *node, Update &update)
+{
+    if (node == nullptr)
+        return;
+    helpRetireAccounts(node->_left, update);
+    helpRetireAccounts(node->_right, update);
+    update.retire(node);
+}
+/**
+ * Move constructor, the pin moves with the snapshot.
+ */
+ReadIndex::Snapshot::Snapshot(Snapshot &&other) noexcept
+    : _root(other._root), _stamp(other._stamp), _pinned(other._pinned), _epoch(other._epoch), _owner(other._owner), _count(other._count)
+{
+    other._root = nullptr;
+    other._pinned = false;
+}
+/**
+ * Move assignment, releases this snapshot first.
+ */
+ReadIndex::Snapshot &ReadIndex::Snapshot::operator=(Snapshot &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        _root = other._root;
+        _stamp = other._stamp;
+        _pinned = other._pinned;
+        _epoch = other._epoch;
+        _owner = other._owner;
+        _count = other._count;
+        other._root = nullptr;
+        other._pinned = false;
+    }
+    return *this;
+}
+/**
+ * Lets go of the snapshot early, leaving it empty. The count is still
+ * alive while the pin is held, even if the index is gone.
+ */
+void ReadIndex::Snapshot::release()
+{
+    if (_pinned)
+    {
+        _count->fetch_sub(1);
+        epochDomain().unpin(_epoch, _owner);
+    }
+    _root = nullptr;
+    _pinned = false;
+}
+/**
+ * Copies out an account as it was when the snapshot was taken.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param found receives the account if there is one
+ * @return true if the account was found, false otherwise
+ */
+bool ReadIndex::Snapshot::findUser(std::string_view username, int disc, Account &found) const
+{
+    return helpFindUser(_root, username, disc, _stamp, found);
+}
+/**
+ * Returns the number of accounts a username had when the snapshot was taken.
+ * @param username username to match
+ * @return number of accounts with the specified username
+ */
+int ReadIndex::Snapshot::numUsers(std::string_view username) const
+{
+    const ReadNode *node = helpFind(_root, username);
+    return (node == nullptr) ? 0 : accountsAt(node->user, _stamp)->count;
+}
+/**
+ * Returns an iterator to the first account of the snapshot.
+ */
+ReadIndex::Snapshot::const_iterator ReadIndex::Snapshot::begin() const
+{
+    const_iterator it;
+    it._stamp = _stamp;
+    it._user.first(_root);
+    if (it._user.valid())
+        it.enterUser();
+    return it;
+}
+/**
+ * Moves to the next account, then to the first account of the next username.
+ */
+ReadIndex::Snapshot::const_iterator &ReadIndex::Snapshot::const_iterator::operator++()
+{
+    if (_set->root != nullptr)
+    {
+        _account.next();
+        if (_account.valid())
+            return *this;
+    }
+    else if (++_slot < _set->count)
+        return *this;
+
+    _user.next();
+    if (_user.valid())
+        enterUser();
+    else
+    {
+        _set = nullptr;
+        _slot = 0;
+    }
+    return *this;
+}
+/**
+ * Moves to the first account of the username under the cursor.
+ */
+void ReadIndex::Snapshot::const_iterator::enterUser()
+{
+    _set = accountsAt(_user.get()->user, _stamp);
+    _slot = 0;
+    _account.first(_set->root);
+}
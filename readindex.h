@@ -0,0 +1,253 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * ReadIndex.h
+ * An interface for the ReadIndex class, a copy of a UTree read without locks.
+ */
+
+#pragma once
+
+#include "dtree.h"
+#include "epoch.h"
+#include "treecursor.h"
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+class Tester; /* Forward declaration for testing class */
+
+#define READ_STRIPES 64        /* writer locks, one per group of usernames */
+#define READ_INLINE_ACCOUNTS 6 /* a user with more keeps its accounts in a tree */
+#define READ_UNSTAMPED UINT64_MAX
+#define READ_LATEST (UINT64_MAX - 1)
+
+/**
+ * Node of the persistent AVL tree of one user's accounts, keyed by
+ * discriminator. A node is never changed once readers can reach it.
+ */
+struct AccountNode
+{
+    Account account;
+    int height;
+    AccountNode *_left; /* named for TreeCursor */
+    AccountNode *_right;
+    uint64_t version; /* update that created the node */
+};
+
+/**
+ * One version of a user's accounts: up to READ_INLINE_ACCOUNTS sorted in
+ * place, more in a tree. Versions are chained newest first, so a snapshot
+ * can go back to the one that was current when it was taken.
+ */
+struct AccountSet
+{
+    AccountNode *root; /* nullptr while the accounts fit in place */
+    int count;
+    std::atomic<uint64_t> stamp; /* orders the version against snapshots, READ_UNSTAMPED until then */
+    AccountSet *older;
+    Account accounts[READ_INLINE_ACCOUNTS];
+};
+
+/**
+ * The accounts of a username in a ReadIndex. Every copy of its ReadNode
+ * shares them, so a write to an existing user swaps its AccountSet without
+ * touching the tree of usernames.
+ */
+struct ReadUser
+{
+    std::atomic<AccountSet *> accounts;
+};
+
+/**
+ * Node of the persistent AVL tree of usernames. A node is never changed
+ * once readers can reach it; an update copies it instead.
+ */
+struct ReadNode
+{
+    const string *username; /* interned */
+    ReadUser *user;
+    int height;
+    ReadNode *_left; /* named for TreeCursor */
+    ReadNode *_right;
+    uint64_t version; /* update that created the node */
+};
+
+/**
+ * Persistent index of every account, keyed like a UTree: an AVL tree of
+ * usernames whose nodes each lead to the accounts of the user, in place or
+ * in a persistent AVL tree. A write to an existing user copies at most
+ * READ_INLINE_ACCOUNTS accounts or the O(log n) nodes on the path to the
+ * account it changes, and publishes the new version with a single store,
+ * holding only one of READ_STRIPES locks chosen by username. Adding or
+ * removing a username also copies a path of the username tree under one
+ * lock; only replacing the whole tree keeps every writer out. What a write
+ * replaces is retired to epochDomain() as the index's own. Readers take no lock and never
+ * wait: they enter an epoch and descend through nodes that no longer change.
+ */
+class ReadIndex
+{
+    friend class Tester;
+
+public:
+    /**
+     * The accounts of a ReadIndex as they were when the snapshot was taken,
+     * unaffected by later writes. A snapshot pins an epoch of epochDomain()
+     * for its index, so nothing the index retires while it lives is freed,
+     * including its nodes if it is destroyed first; other indexes are not
+     * held back. It should not be kept longer than needed.
+     * It may be used and destroyed on any thread.
+     */
+    class Snapshot
+    {
+    public:
+        /**
+         * Forward iterator over the accounts in (username, discriminator) order.
+         */
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = Account;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const Account *;
+            using reference = const Account &;
+
+            const_iterator() : _set(nullptr), _slot(0), _stamp(0) {}
+
+            reference operator*() const { return (_set->root != nullptr) ? _account.get()->account : _set->accounts[_slot]; }
+            pointer operator->() const { return &**this; }
+            const_iterator &operator++();
+            const_iterator operator++(int)
+            {
+                const_iterator old = *this;
+                ++*this;
+                return old;
+            }
+            bool operator==(const const_iterator &rhs) const
+            {
+                return _user == rhs._user && (!_user.valid() || (_account == rhs._account && _slot == rhs._slot));
+            }
+            bool operator!=(const const_iterator &rhs) const { return !(*this == rhs); }
+
+        private:
+            friend class Snapshot;
+            TreeCursor<const ReadNode> _user;
+            const AccountSet *_set;
+            TreeCursor<const AccountNode> _account; /* used if _set has a tree */
+            int _slot;                              /* used if not */
+            uint64_t _stamp;
+
+            void enterUser();
+        };
+
+        Snapshot() : _root(nullptr), _stamp(0), _pinned(false), _epoch(0), _owner(0), _count(nullptr) {}
+        Snapshot(Snapshot &&other) noexcept;
+        Snapshot &operator=(Snapshot &&other) noexcept;
+        ~Snapshot() { release(); }
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        bool findUser(std::string_view username, int disc, Account &found) const;
+        int numUsers(std::string_view username) const;
+        bool empty() const { return _root == nullptr; }
+        void release();
+
+        const_iterator begin() const;
+        const_iterator end() const { return const_iterator(); }
+
+    private:
+        friend class ReadIndex;
+        const ReadNode *_root;
+        uint64_t _stamp; /* versions stamped later are not part of the snapshot */
+        bool _pinned;
+        uint64_t _epoch;
+        uint64_t _owner;          /* owner of the index in epochDomain() */
+        std::atomic<int> *_count; /* live snapshots of the index, retired with it */
+
+        Snapshot(const ReadNode *root, uint64_t stamp, uint64_t epoch, uint64_t owner, std::atomic<int> *count)
+            : _root(root), _stamp(stamp), _pinned(true), _epoch(epoch), _owner(owner), _count(count) {}
+    };
+
+    ReadIndex() : _root(nullptr), _version(0), _snapshots(new std::atomic<int>(0)), _owner(epochDomain().newOwner()) {}
+    ~ReadIndex();
+
+    ReadIndex(const ReadIndex &) = delete;
+    ReadIndex &operator=(const ReadIndex &) = delete;
+
+    bool find(std::string_view username, int disc, Account &found) const;
+    int numUsers(std::string_view username) const;
+    Snapshot snapshot() const;
+    int numSnapshots() const { return _snapshots->load(); }
+    void put(const Account &account);
+    bool erase(std::string_view username, int disc);
+    void buildSorted(const std::vector<Account> &accounts);
+    void clear();
+
+private:
+    /* Nodes one write created and replaced, so it can copy each node at most once */
+    struct Update
+    {
+        uint64_t version;
+        uint64_t owner;
+        std::vector<void *> nodes;
+        std::vector<void *> users;
+        std::vector<void *> sets;
+        std::vector<void *> accounts;
+
+        void retire(ReadNode *node) { nodes.push_back(node); }
+        void retire(AccountNode *node) { accounts.push_back(node); }
+    };
+
+    std::atomic<ReadNode *> _root;
+    std::atomic<uint64_t> _version; /* last update started */
+    std::shared_mutex _structure; /* shared by every write, taken alone to replace the whole tree */
+    std::mutex _stripes[READ_STRIPES];
+    mutable std::mutex _writer; /* taken after a stripe, to add or remove a username */
+    std::atomic<int> *_snapshots;
+    uint64_t _owner; /* retires and pins in epochDomain() as this */
+
+    static const ReadNode *helpFind(const ReadNode *node, std::string_view username);
+    static bool helpFindUser(const ReadNode *root, std::string_view username, int disc, uint64_t stamp, Account &found);
+    static const AccountSet *accountsAt(const ReadUser *user, uint64_t stamp);
+    static uint64_t stampOf(AccountSet *set);
+    static int slotFor(const AccountSet *set, int disc);
+    template <class Node>
+    static int height(const Node *node) { return (node == nullptr) ? -1 : node->height; }
+
+    std::mutex &stripeFor(std::string_view username);
+    void beginUpdate(Update &update);
+    void publish(ReadNode *root, Update &update);
+    static void publish(ReadUser *user, AccountSet *set, Update &update);
+    static void retireReplaced(Update &update);
+    static AccountSet *newSet(const Account *accounts, int count, AccountSet *older, Update &update);
+    static ReadNode *newNode(const string *username, AccountSet *set, Update &update);
+    static AccountNode *newAccount(const Account &account, Update &update);
+    static ReadNode *helpPut(ReadNode *node, const Account &account, Update &update);
+    static AccountSet *helpPutAccount(AccountSet *set, const Account &account, Update &update);
+    static AccountNode *helpPutAccount(AccountNode *node, const Account &account, bool &added, Update &update);
+    static AccountSet *helpEraseAccount(AccountSet *set, int disc, Update &update);
+    static ReadNode *helpBuildSorted(const std::vector<Account> &accounts, const std::vector<int> &runs, int min, int max, Update &update);
+    static AccountNode *helpBuildAccounts(const Account *accounts, int min, int max, Update &update);
+    static void helpRetireAll(ReadNode *node, Update &update);
+    static void helpRetireUser(ReadUser *user, Update &update);
+    static void helpRetireAccounts(AccountNode *node, Update &update);
+
+    template <class Node>
+    static Node *own(Node *node, Update &update);
+    template <class Node>
+    static void discard(Node *node, Update &update);
+    template <class Node, class Order>
+    static Node *helpErase(Node *node, Order order, bool &erased, Update &update);
+    template <class Node>
+    static Node *helpRemoveMin(Node *node, Node *&min, Update &update);
+    template <class Node>
+    static Node *balance(Node *node, Update &update);
+    template <class Node>
+    static Node *rotateLeft(Node *node, Update &update);
+    template <class Node>
+    static Node *rotateRight(Node *node, Update &update);
+};
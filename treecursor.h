@@ -0,0 +1,204 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * TreeCursor.h
+ * A non-recursive in-order cursor over DNode and UNode trees.
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#define PATH_INLINE 48 /* an AVL tree of 2^33 nodes is no taller */
+
+/**
+ * Stack of the nodes (or links) on a root-to-node path. The first
+ * PATH_INLINE entries live inside the object, so walking a balanced tree
+ * never touches the heap; deeper paths spill to a heap array.
+ */
+template <class T>
+class PathStack
+{
+public:
+    PathStack() : _data(_inline), _size(0), _capacity(PATH_INLINE) {}
+    ~PathStack()
+    {
+        if (_data != _inline)
+            delete[] _data;
+    }
+
+    PathStack(const PathStack &rhs) : PathStack() { *this = rhs; }
+    PathStack &operator=(const PathStack &rhs)
+    {
+        if (this == &rhs)
+            return *this;
+        _size = 0;
+        if (rhs._size > _capacity)
+            reserve(rhs._size);
+        for (int i = 0; i < rhs._size; i++)
+            _data[i] = rhs._data[i];
+        _size = rhs._size;
+        return *this;
+    }
+
+    void push_back(T value)
+    {
+        if (_size == _capacity)
+            reserve(2 * _capacity);
+        _data[_size++] = value;
+    }
+    void pop_back() { _size--; }
+    void resize(int size) { _size = std::min(size, _size); }
+    void clear() { _size = 0; }
+
+    T &back() { return _data[_size - 1]; }
+    const T &back() const { return _data[_size - 1]; }
+    T &operator[](int i) { return _data[i]; }
+    bool empty() const { return _size == 0; }
+    int size() const { return _size; }
+
+private:
+    T _inline[PATH_INLINE];
+    T *_data;
+    int _size;
+    int _capacity;
+
+    void reserve(int capacity)
+    {
+        if (capacity <= _capacity)
+            return;
+        capacity = std::max(capacity, 2 * PATH_INLINE);
+        T *data = new T[capacity];
+        for (int i = 0; i < _size; i++)
+            data[i] = _data[i];
+        if (_data != _inline)
+            delete[] _data;
+        _data = data;
+        _capacity = capacity;
+    }
+};
+
+/**
+ * Walks a binary tree in order, forwards or backwards, without recursion.
+ * The cursor keeps the path from the root to the current node on an explicit
+ * stack, so it needs no parent pointers and its memory is bounded by the
+ * height of the tree. Node must have _left and _right members and declare
+ * TreeCursor a friend. Modifying the tree invalidates the cursor.
+ */
+template <class Node>
+class TreeCursor
+{
+public:
+    TreeCursor() {}
+
+    /**
+     * Moves to the smallest node of the tree.
+     * @param root root of the tree, may be nullptr
+     */
+    void first(Node *root)
+    {
+        _path.clear();
+        pushLeftSpine(root);
+    }
+
+    /**
+     * Moves to the largest node of the tree.
+     * @param root root of the tree, may be nullptr
+     */
+    void last(Node *root)
+    {
+        _path.clear();
+        pushRightSpine(root);
+    }
+
+    /**
+     * Moves to the in-order successor; the cursor becomes invalid past the end.
+     */
+    void next()
+    {
+        Node *node = _path.back();
+        if (node->_right != nullptr)
+        {
+            pushLeftSpine(node->_right);
+            return;
+        }
+
+        /* Climb until we leave a left subtree */
+        Node *child;
+        do
+        {
+            child = _path.back();
+            _path.pop_back();
+        } while (!_path.empty() && _path.back()->_right == child);
+    }
+
+    /**
+     * Moves to the in-order predecessor; the cursor becomes invalid past the start.
+     */
+    void prev()
+    {
+        Node *node = _path.back();
+        if (node->_left != nullptr)
+        {
+            pushRightSpine(node->_left);
+            return;
+        }
+
+        /* Climb until we leave a right subtree */
+        Node *child;
+        do
+        {
+            child = _path.back();
+            _path.pop_back();
+        } while (!_path.empty() && _path.back()->_left == child);
+    }
+
+    /**
+     * Moves to the smallest node for which goLeft is true, the way
+     * std::lower_bound would: goLeft must be false for a prefix of the
+     * in-order sequence and true for the rest. The cursor is invalid if no
+     * node qualifies.
+     * @param root root of the tree, may be nullptr
+     * @param goLeft predicate telling whether the answer is at or left of a node
+     */
+    template <class GoLeft>
+    void seek(Node *root, GoLeft goLeft)
+    {
+        _path.clear();
+        int found = 0;
+        while (root != nullptr)
+        {
+            _path.push_back(root);
+            if (goLeft(root))
+            {
+                found = _path.size();
+                root = root->_left;
+            }
+            else
+                root = root->_right;
+        }
+        _path.resize(found);
+    }
+
+    bool valid() const { return !_path.empty(); }
+    Node *get() const { return _path.back(); }
+    int depth() const { return _path.size(); }
+
+    bool operator==(const TreeCursor &rhs) const { return _path.empty() ? rhs._path.empty() : !rhs._path.empty() && _path.back() == rhs._path.back(); }
+    bool operator!=(const TreeCursor &rhs) const { return !(*this == rhs); }
+
+private:
+    PathStack<Node *> _path;
+
+    void pushLeftSpine(Node *node)
+    {
+        for (; node != nullptr; node = node->_left)
+            _path.push_back(node);
+    }
+
+    void pushRightSpine(Node *node)
+    {
+        for (; node != nullptr; node = node->_right)
+            _path.push_back(node);
+    }
+};
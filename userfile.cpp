@@ -0,0 +1,270 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * UserFile.cpp
+ * Implementation for the binary file a UTree is saved to and opened from.
+ */
+
+#include "userfile.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <unordered_map>
+
+/**
+ * Rounds a file offset up to the next multiple of 8.
+ */
+static uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/**
+ * Checks that count entries of size bytes at offset lie inside a file.
+ */
+static bool fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t fileSize)
+{
+    return offset % 8 == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+/**
+ * Destructor, unmaps the file.
+ */
+UserFile::~UserFile()
+{
+    free(_names);
+}
+
+/**
+ * Writes accounts to a user file. The file is written under a temporary name,
+ * synced and renamed into place, so neither a reader nor a crash ever leaves
+ * half of it.
+ * @param path path of the file to write
+ * @param accounts accounts sorted by (username, discriminator) without duplicates
+ * @return true if the file was written, false otherwise
+ */
+bool UserFile::write(const string &path, const std::vector<Account> &accounts)
+{
+    std::vector<UserFileUser> users;
+    std::vector<UserFileAccount> entries;
+    std::vector<UserFileString> vocabulary;
+    std::unordered_map<const string *, uint32_t> vocabularyIndex;
+    string strings;
+
+    auto addString = [&strings](const string &str) {
+        UserFileString entry = {strings.size(), str.size()};
+        strings += str;
+        return entry;
+    };
+    auto addVocabulary = [&](const string &word) {
+        auto found = vocabularyIndex.emplace(&word, vocabulary.size());
+        if (found.second)
+            vocabulary.push_back(addString(word));
+        return found.first->second;
+    };
+
+    for (size_t i = 0; i < accounts.size(); i++)
+    {
+        const Account &acct = accounts[i];
+        if (i == 0 || &acct.getUsername() != &accounts[i - 1].getUsername())
+            users.push_back({addString(acct.getUsername()), entries.size(), 0});
+        users.back().numAccounts++;
+        entries.push_back({acct.getDiscriminator(), acct.hasNitro(), addVocabulary(acct.getBadge()), addVocabulary(acct.getStatus())});
+    }
+
+    UserFileHeader header;
+    memcpy(header.magic, USERFILE_MAGIC, sizeof(header.magic));
+    header.version = USERFILE_VERSION;
+    header.byteOrder = USERFILE_BYTE_ORDER;
+    header.numUsers = users.size();
+    header.numAccounts = entries.size();
+    header.numVocabulary = vocabulary.size();
+    header.usersOffset = align8(sizeof(header));
+    header.accountsOffset = align8(header.usersOffset + users.size() * sizeof(UserFileUser));
+    header.vocabularyOffset = align8(header.accountsOffset + entries.size() * sizeof(UserFileAccount));
+    header.stringsOffset = align8(header.vocabularyOffset + vocabulary.size() * sizeof(UserFileString));
+    header.stringsSize = strings.size();
+
+    string temporary = path + ".tmp";
+    FILE *out = fopen(temporary.c_str(), "wb");
+    if (out == nullptr)
+        return false;
+
+    /* Each section starts at its offset, the gaps are zeros */
+    uint64_t written = 0;
+    auto section = [&](uint64_t offset, const void *data, size_t size) {
+        static const char zeros[8] = {};
+        bool ok = fwrite(zeros, 1, offset - written, out) == offset - written && fwrite(data, 1, size, out) == size;
+        written = offset + size;
+        return ok;
+    };
+    bool ok = section(0, &header, sizeof(header)) &&
+              section(header.usersOffset, users.data(), users.size() * sizeof(UserFileUser)) &&
+              section(header.accountsOffset, entries.data(), entries.size() * sizeof(UserFileAccount)) &&
+              section(header.vocabularyOffset, vocabulary.data(), vocabulary.size() * sizeof(UserFileString)) &&
+              section(header.stringsOffset, strings.data(), strings.size());
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return syncDirectory(path);
+}
+
+/**
+ * Maps a user file and checks, in one pass over its tables, that they lie
+ * inside it and are in the order lookups rely on: usernames ascending, each
+ * user's accounts contiguous, following the previous user's, with
+ * discriminators ascending between MIN_DISC and MAX_DISC.
+ * @param path path of the file to open
+ * @return true if the file could be mapped and is a valid user file, false otherwise
+ */
+bool UserFile::open(const string &path)
+{
+    if (!_file.open(path, false) || _file.size() < sizeof(UserFileHeader))
+        return false;
+
+    const UserFileHeader *header = reinterpret_cast<const UserFileHeader *>(_file.data());
+    uint64_t size = _file.size();
+    if (memcmp(header->magic, USERFILE_MAGIC, sizeof(header->magic)) != 0 || header->version != USERFILE_VERSION ||
+        header->byteOrder != USERFILE_BYTE_ORDER || header->numUsers > INT_MAX || header->numAccounts > INT_MAX ||
+        !fits(header->usersOffset, header->numUsers, sizeof(UserFileUser), size) ||
+        !fits(header->accountsOffset, header->numAccounts, sizeof(UserFileAccount), size) ||
+        !fits(header->vocabularyOffset, header->numVocabulary, sizeof(UserFileString), size) ||
+        !fits(header->stringsOffset, header->stringsSize, 1, size))
+        return false;
+
+    _users = reinterpret_cast<const UserFileUser *>(_file.data() + header->usersOffset);
+    _accounts = reinterpret_cast<const UserFileAccount *>(_file.data() + header->accountsOffset);
+    _strings = _file.data() + header->stringsOffset;
+
+    /* The vocabulary is a few words, interned up front */
+    const UserFileString *vocabulary = reinterpret_cast<const UserFileString *>(_file.data() + header->vocabularyOffset);
+    for (uint64_t i = 0; i < header->numVocabulary; i++)
+    {
+        if (vocabulary[i].offset > header->stringsSize || vocabulary[i].length > header->stringsSize - vocabulary[i].offset)
+            return false;
+        _vocabulary.push_back(vocabularyPool().intern(std::string_view(_strings + vocabulary[i].offset, vocabulary[i].length)));
+    }
+
+    uint64_t next = 0;
+    std::string_view previous;
+    for (uint64_t user = 0; user < header->numUsers; user++)
+    {
+        const UserFileUser &entry = _users[user];
+        if (entry.name.offset > header->stringsSize || entry.name.length > header->stringsSize - entry.name.offset ||
+            entry.firstAccount != next || entry.numAccounts == 0 || entry.numAccounts > header->numAccounts - next)
+            return false;
+        std::string_view name(_strings + entry.name.offset, entry.name.length);
+        if (user > 0 && name <= previous)
+            return false;
+        previous = name;
+
+        int lastDisc = MIN_DISC - 1;
+        for (uint64_t i = next; i < next + entry.numAccounts; i++)
+        {
+            const UserFileAccount &acct = _accounts[i];
+            if (acct.disc <= lastDisc || acct.disc > MAX_DISC || acct.badge >= header->numVocabulary ||
+                acct.status >= header->numVocabulary)
+                return false;
+            lastDisc = acct.disc;
+        }
+        next += entry.numAccounts;
+    }
+    if (next != header->numAccounts)
+        return false;
+
+    /* Zeroed pages are only touched once a username is interned */
+    _names = static_cast<const string **>(calloc(std::max<uint64_t>(1, header->numUsers), sizeof(const string *)));
+    if (_names == nullptr)
+        return false;
+    _header = header;
+    return true;
+}
+
+/**
+ * Returns the index of a username in the file.
+ * @param username username to match
+ * @return index of the user, -1 if the file has no such user
+ */
+int UserFile::findUser(std::string_view username) const
+{
+    int low = 0, high = numUsers();
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (this->username(mid) < username)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return (low < numUsers() && this->username(low) == username) ? low : -1;
+}
+/**
+ * Returns the username of a user.
+ */
+std::string_view UserFile::username(int user) const
+{
+    const UserFileString &name = _users[user].name;
+    return std::string_view(_strings + name.offset, name.length);
+}
+/**
+ * Returns the number of accounts of a user.
+ */
+int UserFile::numAccounts(int user) const
+{
+    return _users[user].numAccounts;
+}
+/**
+ * Copies out one account of a user.
+ * @param user index of the user
+ * @param disc discriminator to match
+ * @param found receives the account if there is one
+ * @return true if the account was found, false otherwise
+ */
+bool UserFile::findAccount(int user, int disc, Account &found)
+{
+    const UserFileAccount *first = _accounts + _users[user].firstAccount;
+    const UserFileAccount *last = first + numAccounts(user);
+    const UserFileAccount *entry = std::lower_bound(first, last, disc, [](const UserFileAccount &entry, int disc) {
+        return entry.disc < disc;
+    });
+    if (entry == last || entry->disc != disc)
+        return false;
+
+    found = makeAccount(user, *entry);
+    return true;
+}
+/**
+ * Appends every account of a user, in discriminator order.
+ * @param user index of the user
+ * @param accounts receives the accounts
+ */
+void UserFile::getAccounts(int user, std::vector<Account> &accounts)
+{
+    const UserFileAccount *first = _accounts + _users[user].firstAccount;
+    for (int i = 0; i < numAccounts(user); i++)
+        accounts.push_back(makeAccount(user, first[i]));
+}
+/**
+ * Builds an Account from its entry, interning the username on first use.
+ */
+Account UserFile::makeAccount(int user, const UserFileAccount &entry)
+{
+    if (_names[user] == nullptr)
+        _names[user] = &usernamePool().get(usernamePool().intern(username(user)));
+
+    Account acct;
+    acct._username = _names[user];
+    acct._disc = entry.disc;
+    acct._nitro = entry.nitro != 0;
+    acct._badge = _vocabulary[entry.badge];
+    acct._status = _vocabulary[entry.status];
+    return acct;
+}
@@ -0,0 +1,96 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * UserFile.h
+ * An interface for the binary file a UTree is saved to and opened from.
+ */
+
+#pragma once
+
+#include "dtree.h"
+#include "loader.h"
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#define USERFILE_MAGIC "UTREEBIN"
+#define USERFILE_VERSION 1
+#define USERFILE_BYTE_ORDER 0x01020304 /* reads back differently on a machine of the other endianness */
+
+/*
+ * Layout of a user file, every section 8-byte aligned:
+ * header, users sorted by username, accounts of each user sorted by
+ * discriminator, badge and status vocabulary, then the bytes of every string.
+ */
+struct UserFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t numUsers;
+    uint64_t numAccounts;
+    uint64_t numVocabulary;
+    uint64_t usersOffset;
+    uint64_t accountsOffset;
+    uint64_t vocabularyOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+struct UserFileString
+{
+    uint64_t offset; /* from the start of the string bytes */
+    uint64_t length;
+};
+
+struct UserFileUser
+{
+    UserFileString name;
+    uint64_t firstAccount;
+    uint64_t numAccounts;
+};
+
+struct UserFileAccount
+{
+    int32_t disc;
+    uint32_t nitro;
+    uint32_t badge; /* index into the vocabulary */
+    uint32_t status;
+};
+
+/**
+ * A user file mapped into memory and read in place. Opening one checks its
+ * header and tables in one pass and interns its small vocabulary, but builds
+ * nothing else; lookups binary search the mapped tables. A username is interned the first time an
+ * Account of that user is handed out. A UserFile is not thread-safe.
+ */
+class UserFile
+{
+public:
+    UserFile() : _header(nullptr), _users(nullptr), _accounts(nullptr), _strings(nullptr), _names(nullptr) {}
+    ~UserFile();
+
+    UserFile(const UserFile &) = delete;
+    UserFile &operator=(const UserFile &) = delete;
+
+    static bool write(const string &path, const std::vector<Account> &accounts);
+    bool open(const string &path);
+
+    int numUsers() const { return (_header == nullptr) ? 0 : _header->numUsers; }
+    int findUser(std::string_view username) const;
+    std::string_view username(int user) const;
+    int numAccounts(int user) const;
+    bool findAccount(int user, int disc, Account &found);
+    void getAccounts(int user, std::vector<Account> &accounts);
+
+private:
+    MappedFile _file;
+    const UserFileHeader *_header;
+    const UserFileUser *_users;
+    const UserFileAccount *_accounts;
+    const char *_strings;
+    std::vector<int> _vocabulary; /* vocabularyPool() id of each vocabulary entry */
+    const string **_names;        /* interned usernames, nullptr until first needed */
+
+    Account makeAccount(int user, const UserFileAccount &entry);
+};
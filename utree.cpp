@@ -6,64 +6,342 @@
  */
 
 #include "utree.h"
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * Orders accounts by username, then by discriminator. Usernames are interned,
+ * so equal usernames are recognised by address without comparing characters.
+ */
+static bool accountLess(const Account &a, const Account &b)
+{
+    if (&a.getUsername() != &b.getUsername())
+        return a.getUsername() < b.getUsername();
+    return a.getDiscriminator() < b.getDiscriminator();
+}
+
+/**
+ * Constructor, optionally draws every UNode and DNode from slab pools owned by
+ * the tree instead of allocating them one by one.
+ * A concurrent tree may be used by several threads at once through insert,
+ * insertOrGet, removeUser, retrieve, retrieveUser, retrieveUsers, findUser,
+ * numUsers, snapshot, clear and freeze. Readers never block each other, and
+ * writers to users on different lock stripes proceed in parallel; adding or
+ * removing a username locks the whole tree. A returned pointer stays valid only until
+ * another thread changes that user. findUser and numUsers take no lock at
+ * all: they read a ReadIndex that every write also updates.
+ * Loading, iterating, printing and dumping are not synchronized. The DTrees
+ * of a concurrent tree allocate from the heap, since a DNode pool would be
+ * shared between stripes.
+ * @param pooled true to use node pools
+ * @param index how usernames are indexed
+ * @param concurrent true to share the tree between threads
+ */
+UTree::UTree(bool pooled, UserIndex index, bool concurrent)
+    : _root(nullptr), _unodePool(nullptr), _dnodePool(nullptr), _btree(nullptr), _locks(nullptr), _readIndex(nullptr), _log(nullptr)
+{
+    if (pooled)
+    {
+        _unodePool = new NodePool<UNode>();
+        if (!concurrent)
+            _dnodePool = new NodePool<DNode>();
+    }
+    if (index == UserIndex::BTREE)
+        _btree = new BTree();
+    if (concurrent)
+    {
+        _locks = new UTreeLocks();
+        _readIndex = new ReadIndex();
+    }
+}
 
 /**
  * Destructor, deletes all dynamic memory.
  */
 UTree::~UTree()
 {
+    /* Closing syncs the log; tearing the tree down is not a mutation */
+    delete _log;
+    _log = nullptr;
     clear();
+    delete _unodePool;
+    delete _dnodePool;
+    delete _btree;
+    delete _locks;
+    delete _readIndex;
 }
 
 /**
  * Sources a .csv file to populate Account objects and insert them into the UTree.
+ * Throws std::invalid_argument if the file cannot be loaded or has a malformed
+ * line, with the reason reported for it.
  * @param infile path to .csv file containing database of accounts
  * @param append true to append to an existing tree structure or false to clear before importing
  */
 void UTree::loadData(string infile, bool append)
 {
-    std::ifstream instream(infile);
-    string line;
-    char delim = ',';
-    const int numFields = 5;
-    string fields[numFields];
+    std::vector<LoadError> errors;
+
+    /* A file that could not be loaded at all is reported last */
+    if (loadData(infile, append, errors) < 0)
+        throw std::invalid_argument("File " + infile + ": " + errors.back().message);
 
-    /* Check to make sure the file was opened */
-    if (!instream.is_open())
+    /* Every well-formed line has been inserted, report the first bad one */
+    if (!errors.empty())
     {
-        std::cerr << __FUNCTION__ << ": File " << infile << " could not be opened or located" << endl;
-        exit(-1);
+        throw std::invalid_argument("Malformed input file detected at line " + std::to_string(errors[0].line) +
+                                    " (byte " + std::to_string(errors[0].offset) + ") - " + errors[0].message);
     }
+}
 
-    /* Should we append or clear? */
-    if (!append)
-        this->clear();
+/**
+ * Sources a .csv file; malformed lines are skipped and reported instead of
+ * aborting the load. Appending streams the file through a fixed amount of
+ * memory, see streamData. A fresh tree (append == false) sorts every account
+ * before building bottom-up, so it reads the file through a read-only memory
+ * mapping instead: the file is split into newline-aligned chunks that are
+ * parsed by numThreads workers, and the tree is built on numThreads workers,
+ * each owning a disjoint range of usernames.
+ * @param infile path to .csv file containing database of accounts
+ * @param append true to append to an existing tree structure or false to clear before importing
+ * @param errors receives the line number, byte offset and reason of every malformed line
+ * @param numThreads number of worker threads for a fresh tree, 0 to use every hardware thread
+ * @return number of accounts inserted, -1 if the file could not be opened
+ */
+int UTree::loadData(string infile, bool append, std::vector<LoadError> &errors, int numThreads)
+{
+    if (append)
+        return streamData(infile, errors);
 
-    /* Read in the data from the .csv file and insert into the UTree */
-    while (std::getline(instream, line))
+    MappedFile file;
+    if (!file.open(infile))
     {
-        std::stringstream buffer(line);
+        errors.push_back({0, 0, "file could not be opened or located"});
+        return -1;
+    }
 
-        /* Quick check to make sure each line is formatted correctly */
-        int delimCount = 0;
-        for (unsigned int c = 0; c < buffer.str().length(); c++)
-            if (buffer.str()[c] == delim)
-                delimCount++;
-        if (delimCount != numFields - 1)
-        {
-            throw std::invalid_argument("Malformed input file detected - ensure each line contains 5 fields deliminated by a ','");
-        }
+    if (!this->clear())
+    {
+        errors.push_back({0, 0, "tree could not be cleared, its log has failed"});
+        return -1;
+    }
+
+    if (numThreads <= 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    /* Parse and sort every chunk */
+    std::vector<ChunkResult> chunks = splitChunks(file.data(), file.size(), numThreads);
+    auto parse = [&](size_t i) {
+        parseChunk(file.data(), chunks[i]);
+        std::stable_sort(chunks[i].accounts.begin(), chunks[i].accounts.end(), accountLess);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunks.size(); i++)
+        workers.emplace_back(parse, i);
+    if (!chunks.empty())
+        parse(0);
+    for (std::thread &worker : workers)
+        worker.join();
+    mergeChunkErrors(chunks, errors);
+
+    /* Merge neighbouring batches pairwise; std::merge is stable, so equal
+     * accounts stay in file order and the first occurrence wins */
+    std::vector<std::vector<Account>> batches;
+    for (ChunkResult &chunk : chunks)
+        batches.push_back(std::move(chunk.accounts));
+    while (batches.size() > 1)
+    {
+        std::vector<std::vector<Account>> merged((batches.size() + 1) / 2);
+        auto merge = [&](size_t i) {
+            if (2 * i + 1 == batches.size())
+            {
+                merged[i] = std::move(batches[2 * i]);
+                return;
+            }
+            std::vector<Account> &first = batches[2 * i], &second = batches[2 * i + 1];
+            merged[i].reserve(first.size() + second.size());
+            std::merge(std::make_move_iterator(first.begin()), std::make_move_iterator(first.end()),
+                       std::make_move_iterator(second.begin()), std::make_move_iterator(second.end()),
+                       std::back_inserter(merged[i]), accountLess);
+        };
+        workers.clear();
+        for (size_t i = 1; i < merged.size(); i++)
+            workers.emplace_back(merge, i);
+        merge(0);
+        for (std::thread &worker : workers)
+            worker.join();
+        batches = std::move(merged);
+    }
+
+    if (batches.empty())
+        return 0;
+
+    /* Node pools are not thread-safe, a pooled tree is built on one thread */
+    buildSorted(batches[0], (_unodePool != nullptr) ? 1 : numThreads);
+    if (_log != nullptr)
+        checkpoint();
+    return batches[0].size();
+}
+
+/**
+ * Appends the accounts of a .csv file while it is still being read. A reader
+ * thread fills a pair of buffers, a parser thread turns them into batches of
+ * accounts, and this thread inserts each batch; the stages are joined by
+ * bounded queues, so memory use does not grow with the size of the file.
+ * @param infile path to .csv file containing database of accounts
+ * @param errors receives the line number, byte offset and reason of every malformed line
+ * Once the log fails, the remaining accounts are read but not inserted.
+ * @return number of accounts inserted, -1 if the file could not be opened
+ * or the accounts inserted could not be logged; those stay in the tree
+ */
+int UTree::streamData(const string &infile, std::vector<LoadError> &errors)
+{
+    StreamReader reader;
+    if (!reader.open(infile))
+    {
+        errors.push_back({0, 0, "file could not be opened or located"});
+        return -1;
+    }
+
+    BoundedQueue<std::vector<Account>> batches(STREAM_QUEUE_DEPTH);
+    std::vector<LoadError> parseErrors;
+    std::thread parser([&]() { parseStream(reader, batches, parseErrors); });
+
+    /* Logged records are waited for once, as one group */
+    int inserted = 0;
+    uint64_t logged = 0;
+    std::vector<Account> batch;
+    try
+    {
+        while (batches.pop(batch))
+            for (const Account &newAcct : batch)
+            {
+                if (logged == LOG_FAILED)
+                    break;
+                bool wasInserted;
+                logInsertOrGet(newAcct, wasInserted, logged);
+                if (wasInserted)
+                    inserted++;
+            }
+    }
+    catch (...)
+    {
+        /* The parser stops at its next push, a joinable thread must not be destroyed */
+        batches.close();
+        parser.join();
+        throw;
+    }
+    parser.join();
+    bool durable = awaitLog(logged);
 
-        /* Populate the account attributes - 
-         * Each line always has 5 sections of data */
-        for (int i = 0; i < numFields; i++)
+    errors.insert(errors.end(), parseErrors.begin(), parseErrors.end());
+    if (!durable)
+    {
+        errors.push_back({0, 0, "accounts could not be logged"});
+        return -1;
+    }
+    return inserted;
+}
+
+/**
+ * Builds the UTree and every DTree directly from a batch of accounts, without
+ * any per-account descent or rebalancing. The tree must be empty.
+ * Duplicate (username, discriminator) pairs keep their first occurrence.
+ * @param accounts accounts sorted by (username, discriminator), deduplicated in place
+ * @param numThreads number of threads sharing the build
+ */
+void UTree::buildSorted(std::vector<Account> &accounts, int numThreads)
+{
+    accounts.erase(std::unique(accounts.begin(), accounts.end(), [](const Account &a, const Account &b) {
+                       return a.getDiscriminator() == b.getDiscriminator() && &a.getUsername() == &b.getUsername();
+                   }),
+                   accounts.end());
+    if (keepsReadIndex())
+        _readIndex->buildSorted(accounts);
+
+    /* runs[i] is the index of the first account of the i-th username */
+    std::vector<int> runs;
+    for (unsigned int i = 0; i < accounts.size(); i++)
+        if (i == 0 || &accounts[i].getUsername() != &accounts[i - 1].getUsername())
+            runs.push_back(i);
+    runs.push_back(accounts.size());
+
+    if (_btree == nullptr)
+    {
+        helpBuildSorted(_root, accounts.data(), runs, 0, (int)runs.size() - 2, numThreads);
+        return;
+    }
+
+    /* Every thread fills a contiguous range of UNodes, then the index is
+     * built over all of them at once */
+    int numUsers = runs.size() - 1;
+    std::vector<UNode *> users(numUsers);
+    auto build = [&](int min, int max) {
+        for (int i = min; i < max; i++)
         {
-            std::getline(buffer, line, delim);
-            fields[i] = line;
+            users[i] = newNode();
+            users[i]->_username = accounts[runs[i]]._username;
+            users[i]->_dtree.buildSorted(accounts.data() + runs[i], runs[i + 1] - runs[i]);
         }
-        Account newAcct = Account(fields[0], std::stoi(fields[1]), std::stoi(fields[2]), fields[3], fields[4]);
-        this->insert(newAcct);
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numThreads; t++)
+        workers.emplace_back(build, (long)numUsers * t / numThreads, (long)numUsers * (t + 1) / numThreads);
+    build(0, numUsers / numThreads);
+    for (std::thread &worker : workers)
+        worker.join();
+
+    _btree->buildSorted(users.data(), numUsers);
+}
+/**
+ * Helper funtion for build sorted, the middle username becomes the subtree root.
+ * While more than one thread is available the left subtree is handed to a new thread.
+ */
+void UTree::helpBuildSorted(UNode *&root, const Account *accounts, const std::vector<int> &runs, int min, int max, int numThreads)
+{
+    if (min > max)
+        return;
+
+    int mid = (max + min) / 2;
+    root = newNode();
+    root->_username = accounts[runs[mid]]._username;
+    root->_dtree.buildSorted(accounts + runs[mid], runs[mid + 1] - runs[mid]);
+
+    if (numThreads > 1)
+    {
+        std::thread left(&UTree::helpBuildSorted, this, std::ref(root->_left), accounts, std::cref(runs), min, mid - 1, numThreads / 2);
+        helpBuildSorted(root->_right, accounts, runs, mid + 1, max, numThreads - numThreads / 2);
+        left.join();
+    }
+    else
+    {
+        helpBuildSorted(root->_left, accounts, runs, min, mid - 1, 1);
+        helpBuildSorted(root->_right, accounts, runs, mid + 1, max, 1);
     }
+    updateHeight(root);
+}
+
+/**
+ * Allocates a UNode from the tree's pool, or from the heap if it has none.
+ * @return the new UNode, its DTree draws from the DNode pool
+ */
+UNode *UTree::newNode()
+{
+    if (_unodePool != nullptr)
+        return _unodePool->create(_dnodePool);
+    return new UNode();
+}
+/**
+ * Returns a UNode to wherever newNode took it from.
+ */
+void UTree::deleteNode(UNode *node)
+{
+    if (_unodePool != nullptr)
+        _unodePool->destroy(node);
+    else
+        delete node;
 }
 
 /**
@@ -73,187 +351,355 @@ void UTree::loadData(string infile, bool append)
  * @param newAcct Account object to be inserted into the corresponding DTree
  * @return true if the account was inserted, false otherwise
  */
-bool UTree::insert(Account newAcct)
+bool UTree::insert(const Account &newAcct)
 {
-    if (retrieveUser(newAcct.getUsername(), newAcct.getDiscriminator()) != nullptr)
-        return false;
+    bool inserted;
+    insertOrGet(newAcct, inserted);
+    return inserted;
+}
+/**
+ * Inserts an account unless the user already has one with the same
+ * discriminator, in a single descent of the UTree and the DTree.
+ * @param newAcct Account object to be inserted into the corresponding DTree
+ * An insert the log could not take is undone, so it has no effect.
+ * @param inserted set to true if the account was inserted, false otherwise
+ * @return the new DNode, or the existing one holding the account's discriminator,
+ * nullptr if the discriminator is out of range or the insert could not be logged
+ */
+DNode *UTree::insertOrGet(const Account &newAcct, bool &inserted)
+{
+    uint64_t logged = 0;
+    DNode *node = logInsertOrGet(newAcct, inserted, logged);
+    if (awaitLog(logged))
+        return node;
 
-    helpInsert(newAcct, _root);
-    return true;
+    /* The log has failed for good, undoing is not logged */
+    DNode *undone;
+    if (logRemoveUser(newAcct.getUsername(), newAcct.getDiscriminator(), undone, logged))
+        delete undone;
+    inserted = false;
+    return nullptr;
 }
 /**
- * Helper funtion for insert.
+ * Helper funtion for insert or get, logs the account but does not wait for
+ * the log to reach disk. The record is appended under the same lock as the
+ * change, so the log holds the changes to each user in the order applied.
  */
-void UTree::helpInsert(Account newAcct, UNode *&root)
+DNode *UTree::logInsertOrGet(const Account &newAcct, bool &inserted, uint64_t &logged)
 {
-    if (root == nullptr)
+    inserted = false;
+    if (newAcct.getDiscriminator() < MIN_DISC || newAcct.getDiscriminator() > MAX_DISC)
+        return nullptr;
+
+    if (_locks == nullptr)
     {
-        root = new UNode();
-        root->_dtree->insert(newAcct);
-        updateHeight(root);
-        return;
+        DNode *node = helpInsertOrGet(newAcct, inserted);
+        if (inserted)
+            logged = logMutation(WAL_INSERT, &newAcct, newAcct.getUsername(), newAcct.getDiscriminator());
+        return node;
     }
-    if (root->getUsername() == newAcct.getUsername())
+
+    /* An existing user only needs its own stripe */
     {
-        root->_dtree->insert(newAcct);
-        if (checkImbalance(root))
-            rebalance(root);
-        return;
+        std::shared_lock<std::shared_mutex> structure(_locks->structure);
+        if (UNode *user = helpFind(newAcct.getUsername()))
+        {
+            std::unique_lock<std::shared_mutex> guard(_locks->forUser(user->_username));
+            DNode *node = user->_dtree.insertOrGet(newAcct, inserted);
+            if (inserted)
+            {
+                _readIndex->put(newAcct);
+                logged = logMutation(WAL_INSERT, &newAcct, newAcct.getUsername(), newAcct.getDiscriminator());
+            }
+            return node;
+        }
     }
 
-    if (root->getUsername() > newAcct.getUsername())
+    /* A new one links a UNode in; the descent rechecks, it may exist by now */
+    std::unique_lock<std::shared_mutex> structure(_locks->structure);
+    DNode *node = helpInsertOrGet(newAcct, inserted);
+    if (inserted)
+        logged = logMutation(WAL_INSERT, &newAcct, newAcct.getUsername(), newAcct.getDiscriminator());
+    return node;
+}
+/**
+ * Helper funtion for insert or get, without locking.
+ */
+DNode *UTree::helpInsertOrGet(const Account &newAcct, bool &inserted)
+{
+    DNode *node;
+    if (_btree == nullptr)
+        node = helpInsert(newAcct, _root, inserted);
+    else
     {
-        helpInsert(newAcct, root->_left);
-        updateHeight(root);
-        if (checkImbalance(root))
-            rebalance(root);
-        return;
+        UNode *user = _btree->find(newAcct.getUsername());
+        if (user == nullptr)
+        {
+            user = newNode();
+            user->_username = newAcct._username;
+            _btree->insert(user);
+        }
+        node = user->_dtree.insertOrGet(newAcct, inserted);
     }
-    if (root->getUsername() < newAcct.getUsername())
+
+    if (inserted && keepsReadIndex())
+        _readIndex->put(newAcct);
+    return node;
+}
+/**
+ * Helper funtion for insert.
+ */
+DNode *UTree::helpInsert(const Account &newAcct, UNode *&root, bool &inserted)
+{
+    /* Links followed from root, so rotations can replace the subtree roots */
+    PathStack<UNode **> path;
+
+    UNode **link = &root;
+    while (*link != nullptr && (*link)->_username != newAcct._username)
     {
-        helpInsert(newAcct, root->_right);
-        updateHeight(root);
-        if (checkImbalance(root))
-            rebalance(root);
-        return;
+        path.push_back(link);
+        link = (newAcct.getUsername() < (*link)->getUsername()) ? &(*link)->_left : &(*link)->_right;
     }
 
-    return;
+    /* An existing user keeps its height, so only a new UNode needs a retrace */
+    if (*link != nullptr)
+        return (*link)->_dtree.insertOrGet(newAcct, inserted);
+
+    *link = newNode();
+    (*link)->_username = newAcct._username;
+    DNode *node = (*link)->_dtree.insertOrGet(newAcct, inserted);
+
+    for (int i = path.size() - 1; i >= 0; i--)
+    {
+        updateHeight(*path[i]);
+        if (checkImbalance(*path[i]))
+            rebalance(*path[i]);
+    }
+    return node;
 }
 /**
  * Removes a user with a matching username and discriminator.
  * @param username username to match
  * @param disc discriminator to match
+ * A removal the log could not take is undone, so it has no effect.
  * @param removed DNode object to hold removed account
- * @return true if an account was removed, false otherwise
+ * @return true if an account was removed, false otherwise or if the removal could not be logged
  */
-bool UTree::removeUser(string username, int disc, DNode *&removed)
+bool UTree::removeUser(std::string_view username, int disc, DNode *&removed)
 {
-    helpRemoveUser(username, disc, removed, _root);
-    if (removed == nullptr)
-        return false;
+    uint64_t logged = 0;
+    bool found = logRemoveUser(username, disc, removed, logged);
+    if (awaitLog(logged))
+        return found;
 
-    return true;
+    /* The log has failed for good, undoing is not logged */
+    bool reinserted;
+    logInsertOrGet(removed->getAccount(), reinserted, logged);
+    delete removed;
+    removed = nullptr;
+    return false;
 }
 /**
- * Helper funtion for remove User.
+ * Helper funtion for remove user, logs the removal but does not wait for
+ * the log to reach disk.
  */
-void UTree::helpRemoveUser(string username, int disc, DNode *&removed, UNode *&root)
+bool UTree::logRemoveUser(std::string_view username, int disc, DNode *&removed, uint64_t &logged)
 {
-    if (root == nullptr)
-        return;
+    removed = nullptr;
+    if (_locks == nullptr)
+    {
+        if (!helpRemove(username, disc, removed))
+            return false;
+        logged = logMutation(WAL_REMOVE, nullptr, username, disc);
+        return true;
+    }
 
-    if (root->getUsername() == username)
+    /* Only removing the last account of a user takes its UNode away */
     {
-        root->_dtree->remove(disc, removed);
-        if (root->_dtree->getNumUsers() == 0)
+        std::shared_lock<std::shared_mutex> structure(_locks->structure);
+        UNode *user = helpFind(username);
+        if (user == nullptr)
+            return false;
+
+        std::unique_lock<std::shared_mutex> guard(_locks->forUser(user->_username));
+        if (user->_dtree.getNumUsers() > 1)
         {
-            UNode* temp = helpDeleteNodeAVL(root);
-            root = temp;
-            deepHeightUpdate(root);
+            user->_dtree.remove(disc, removed);
+            if (removed == nullptr)
+                return false;
+            _readIndex->erase(username, disc);
+            logged = logMutation(WAL_REMOVE, nullptr, username, disc);
+            return true;
         }
-        return;
     }
 
-    if (root->getUsername() > username)
-    {
-        helpRemoveUser(username, disc, removed, root->_left);
-        updateHeight(root);
-        return;
-    }
-    if (root->getUsername() < username)
+    std::unique_lock<std::shared_mutex> structure(_locks->structure);
+    if (!helpRemove(username, disc, removed))
+        return false;
+    logged = logMutation(WAL_REMOVE, nullptr, username, disc);
+    return true;
+}
+/**
+ * Appends a mutation to the log, if the tree has one.
+ * @param type WAL_INSERT, WAL_REMOVE or WAL_CLEAR
+ * @param acct inserted account, nullptr for any other mutation
+ * @param username username of the account inserted or removed
+ * @param disc discriminator of the account inserted or removed
+ * @return sequence number to pass to awaitLog, 0 if the tree has no log,
+ * LOG_FAILED if the log could not take the mutation
+ */
+uint64_t UTree::logMutation(int type, const Account *acct, std::string_view username, int disc)
+{
+    if (_log == nullptr)
+        return 0;
+
+    WalRecord record = {type, username, disc, false, std::string_view(), std::string_view()};
+    if (acct != nullptr)
     {
-        helpRemoveUser(username, disc, removed, root->_right);
-        updateHeight(root);
-        return;
+        record.nitro = acct->hasNitro();
+        record.badge = acct->getBadge();
+        record.status = acct->getStatus();
     }
-
-    return;
+    uint64_t sequence = _log->append(record);
+    return (sequence != 0) ? sequence : LOG_FAILED;
 }
-void UTree::deepHeightUpdate(UNode *&root)
+/**
+ * Waits until a logged mutation is on disk. Writers that wait at the same
+ * time share one sync, so only clear() waits while holding a lock.
+ * @param logged sequence number from logMutation, 0 for none
+ * @return true if the mutation is on disk or nothing was logged, false if
+ * the log could not take it or failed before syncing it
+ */
+bool UTree::awaitLog(uint64_t logged)
 {
-    if (root == nullptr)
-        return;
-
-    deepHeightUpdate(root->_left);
-    deepHeightUpdate(root->_right);
-
-    updateHeight(root);
+    if (logged == 0)
+        return true;
+    return logged != LOG_FAILED && _log->waitDurable(logged);
 }
 /**
- * Helper funtion to delete a node in an AVL tree.
+ * Helper funtion for remove user, without locking.
  */
-UNode *UTree::helpDeleteNodeAVL(UNode *root)
+bool UTree::helpRemove(std::string_view username, int disc, DNode *&removed)
 {
-
-    if (root->_left != nullptr)
+    if (_btree == nullptr)
+        helpRemoveUser(username, disc, removed, _root);
+    else if (UNode *user = _btree->find(username))
     {
-        UNode *tempR = root->_right;
-        UNode *tempL = root->_left;
+        user->_dtree.remove(disc, removed);
+        if (removed != nullptr && user->_dtree.getNumUsers() == 0)
+            deleteNode(_btree->erase(username));
+    }
+    if (removed == nullptr)
+        return false;
 
-        root = highestNode(root->_left);
-        root->_right = tempR;
-        
-        if (root != tempL)
-            root->_left = tempL;
+    if (keepsReadIndex())
+        _readIndex->erase(username, disc);
+    return true;
+}
+/**
+ * Helper funtion for remove User.
+ */
+void UTree::helpRemoveUser(std::string_view username, int disc, DNode *&removed, UNode *&root)
+{
+    /* Links followed from root, so rotations can replace the subtree roots */
+    PathStack<UNode **> path;
 
-        return root;
+    UNode **link = &root;
+    int order;
+    while (*link != nullptr && (order = username.compare((*link)->getUsername())) != 0)
+    {
+        path.push_back(link);
+        link = (order < 0) ? &(*link)->_left : &(*link)->_right;
     }
+    if (*link == nullptr)
+        return;
 
-    UNode *tempR = root->_right;
-
-    delete root;
-    root = tempR;
+    (*link)->_dtree.remove(disc, removed);
+    if (removed == nullptr || (*link)->_dtree.getNumUsers() != 0)
+        return;
 
-    return root;
+    helpDeleteNodeAVL(path, link);
+    for (int i = path.size() - 1; i >= 0; i--)
+    {
+        updateHeight(*path[i]);
+        if (checkImbalance(*path[i]))
+            rebalance(*path[i]);
+    }
 }
 /**
- * Helper funtion to find highest node
+ * Helper funtion to delete a node in an AVL tree. A node with two children
+ * is replaced by its in-order successor, which is relinked rather than
+ * copied. Only the nodes whose subtrees changed are added to path, so the
+ * caller retraces just the search path.
+ * @param path links followed from the root to link, extended to the
+ * lowest link whose subtree changed
+ * @param link link to the node to delete
  */
-UNode *UTree::highestNode(UNode *&root)
+void UTree::helpDeleteNodeAVL(PathStack<UNode **> &path, UNode **link)
 {
-    UNode *node = root;
-    if (node->_right == nullptr)
-        return node;
-
-    while (node->_right->_right != NULL)
-        node = node->_right;
-
-    if (node->_right->_left != nullptr)
+    UNode *node = *link;
+    if (node->_left == nullptr || node->_right == nullptr)
     {
-        UNode *temp = node->_right;
-        node->_right = node->_right->_left;
-        return temp;
+        *link = (node->_left != nullptr) ? node->_left : node->_right;
+        deleteNode(node);
+        return;
     }
 
-    UNode *temp = node->_right;
-    node->_right = nullptr;
+    /* Unlink the successor, the leftmost node of the right subtree */
+    path.push_back(link);
+    int top = path.size();
+    UNode **successorLink = &node->_right;
+    while ((*successorLink)->_left != nullptr)
+    {
+        path.push_back(successorLink);
+        successorLink = &(*successorLink)->_left;
+    }
+    UNode *successor = *successorLink;
+    *successorLink = successor->_right;
 
-    return temp;
+    /* and put it where node was; the walk began at the link it takes over */
+    successor->_left = node->_left;
+    successor->_right = node->_right;
+    *link = successor;
+    if (path.size() > top)
+        path[top] = &successor->_right;
+    deleteNode(node);
 }
 /**
  * Retrieves a set of users within a UNode.
  * @param username username to match
  * @return UNode with a matching username, nullptr otherwise
  */
-UNode *UTree::retrieve(string username)
+UNode *UTree::retrieve(std::string_view username)
 {
+    if (_locks == nullptr)
+        return helpFind(username);
+
+    std::shared_lock<std::shared_mutex> structure(_locks->structure);
+    return helpFind(username);
+}
+/**
+ * Helper funtion for retrieve, without locking.
+ */
+UNode *UTree::helpFind(std::string_view username)
+{
+    if (_btree != nullptr)
+        return _btree->find(username);
     return helpRetrieve(username, _root);
 }
 /**
  * Helper funtion for retrieve.
  */
-UNode *UTree::helpRetrieve(string username, UNode *root)
+UNode *UTree::helpRetrieve(std::string_view username, UNode *root)
 {
-    if (root == nullptr)
-        return nullptr;
-    if (username == root->getUsername())
-        return root;
-
-    if (username < root->getUsername())
-        return helpRetrieve(username, root->_left);
-    if (username > root->getUsername())
-        return helpRetrieve(username, root->_right);
+    /* One comparison per level decides the direction */
+    while (root != nullptr)
+    {
+        int order = username.compare(root->getUsername());
+        if (order == 0)
+            return root;
+        root = (order < 0) ? root->_left : root->_right;
+    }
 
     return nullptr;
 }
@@ -263,106 +709,623 @@ UNode *UTree::helpRetrieve(string username, UNode *root)
  * @param disc discriminator to match
  * @return DNode with a matching username and discriminator, nullptr otherwise
  */
-DNode *UTree::retrieveUser(string username, int disc)
+DNode *UTree::retrieveUser(std::string_view username, int disc)
 {
+    if (_locks != nullptr)
+    {
+        std::shared_lock<std::shared_mutex> structure(_locks->structure);
+        UNode *user = helpFind(username);
+        if (user == nullptr)
+            return nullptr;
+        std::shared_lock<std::shared_mutex> guard(_locks->forUser(user->_username));
+        return user->_dtree.retrieve(disc);
+    }
+
+    if (_btree != nullptr)
+    {
+        UNode *user = _btree->find(username);
+        return (user == nullptr) ? nullptr : user->_dtree.retrieve(disc);
+    }
     return helpRetrieveUser(username, disc, _root);
 }
 /**
  * Helper funtion for retrieve user.
  */
-DNode *UTree::helpRetrieveUser(string username, int disc, UNode *root)
+DNode *UTree::helpRetrieveUser(std::string_view username, int disc, UNode *root)
 {
-    if (root == nullptr)
-        return nullptr;
-    if (username == root->getUsername())
-        return root->_dtree->retrieve(disc);
-
-    if (username < root->getUsername())
-        return helpRetrieveUser(username, disc, root->_left);
-    if (username > root->getUsername())
-        return helpRetrieveUser(username, disc, root->_right);
+    while (root != nullptr)
+    {
+        int order = username.compare(root->getUsername());
+        if (order == 0)
+            return root->_dtree.retrieve(disc);
+        root = (order < 0) ? root->_left : root->_right;
+    }
 
     return nullptr;
 }
+/**
+ * Copies out the specified Account, which stays safe to use however other
+ * threads change the tree afterwards.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param found receives the account if there is one
+ * @return true if the account was found, false otherwise
+ */
+bool UTree::findUser(std::string_view username, int disc, Account &found)
+{
+    if (_readIndex != nullptr)
+        return _readIndex->find(username, disc, found);
+
+    UNode *user = helpFind(username);
+    if (user == nullptr)
+        return false;
+
+    DNode *node = user->_dtree.retrieve(disc);
+    if (node == nullptr)
+        return false;
+
+    found = node->getAccount();
+    return true;
+}
+/**
+ * Retrieves several users at once. Lookups run in groups of BATCH_GROUP
+ * whose descents advance together, each prefetching the node it reads next,
+ * so the cache misses of a group overlap instead of queueing.
+ * @param queries username and discriminator of each user to retrieve
+ * @param count number of queries
+ * @param results receives each DNode, or nullptr if it was not found
+ */
+void UTree::retrieveUsers(const std::pair<std::string_view, int> *queries, size_t count, DNode **results)
+{
+    std::shared_lock<std::shared_mutex> structure;
+    if (_locks != nullptr)
+        structure = std::shared_lock<std::shared_mutex>(_locks->structure);
+
+    for (size_t base = 0; base < count; base += BATCH_GROUP)
+    {
+        int group = (int)std::min<size_t>(BATCH_GROUP, count - base);
+        const std::pair<std::string_view, int> *batch = queries + base;
+        UNode *users[BATCH_GROUP];
+
+        if (_btree != nullptr)
+        {
+            std::string_view usernames[BATCH_GROUP];
+            for (int i = 0; i < group; i++)
+                usernames[i] = batch[i].first;
+            _btree->findBatch(usernames, group, users);
+        }
+        else
+            helpRetrieveBatch(batch, group, users);
+
+        /* Stripes are taken one user at a time, never several together */
+        if (_locks != nullptr)
+        {
+            for (int i = 0; i < group; i++)
+            {
+                results[base + i] = nullptr;
+                if (users[i] == nullptr)
+                    continue;
+                std::shared_lock<std::shared_mutex> guard(_locks->forUser(users[i]->_username));
+                results[base + i] = users[i]->_dtree.retrieve(batch[i].second);
+            }
+            continue;
+        }
+
+        DTree *trees[BATCH_GROUP];
+        int discs[BATCH_GROUP];
+        for (int i = 0; i < group; i++)
+        {
+            trees[i] = (users[i] == nullptr) ? nullptr : &users[i]->_dtree;
+            discs[i] = batch[i].second;
+        }
+        DTree::retrieveBatch(trees, discs, group, results + base);
+    }
+}
+/**
+ * Helper funtion for retrieve users. Each round first prefetches the
+ * usernames of the current nodes, then compares against them and prefetches
+ * the children, so both misses of a level overlap across the group.
+ */
+void UTree::helpRetrieveBatch(const std::pair<std::string_view, int> *queries, int count, UNode **users)
+{
+    UNode *nodes[BATCH_GROUP];
+    int pending[BATCH_GROUP];
+    int numPending = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        users[i] = nullptr;
+        nodes[i] = _root;
+        if (_root != nullptr)
+            pending[numPending++] = i;
+    }
+
+    while (numPending > 0)
+    {
+        for (int k = 0; k < numPending; k++)
+            __builtin_prefetch(nodes[pending[k]]->_username);
+
+        int kept = 0;
+        for (int k = 0; k < numPending; k++)
+        {
+            int i = pending[k];
+            UNode *node = nodes[i];
+            int order = queries[i].first.compare(node->getUsername());
+            if (order == 0)
+            {
+                users[i] = node;
+                continue;
+            }
+
+            node = (order < 0) ? node->_left : node->_right;
+            if (node == nullptr)
+                continue;
+            __builtin_prefetch(node);
+            nodes[i] = node;
+            pending[kept++] = i;
+        }
+        numPending = kept;
+    }
+}
 /**
  * Returns the number of users with a specific username.
  * @param username username to match
  * @return number of users with the specified username
  */
-int UTree::numUsers(string username)
+int UTree::numUsers(std::string_view username)
 {
+    if (_readIndex != nullptr)
+        return _readIndex->numUsers(username);
+
+    if (_btree != nullptr)
+    {
+        UNode *user = _btree->find(username);
+        return (user == nullptr) ? 0 : user->_dtree.getNumUsers();
+    }
     return helpNumUsers(username, _root);
 }
 /**
  * Helper funtion for num Users.
  */
-int UTree::helpNumUsers(string username, UNode *root)
+int UTree::helpNumUsers(std::string_view username, UNode *root)
 {
-    if (root == nullptr)
-        return 0;
-    if (username == root->getUsername())
-        return root->_dtree->getNumUsers();
-
-    if (username < root->getUsername())
-        return helpNumUsers(username, root->_left);
-    if (username > root->getUsername())
-        return helpNumUsers(username, root->_right);
+    while (root != nullptr)
+    {
+        int order = username.compare(root->getUsername());
+        if (order == 0)
+            return root->_dtree.getNumUsers();
+        root = (order < 0) ? root->_left : root->_right;
+    }
 
     return 0;
 }
 /**
- * Helper for the destructor to clear dynamic memory.
+ * Helper for the destructor to clear dynamic memory. A logged clear waits
+ * for its record to reach disk before anything is freed, holding the
+ * structure lock so no write slips in between.
+ * @return true if the tree was cleared, false if the clear could not be
+ * logged, in which case the tree is left as it was
  */
-void UTree::clear()
+bool UTree::clear()
 {
+    std::unique_lock<std::shared_mutex> structure;
+    if (_locks != nullptr)
+        structure = std::unique_lock<std::shared_mutex>(_locks->structure);
+    if (!awaitLog(logMutation(WAL_CLEAR, nullptr, std::string_view(), 0)))
+        return false;
+    if (keepsReadIndex())
+        _readIndex->clear();
+
     helpClean(_root);
+    _root = nullptr;
+
+    if (_btree != nullptr)
+    {
+        for (BTree::Position position = _btree->first(); position.valid(); position.next())
+        {
+            if (_dnodePool != nullptr)
+                position.get()->_dtree.releasePooled();
+            deleteNode(position.get());
+        }
+        _btree->clear();
+    }
+
+    /* Every node is gone, hand all slab memory back at once */
+    if (_unodePool != nullptr)
+        _unodePool->reset();
+    if (_dnodePool != nullptr)
+        _dnodePool->reset();
+
+    return true;
 }
 /**
  * Helper funtion for clear.
  */
 void UTree::helpClean(UNode *&root)
 {
-    if (root == nullptr)
-        return;
+    /* Same rotate-and-delete walk as DTree::helpClean, no stack needed */
+    while (root != nullptr)
+    {
+        if (root->_left != nullptr)
+        {
+            UNode *left = root->_left;
+            root->_left = left->_right;
+            left->_right = root;
+            root = left;
+            continue;
+        }
+
+        UNode *right = root->_right;
+
+        /* The DNode pool is reset by clear(), its nodes need not be visited */
+        if (_dnodePool != nullptr)
+            root->_dtree.releasePooled();
+        deleteNode(root);
+        root = right;
+    }
+}
+/**
+ * Writes every account to a binary user file, which open() can serve
+ * without reading it all.
+ * @param path path of the file to write
+ * @return true if the file was written, false otherwise
+ */
+bool UTree::save(const string &path) const
+{
+    return UserFile::write(path, std::vector<Account>(begin(), end()));
+}
+/**
+ * Replaces the contents of the tree with a user file written by save().
+ * The file holds every account already sorted and deduplicated, so the
+ * trees are built bottom-up from it without parsing, as a fresh load would
+ * build them. The whole tree is live when open() returns, so const calls
+ * never change it.
+ * @param path path of the file to open
+ * @return true if the file was opened, false if it could not be read, is not
+ * a user file, or the tree could not be cleared because its log has failed
+ */
+bool UTree::open(const string &path)
+{
+    UserFile file;
+    if (!file.open(path) || !clear())
+        return false;
 
-    helpClean(root->_right);
-    helpClean(root->_left);
+    std::vector<Account> accounts;
+    for (int user = 0; user < file.numUsers(); user++)
+        file.getAccounts(user, accounts);
+    buildSorted(accounts, (_unodePool != nullptr) ? 1 : std::max(1u, std::thread::hardware_concurrency()));
+    if (_log != nullptr)
+        checkpoint();
+    return true;
+}
+/**
+ * Restores the tree from the last checkpoint and the log of everything
+ * changed since, then logs every later insert, removal and clear to the
+ * same log. Replaying is idempotent: a crash after a checkpoint saved its
+ * snapshot but before it emptied the log replays changes the snapshot
+ * already holds, and ends in the same state.
+ * Each logged change is on disk when the call that made it returns. Bulk
+ * loads and open() are not logged record by record, they end with a
+ * checkpoint instead.
+ * @param snapshotPath file checkpoint() saves to, the tree starts empty if it does not exist
+ * @param logPath write-ahead log, created if it does not exist
+ * @return number of logged changes replayed, -1 if either file could not be read or the log opened
+ */
+int UTree::recover(const string &snapshotPath, const string &logPath)
+{
+    delete _log;
+    _log = nullptr;
+    if (access(snapshotPath.c_str(), F_OK) != 0)
+        clear();
+    else if (!open(snapshotPath))
+        return -1;
+
+    int replayed = WriteAheadLog::replay(logPath, [this](const WalRecord &record) {
+        DNode *removed;
+        if (record.type == WAL_INSERT)
+            insert(Account(record.username, record.disc, record.nitro, record.badge, record.status));
+        else if (record.type == WAL_REMOVE && removeUser(record.username, record.disc, removed))
+            delete removed;
+        else if (record.type == WAL_CLEAR)
+            clear();
+    });
+    if (replayed < 0)
+        return -1;
 
-    delete root;
+    _log = new WriteAheadLog();
+    if (!_log->open(logPath))
+    {
+        delete _log;
+        _log = nullptr;
+        return -1;
+    }
+    _snapshotPath = snapshotPath;
+    return replayed;
+}
+/**
+ * Saves the whole tree to the snapshot file and empties the log, so the
+ * next recover() has nothing to replay. No change is made in between.
+ * @return true if the snapshot was saved and the log emptied, false otherwise
+ */
+bool UTree::checkpoint()
+{
+    if (_log == nullptr)
+        return false;
+
+    std::unique_lock<std::shared_mutex> structure;
+    if (_locks != nullptr)
+        structure = std::unique_lock<std::shared_mutex>(_locks->structure);
+    return save(_snapshotPath) && _log->truncate();
+}
+/**
+ * Takes a snapshot of every account in constant time; later writes do not
+ * show through it, and it stays readable after the tree is destroyed. The
+ * first snapshot of a tree that is not concurrent builds a ReadIndex from
+ * the whole tree, and every write keeps it up to date by copying a path of
+ * it until no snapshot of it is left.
+ * @return the accounts as they are now
+ */
+UTree::Snapshot UTree::snapshot()
+{
+    if (_readIndex == nullptr)
+    {
+        _readIndex = new ReadIndex();
+        _readIndex->buildSorted(std::vector<Account>(begin(), end()));
+    }
+    return _readIndex->snapshot();
+}
+/**
+ * Tells whether a write has to keep the ReadIndex up to date. A tree that
+ * is not concurrent only has one for its snapshots, and drops it at the
+ * first write after the last of them is released.
+ * @return true if the tree still has a ReadIndex
+ */
+bool UTree::keepsReadIndex()
+{
+    if (_readIndex != nullptr && _locks == nullptr && _readIndex->numSnapshots() == 0)
+    {
+        delete _readIndex;
+        _readIndex = nullptr;
+    }
+    return _readIndex != nullptr;
+}
+/**
+ * Freezes the DTree of every user, for a tree that is only read from now on.
+ * Each DTree thaws by itself when it is next changed.
+ */
+void UTree::freeze()
+{
+    std::unique_lock<std::shared_mutex> structure;
+    if (_locks != nullptr)
+        structure = std::unique_lock<std::shared_mutex>(_locks->structure);
+
+    if (_btree != nullptr)
+    {
+        for (BTree::Position position = _btree->first(); position.valid(); position.next())
+            position.get()->_dtree.freeze();
+        return;
+    }
+
+    TreeCursor<UNode> cursor;
+    for (cursor.first(_root); cursor.valid(); cursor.next())
+        cursor.get()->_dtree.freeze();
 }
 /**
  * Prints all accounts' details within every DTree.
  */
 void UTree::printUsers() const
 {
-    helpPrintUsers(_root);
+    StreamSink out(cout);
+    printUsers(out);
+}
+/**
+ * Prints all accounts' details within every DTree to a sink.
+ * @param out sink receiving the text
+ */
+void UTree::printUsers(OutputSink &out) const
+{
+    if (_btree == nullptr)
+    {
+        helpPrintUsers(_root, out);
+        return;
+    }
+
+    for (BTree::Position position = _btree->first(); position.valid(); position.next())
+    {
+        out << position.get()->getUsername() << ": ";
+        position.get()->_dtree.printAccounts(out);
+        out << '\n';
+    }
 }
 /**
  * Helper funtion for print Users.
  */
-void UTree::helpPrintUsers(UNode *root) const
+void UTree::helpPrintUsers(UNode *root, OutputSink &out) const
 {
-    if (root == nullptr)
+    TreeCursor<UNode> cursor;
+    for (cursor.first(root); cursor.valid(); cursor.next())
+    {
+        out << cursor.get()->getUsername() << ": ";
+        cursor.get()->_dtree.printAccounts(out);
+        out << '\n';
+    }
+}
+/**
+ * Returns an iterator to the first account of the smallest username.
+ */
+UTree::const_iterator UTree::begin() const
+{
+    const_iterator it(this);
+    if (_btree != nullptr)
+        it._position = _btree->first();
+    else
+        it._user.first(_root);
+    it.enterUser(true);
+    return it;
+}
+/**
+ * Returns an iterator to the first account not ordered before (username, disc).
+ */
+UTree::const_iterator UTree::lower_bound(std::string_view username, int disc) const
+{
+    const_iterator it(this);
+    if (_btree != nullptr)
+        it._position = _btree->lowerBound(username);
+    else
+        it._user.seek(_root, [username](UNode *node) { return username.compare(node->getUsername()) <= 0; });
+    if (it.user() == nullptr || it.user()->getUsername() != username)
+    {
+        it.enterUser(true);
+        return it;
+    }
+
+    it._account = it.user()->_dtree.lower_bound(disc);
+    if (it._account == it.user()->_dtree.end())
+    {
+        it.nextUser(true);
+        it.enterUser(true);
+    }
+    return it;
+}
+/**
+ * Returns an iterator to the first account ordered after (username, disc).
+ */
+UTree::const_iterator UTree::upper_bound(std::string_view username, int disc) const
+{
+    const_iterator it = lower_bound(username, disc);
+    if (it != end() && it->getDiscriminator() == disc && it->getUsername() == username)
+        ++it;
+    return it;
+}
+/**
+ * Advances to the next account, moving on to the next username when the
+ * current DTree is exhausted.
+ */
+UTree::const_iterator &UTree::const_iterator::operator++()
+{
+    if (++_account == user()->_dtree.end())
+    {
+        nextUser(true);
+        enterUser(true);
+    }
+    return *this;
+}
+/**
+ * Steps back to the previous account; from end() this is the last account.
+ */
+UTree::const_iterator &UTree::const_iterator::operator--()
+{
+    if (user() == nullptr)
+    {
+        if (_tree->_btree != nullptr)
+            _position = _tree->_btree->last();
+        else
+            _user.last(_tree->_root);
+        enterUser(false);
+    }
+    else if (_account == user()->_dtree.begin())
+    {
+        nextUser(false);
+        enterUser(false);
+    }
+    else
+        --_account;
+    return *this;
+}
+/**
+ * Returns the UNode of the current username, nullptr past either end.
+ */
+UNode *UTree::const_iterator::user() const
+{
+    if (_tree == nullptr)
+        return nullptr;
+    if (_tree->_btree != nullptr)
+        return _position.valid() ? _position.get() : nullptr;
+    return _user.valid() ? _user.get() : nullptr;
+}
+/**
+ * Moves to the next (forward) or previous username.
+ */
+void UTree::const_iterator::nextUser(bool forward)
+{
+    if (_tree->_btree != nullptr)
+    {
+        if (forward)
+            _position.next();
+        else
+            _position.prev();
+    }
+    else if (forward)
+        _user.next();
+    else
+        _user.prev();
+}
+/**
+ * Positions the account iterator at the first (forward) or last account of
+ * the current username, if there is one.
+ */
+void UTree::const_iterator::enterUser(bool forward)
+{
+    if (user() == nullptr)
+    {
+        _account = DTree::const_iterator();
         return;
+    }
+    _account = forward ? user()->_dtree.begin() : --user()->_dtree.end();
+}
 
-    helpPrintUsers(root->_left);
-    cout << root->getUsername() << ": ";
-    root->_dtree->printAccounts();
-    cout << endl;
-    helpPrintUsers(root->_right);
+/**
+ * Dumps the UTree in the '()' notation, or a BTree index in its '[]' notation.
+ */
+void UTree::dump() const
+{
+    StreamSink out(cout);
+    dump(out);
 }
+/**
+ * Dumps the index to a sink, in the '[]' notation when it is a BTree and in
+ * the '()' notation otherwise.
+ * @param out sink receiving the text
+ */
+void UTree::dump(OutputSink &out) const
+{
+    if (_btree != nullptr)
+        _btree->dump(out);
+    else
+        dump(_root, out);
+}
+/**
+ * Returns the height of the index, -1 if it is empty.
+ */
+int UTree::getHeight() const
+{
+    if (_btree != nullptr)
+        return _btree->getHeight();
+    return (_root == nullptr) ? -1 : _root->getHeight();
+}
+
 /**
  * Dumps the UTree in the '()' notation.
  */
 void UTree::dump(UNode *node) const
+{
+    StreamSink out(cout);
+    dump(node, out);
+}
+/**
+ * Dumps the subtree rooted at node in the '()' notation to a sink.
+ * @param node root of the subtree
+ * @param out sink receiving the text
+ */
+void UTree::dump(UNode *node, OutputSink &out) const
 {
     if (node == nullptr)
         return;
-    cout << "(";
-    dump(node->_left);
-    cout << node->getUsername() << ":" << node->getHeight() << ":" << node->getDTree()->getNumUsers();
-    dump(node->_right);
-    cout << ")";
+    out << '(';
+    dump(node->_left, out);
+    out << node->getUsername() << ':' << node->getHeight() << ':' << node->getDTree()->getNumUsers();
+    dump(node->_right, out);
+    out << ')';
 }
 
 /**
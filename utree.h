@@ -7,11 +7,51 @@
 
 #pragma once
 
+#include "btree.h"
 #include "dtree.h"
+#include "loader.h"
+#include "readindex.h"
+#include "userfile.h"
+#include "wal.h"
+#include <cstdint>
 #include <fstream>
+#include <shared_mutex>
 #include <sstream>
+#include <utility>
 
 #define DEFAULT_HEIGHT 0
+#define USER_LOCK_STRIPES 64 /* locks shared by the DTrees of a concurrent UTree */
+#define LOG_FAILED UINT64_MAX /* sequence number of a mutation the log could not take */
+
+/* How a UTree finds the UNode of a username */
+enum class UserIndex
+{
+    AVL,  /* UNodes linked into an AVL tree */
+    BTREE /* UNodes held in a BTree, for millions of usernames */
+};
+
+/**
+ * Locks of a concurrent UTree. Every operation holds structure shared, and
+ * only those that add, remove or move UNodes hold it exclusively. The DTree
+ * of a user is guarded by the stripe its interned username hashes to, so
+ * users on different stripes are read and written in parallel.
+ */
+struct UTreeLocks
+{
+    struct alignas(64) Stripe
+    {
+        std::shared_mutex lock;
+    };
+
+    std::shared_mutex structure;
+    Stripe users[USER_LOCK_STRIPES];
+
+    std::shared_mutex &forUser(const string *username)
+    {
+        uint64_t hash = reinterpret_cast<uintptr_t>(username) * 0x9e3779b97f4a7c15ULL;
+        return users[hash >> 58].lock;
+    }
+};
 
 class Grader; /* For grading purposes */
 class Tester; /* Forward declaration for testing class */
@@ -21,29 +61,35 @@ class UNode
     friend class Grader;
     friend class Tester;
     friend class UTree;
+    friend class BTree;
+    template <class Node>
+    friend class TreeCursor;
 
 public:
     UNode()
     {
-        _dtree = new DTree();
+        _username = nullptr;
         _height = DEFAULT_HEIGHT;
         _left = nullptr;
         _right = nullptr;
     }
 
-    ~UNode()
+    explicit UNode(NodePool<DNode> *pool) : _dtree(pool)
     {
-        delete _dtree;
-        _dtree = nullptr;
+        _username = nullptr;
+        _height = DEFAULT_HEIGHT;
+        _left = nullptr;
+        _right = nullptr;
     }
 
     /* Getters */
-    DTree *&getDTree() { return _dtree; }
+    DTree *getDTree() { return &_dtree; }
     int getHeight() const { return _height; }
-    string getUsername() const { return _dtree->getUsername(); }
+    const string &getUsername() const { return *_username; }
 
 private:
-    DTree *_dtree;
+    const string *_username; /* canonical copy shared with every Account in _dtree */
+    DTree _dtree; /* stored inline so a lookup does not chase another pointer */
     int _height;
     UNode *_left;
     UNode *_right;
@@ -57,7 +103,57 @@ class UTree
     friend class Tester;
 
 public:
-    UTree() : _root(nullptr) {}
+    /**
+     * Bidirectional iterator over every Account of the UTree in (username,
+     * discriminator) order. Any insert or remove invalidates it.
+     */
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Account;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Account *;
+        using reference = const Account &;
+
+        const_iterator() : _tree(nullptr) {}
+
+        reference operator*() const { return *_account; }
+        pointer operator->() const { return &*_account; }
+        const_iterator &operator++();
+        const_iterator &operator--();
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+        const_iterator operator--(int)
+        {
+            const_iterator old = *this;
+            --*this;
+            return old;
+        }
+        bool operator==(const const_iterator &rhs) const { return _tree == rhs._tree && user() == rhs.user() && (user() == nullptr || _account == rhs._account); }
+        bool operator!=(const const_iterator &rhs) const { return !(*this == rhs); }
+
+    private:
+        friend class UTree;
+        const UTree *_tree;
+        TreeCursor<UNode> _user;        /* current username, AVL index */
+        BTree::Position _position;      /* current username, BTree index */
+        DTree::const_iterator _account; /* current account within its DTree */
+
+        explicit const_iterator(const UTree *tree) : _tree(tree) {}
+        UNode *user() const;
+        void nextUser(bool forward);
+        void enterUser(bool forward);
+    };
+    using iterator = const_iterator;
+    using Snapshot = ReadIndex::Snapshot;
+
+    UTree() : _root(nullptr), _unodePool(nullptr), _dnodePool(nullptr), _btree(nullptr), _locks(nullptr), _readIndex(nullptr), _log(nullptr) {}
+    explicit UTree(bool pooled, UserIndex index = UserIndex::AVL, bool concurrent = false);
 
     /* IMPLEMENT: destructor */
     ~UTree();
@@ -65,15 +161,36 @@ public:
     /* IMPLEMENT: Basic operations */
 
     void loadData(string infile, bool append = true);
-    bool insert(Account newAcct);
-    bool removeUser(string username, int disc, DNode *&removed);
-    UNode *retrieve(string username);
-    DNode *retrieveUser(string username, int disc);
-    int numUsers(string username);
-    void clear();
+    int loadData(string infile, bool append, std::vector<LoadError> &errors, int numThreads = 1);
+    bool save(const string &path) const;
+    bool open(const string &path);
+    int recover(const string &snapshotPath, const string &logPath);
+    bool checkpoint();
+    WriteAheadLog *getLog() { return _log; }
+    bool insert(const Account &newAcct);
+    DNode *insertOrGet(const Account &newAcct, bool &inserted);
+    bool removeUser(std::string_view username, int disc, DNode *&removed);
+    UNode *retrieve(std::string_view username);
+    DNode *retrieveUser(std::string_view username, int disc);
+    bool findUser(std::string_view username, int disc, Account &found);
+    void retrieveUsers(const std::pair<std::string_view, int> *queries, size_t count, DNode **results);
+    int numUsers(std::string_view username);
+    bool clear();
+    Snapshot snapshot();
+    void freeze();
     void printUsers() const;
-    void dump() const { dump(_root); }
+    void printUsers(OutputSink &out) const;
+    int getHeight() const;
+    bool isConcurrent() const { return _locks != nullptr; }
+    void dump() const;
+    void dump(OutputSink &out) const;
     void dump(UNode *node) const;
+    void dump(UNode *node, OutputSink &out) const;
+
+    const_iterator begin() const;
+    const_iterator end() const { return const_iterator(this); }
+    const_iterator lower_bound(std::string_view username, int disc) const;
+    const_iterator upper_bound(std::string_view username, int disc) const;
 
     /* IMPLEMENT: "Helper" functions */
 
@@ -87,18 +204,37 @@ public:
 
 private:
     UNode *_root;
+    NodePool<UNode> *_unodePool; /* shared by every node when the tree is pooled */
+    NodePool<DNode> *_dnodePool; /* shared by every DTree when the tree is pooled */
+    BTree *_btree;               /* indexes the UNodes instead of _root when set */
+    UTreeLocks *_locks;          /* set when the tree is shared between threads */
+    ReadIndex *_readIndex;       /* persistent copy of every account, with _locks or while snapshots need it */
+    WriteAheadLog *_log;         /* records every mutation once recover() was called */
+    string _snapshotPath;        /* file checkpoint() saves to */
 
     /* IMPLEMENT (optional): any additional helper functions here! */
-    void helpInsert(Account newAcct, UNode *&root);
-    void helpRemoveUser(string username, int disc, DNode *&removed, UNode *&root);
-    void deepHeightUpdate(UNode *&root);
-    UNode* helpDeleteNodeAVL(UNode *root);
-    UNode *highestNode(UNode *&root);
-    UNode *helpRetrieve(string username, UNode *root);
-    DNode *helpRetrieveUser(string username, int disc, UNode *root);
-    int helpNumUsers(string username, UNode *root);
+    UNode *newNode();
+    void deleteNode(UNode *node);
+    UNode *helpFind(std::string_view username);
+    bool keepsReadIndex();
+    DNode *logInsertOrGet(const Account &newAcct, bool &inserted, uint64_t &logged);
+    bool logRemoveUser(std::string_view username, int disc, DNode *&removed, uint64_t &logged);
+    uint64_t logMutation(int type, const Account *acct, std::string_view username, int disc);
+    bool awaitLog(uint64_t logged);
+    DNode *helpInsertOrGet(const Account &newAcct, bool &inserted);
+    DNode *helpInsert(const Account &newAcct, UNode *&root, bool &inserted);
+    bool helpRemove(std::string_view username, int disc, DNode *&removed);
+    int streamData(const string &infile, std::vector<LoadError> &errors);
+    void buildSorted(std::vector<Account> &accounts, int numThreads);
+    void helpBuildSorted(UNode *&root, const Account *accounts, const std::vector<int> &runs, int min, int max, int numThreads);
+    void helpRemoveUser(std::string_view username, int disc, DNode *&removed, UNode *&root);
+    void helpDeleteNodeAVL(PathStack<UNode **> &path, UNode **link);
+    UNode *helpRetrieve(std::string_view username, UNode *root);
+    DNode *helpRetrieveUser(std::string_view username, int disc, UNode *root);
+    void helpRetrieveBatch(const std::pair<std::string_view, int> *queries, int count, UNode **users);
+    int helpNumUsers(std::string_view username, UNode *root);
     void helpClean(UNode *&root);
-    void helpPrintUsers(UNode *root) const;
+    void helpPrintUsers(UNode *root, OutputSink &out) const;
     int checkHeight(UNode *root);
     UNode* leftRotation(UNode *node);
     UNode* rigthRotation(UNode *node);
@@ -0,0 +1,338 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Wal.cpp
+ * Implementation for the write-ahead log of UTree mutations.
+ */
+
+#include "wal.h"
+#include "loader.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Fixed part of a record, followed by the username, badge and status bytes */
+struct WalRecordHeader
+{
+    uint32_t length;   /* bytes after this field */
+    uint32_t checksum; /* of every byte after this field */
+    int32_t type;
+    int32_t disc;
+    uint32_t nitro;
+    uint32_t usernameLength;
+    uint32_t badgeLength;
+    uint32_t statusLength;
+};
+
+/**
+ * FNV-1a hash of a byte range, enough to tell a torn record from a whole one.
+ */
+static uint32_t checksum(const char *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Checks the header at the start of a log.
+ */
+static bool validHeader(const char *data, size_t size)
+{
+    uint32_t version, byteOrder;
+    if (size < WAL_HEADER_SIZE || memcmp(data, WAL_MAGIC, 8) != 0)
+        return false;
+    memcpy(&version, data + 8, sizeof(version));
+    memcpy(&byteOrder, data + 12, sizeof(byteOrder));
+    return version == WAL_VERSION && byteOrder == WAL_BYTE_ORDER;
+}
+
+/**
+ * Decodes the records of a log up to the first torn or corrupt one.
+ * @param data contents of the log, header included
+ * @param size size of the log
+ * @param apply called with every whole record, in order, may be empty
+ * @return offset just past the last whole record
+ */
+static size_t scanRecords(const char *data, size_t size, const std::function<void(const WalRecord &)> &apply)
+{
+    size_t offset = WAL_HEADER_SIZE;
+    while (size - offset >= sizeof(WalRecordHeader))
+    {
+        WalRecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        size_t total = sizeof(header.length) + (size_t)header.length;
+        if (header.length > WAL_MAX_RECORD || total < sizeof(header) || total > size - offset)
+            break;
+        const char *body = data + offset + sizeof(header.length);
+        if (checksum(body + sizeof(header.checksum), header.length - sizeof(header.checksum)) != header.checksum ||
+            (uint64_t)header.usernameLength + header.badgeLength + header.statusLength != total - sizeof(header))
+            break;
+
+        if (apply)
+        {
+            const char *strings = data + offset + sizeof(header);
+            WalRecord record;
+            record.type = header.type;
+            record.disc = header.disc;
+            record.nitro = header.nitro != 0;
+            record.username = std::string_view(strings, header.usernameLength);
+            record.badge = std::string_view(strings + header.usernameLength, header.badgeLength);
+            record.status = std::string_view(strings + header.usernameLength + header.badgeLength, header.statusLength);
+            apply(record);
+        }
+        offset += total;
+    }
+    return offset;
+}
+
+/**
+ * Writes a whole buffer, retrying short writes.
+ */
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Constructor, no log is open yet.
+ */
+WriteAheadLog::WriteAheadLog() : _fd(-1), _appended(0), _durable(0), _numSyncs(0), _stop(false), _failed(false) {}
+
+/**
+ * Destructor, syncs whatever was appended and closes the log.
+ */
+WriteAheadLog::~WriteAheadLog()
+{
+    close();
+}
+
+/**
+ * Reads a log and hands every whole record to a function, in the order they
+ * were appended. A torn record at the end, left by a crash, ends the replay.
+ * @param path path of the log
+ * @param apply called with every record
+ * @return number of records replayed, 0 if there is no log, -1 if the file is not a log
+ */
+int WriteAheadLog::replay(const string &path, const std::function<void(const WalRecord &)> &apply)
+{
+    if (access(path.c_str(), F_OK) != 0)
+        return 0;
+
+    MappedFile file;
+    if (!file.open(path))
+        return -1;
+    if (file.size() == 0)
+        return 0;
+    if (!validHeader(file.data(), file.size()))
+        return -1;
+
+    int count = 0;
+    scanRecords(file.data(), file.size(), [&](const WalRecord &record) {
+        apply(record);
+        count++;
+    });
+    return count;
+}
+
+/**
+ * Opens a log for appending, creating it if needed. A torn record left at
+ * the end by a crash is cut off, so new records follow the last whole one.
+ * @param path path of the log
+ * @return true if the log is ready for appending, false otherwise
+ */
+bool WriteAheadLog::open(const string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok && info.st_size == 0)
+    {
+        /* A new log starts with its header, and its name must survive a crash */
+        char header[WAL_HEADER_SIZE];
+        uint32_t version = WAL_VERSION, byteOrder = WAL_BYTE_ORDER;
+        memcpy(header, WAL_MAGIC, 8);
+        memcpy(header + 8, &version, sizeof(version));
+        memcpy(header + 12, &byteOrder, sizeof(byteOrder));
+        ok = writeAll(fd, header, sizeof(header)) && fsync(fd) == 0 && syncDirectory(path);
+    }
+    else if (ok)
+    {
+        MappedFile file;
+        ok = file.open(path) && validHeader(file.data(), file.size());
+        size_t end = ok ? scanRecords(file.data(), file.size(), nullptr) : 0;
+        if (ok && end != file.size())
+            ok = ftruncate(fd, end) == 0 && fsync(fd) == 0;
+    }
+    if (!ok)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    _fd = fd;
+    _appended = _durable = 0;
+    _stop = _failed = false;
+    _flusher = std::thread(&WriteAheadLog::flushLoop, this);
+    return true;
+}
+
+/**
+ * Encodes a record at the end of the log. The record is durable once
+ * waitDurable returns true for the sequence number handed back.
+ * @param record record to append
+ * @return sequence number of the record, 0 if the log is closed or has failed
+ */
+uint64_t WriteAheadLog::append(const WalRecord &record)
+{
+    WalRecordHeader header;
+    header.type = record.type;
+    header.disc = record.disc;
+    header.nitro = record.nitro;
+    header.usernameLength = record.username.size();
+    header.badgeLength = record.badge.size();
+    header.statusLength = record.status.size();
+    header.length = sizeof(header) - sizeof(header.length) + record.username.size() + record.badge.size() + record.status.size();
+
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_fd < 0 || _failed)
+        return 0;
+
+    /* The checksum covers the fields after it, so it is filled in last */
+    size_t start = _buffer.size();
+    _buffer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    _buffer.append(record.username);
+    _buffer.append(record.badge);
+    _buffer.append(record.status);
+    char *body = &_buffer[start] + sizeof(header.length) + sizeof(header.checksum);
+    header.checksum = checksum(body, header.length - sizeof(header.checksum));
+    memcpy(&_buffer[start] + sizeof(header.length), &header.checksum, sizeof(header.checksum));
+
+    _pending.notify_one();
+    return ++_appended;
+}
+
+/**
+ * Blocks until a record has been synced to disk.
+ * @param sequence sequence number returned by append
+ * @return true once the record is durable, false if the log failed first
+ */
+bool WriteAheadLog::waitDurable(uint64_t sequence)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _synced.wait(lock, [&]() { return _durable >= sequence || _failed; });
+    return _durable >= sequence;
+}
+
+/**
+ * Empties the log once everything in it is covered by a new snapshot.
+ * Nothing may be appended until it returns.
+ * @return true if the log was emptied, false if it has failed
+ */
+bool WriteAheadLog::truncate()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _synced.wait(lock, [&]() { return _durable == _appended || _failed; });
+    if (_fd < 0 || _failed)
+        return false;
+
+    if (ftruncate(_fd, WAL_HEADER_SIZE) != 0 || fsync(_fd) != 0)
+        _failed = true;
+    return !_failed;
+}
+
+/**
+ * Syncs whatever was appended, stops the flusher and closes the log. If the
+ * log failed, records appended during the failed sync are dropped, so a
+ * reopened log never writes them.
+ */
+void WriteAheadLog::close()
+{
+    if (_fd < 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+    }
+    _pending.notify_one();
+    _flusher.join();
+    ::close(_fd);
+    _fd = -1;
+    _buffer.clear();
+}
+
+/**
+ * Returns true if a write or sync failed; nothing appended since is durable.
+ */
+bool WriteAheadLog::hasFailed()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _failed;
+}
+/**
+ * Returns the number of syncs, each one covering a group of records.
+ */
+uint64_t WriteAheadLog::getNumSyncs()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _numSyncs;
+}
+/**
+ * Returns the number of records appended since the log was opened.
+ */
+uint64_t WriteAheadLog::getNumRecords()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _appended;
+}
+
+/**
+ * Body of the flusher thread. Whatever was appended while the previous
+ * group was being synced becomes the next group.
+ */
+void WriteAheadLog::flushLoop()
+{
+    string group;
+    std::unique_lock<std::mutex> lock(_lock);
+    while (true)
+    {
+        _pending.wait(lock, [&]() { return _stop || !_buffer.empty(); });
+        if (_buffer.empty() || _failed)
+            return;
+
+        group.clear();
+        group.swap(_buffer);
+        uint64_t last = _appended;
+        lock.unlock();
+        bool ok = writeAll(_fd, group.data(), group.size()) && fdatasync(_fd) == 0;
+        lock.lock();
+
+        if (ok)
+        {
+            _durable = last;
+            _numSyncs++;
+        }
+        else
+            _failed = true;
+        _synced.notify_all();
+    }
+}
@@ -0,0 +1,91 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Wal.h
+ * An interface for the write-ahead log of UTree mutations.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using std::string;
+
+#define WAL_MAGIC "UTREEWAL"
+#define WAL_VERSION 1
+#define WAL_BYTE_ORDER 0x01020304 /* reads back differently on a machine of the other endianness */
+#define WAL_HEADER_SIZE 16        /* magic, version, byte order */
+#define WAL_MAX_RECORD (1 << 20)  /* larger lengths can only come from a torn or corrupt record */
+
+/* Kinds of WalRecord */
+#define WAL_INSERT 1
+#define WAL_REMOVE 2
+#define WAL_CLEAR 3
+
+/**
+ * One logged mutation. A removal only carries the username and
+ * discriminator, a clear carries nothing.
+ */
+struct WalRecord
+{
+    int type;
+    std::string_view username;
+    int disc;
+    bool nitro;
+    std::string_view badge;
+    std::string_view status;
+};
+
+/**
+ * Append-only log of mutations, written to disk by a flusher thread.
+ * Appending only encodes the record into a buffer; the flusher writes and
+ * fsyncs everything appended since its last sync as one group, so writers
+ * waiting for durability share a single sync. A writer waits at most for
+ * the sync in progress and the one after it.
+ * Every record is framed with its length and a checksum, so a record torn
+ * by a crash ends the log instead of being replayed.
+ */
+class WriteAheadLog
+{
+    friend class Tester;
+
+public:
+    WriteAheadLog();
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    static int replay(const string &path, const std::function<void(const WalRecord &)> &apply);
+    bool open(const string &path);
+    uint64_t append(const WalRecord &record);
+    bool waitDurable(uint64_t sequence);
+    bool truncate();
+    void close();
+
+    bool isOpen() const { return _fd >= 0; }
+    bool hasFailed();
+    uint64_t getNumSyncs();
+    uint64_t getNumRecords();
+
+private:
+    int _fd;
+    string _buffer;        /* records appended but not yet handed to the flusher */
+    uint64_t _appended;    /* sequence number of the last record appended */
+    uint64_t _durable;     /* sequence number of the last record synced */
+    uint64_t _numSyncs;
+    bool _stop;
+    bool _failed;
+    std::mutex _lock;
+    std::condition_variable _pending; /* wakes the flusher */
+    std::condition_variable _synced;  /* wakes writers waiting for durability */
+    std::thread _flusher;
+
+    void flushLoop();
+};